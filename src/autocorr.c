@@ -0,0 +1,347 @@
+/*
+ * autocorr.c -- multi-lag autocorrelation of a bit stream
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "autocorr.h"
+
+/*
+ * The stream is kept as big-endian 64-bit words, with the lags / 64 + 1
+ * words before the new ones, so that word i shifted back by lag
+ * k = 64q + r is (w[i - q - 1] << (64 - r)) | (w[i - q] >> r), and
+ * popcount(w[i] ^ that) are the bits of word i differing from the ones
+ * k before them.  Lags are done 4 at a time, which share q and so the
+ * loads, and only words with all their bits k bits into the stream
+ * count.
+ *
+ * The kernels are built with target attributes, so the rest of librngd
+ * doesn't need any -m flags, and picked by autocorr_new() at run time:
+ * AVX-512 with its vector popcount, AVX2 counting bits per byte with a
+ * pshufb nibble table, or plain C.
+ */
+#define AUTOCORR_INLINE static inline __attribute__((always_inline))
+#if defined(__x86_64__) || defined(__i386__)
+#define AUTOCORR_TARGET_AVX2   __attribute__((target("avx2,popcnt")))
+#define AUTOCORR_TARGET_AVX512 \
+	__attribute__((target("avx512f,avx512vpopcntdq,avx2,popcnt")))
+#endif
+
+#define AUTOCORR_CHUNK		1024	/* Words compared at a time */
+
+/* Adds the differing bits of n words at lags k to k + 3 to differ[] */
+typedef void (*autocorr_fn)(const uint64_t *w, size_t n, unsigned int k,
+			    uint64_t *differ);
+
+struct autocorr_ctx {
+	unsigned int lags;
+	unsigned int hist;		/* Words kept, lags / 64 + 1 */
+	unsigned int fill;		/* Bytes after them */
+	uint64_t words;			/* Words of the stream compared */
+	uint64_t *w;			/* hist + AUTOCORR_CHUNK words */
+	uint64_t *differ;		/* Per lag, from 0 */
+	autocorr_fn fn;
+};
+
+/* Bits of c differing at lags k to k + 3, a and b the words before it */
+AUTOCORR_INLINE void autocorr_word(uint64_t a, uint64_t b, uint64_t c,
+				   unsigned int r, uint64_t *d)
+{
+	unsigned int l;
+
+	/* r + l is 0 to 63, and << 1 << 63 clears the word */
+	for (l = 0; l < 4; l++)
+		d[l] += __builtin_popcountll(c ^ (a << 1 << (63 - r - l)) ^
+					     (b >> (r + l)));
+}
+
+static void autocorr_generic(const uint64_t *w, size_t n, unsigned int k,
+			     uint64_t *differ)
+{
+	const uint64_t *p = w - k / 64 - 1;
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		autocorr_word(p[i], p[i + 1], w[i], k % 64, differ);
+}
+
+#ifdef AUTOCORR_TARGET_AVX2
+/* Per-byte popcount */
+AUTOCORR_INLINE AUTOCORR_TARGET_AVX2 __m256i autocorr_popcnt8_avx2(__m256i v)
+{
+	const __m256i lut = _mm256_setr_epi8(
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i mask = _mm256_set1_epi8(0x0f);
+
+	return _mm256_add_epi8(
+		_mm256_shuffle_epi8(lut, _mm256_and_si256(v, mask)),
+		_mm256_shuffle_epi8(lut, _mm256_and_si256(
+				_mm256_srli_epi16(v, 4), mask)));
+}
+
+/* Up to 31 vectors of per-byte counts (8 max) fit in a byte counter */
+#define AUTOCORR_AVX2_FLUSH 31
+
+static AUTOCORR_TARGET_AVX2 void autocorr_avx2(const uint64_t *w, size_t n,
+					       unsigned int k,
+					       uint64_t *differ)
+{
+	const uint64_t *p = w - k / 64 - 1;
+	const unsigned int r = k % 64;
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc8[4], acc64[4], sl[4], sr[4], a, b, c, x;
+	uint64_t lane[4];
+	unsigned int l, m = 0;
+	size_t i;
+
+	/* shifts by 64 clear the lanes */
+	for (l = 0; l < 4; l++) {
+		sl[l] = _mm256_set1_epi64x(64 - r - l);
+		sr[l] = _mm256_set1_epi64x(r + l);
+		acc8[l] = acc64[l] = zero;
+	}
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		a = _mm256_loadu_si256((const __m256i *)(p + i));
+		b = _mm256_loadu_si256((const __m256i *)(p + i + 1));
+		c = _mm256_loadu_si256((const __m256i *)(w + i));
+		for (l = 0; l < 4; l++) {
+			x = _mm256_xor_si256(c, _mm256_or_si256(
+					_mm256_sllv_epi64(a, sl[l]),
+					_mm256_srlv_epi64(b, sr[l])));
+			acc8[l] = _mm256_add_epi8(acc8[l],
+					autocorr_popcnt8_avx2(x));
+		}
+		if (++m == AUTOCORR_AVX2_FLUSH) {
+			for (l = 0; l < 4; l++) {
+				acc64[l] = _mm256_add_epi64(acc64[l],
+					_mm256_sad_epu8(acc8[l], zero));
+				acc8[l] = zero;
+			}
+			m = 0;
+		}
+	}
+	for (l = 0; l < 4; l++) {
+		acc64[l] = _mm256_add_epi64(acc64[l],
+				_mm256_sad_epu8(acc8[l], zero));
+		_mm256_storeu_si256((__m256i *)lane, acc64[l]);
+		differ[l] += lane[0] + lane[1] + lane[2] + lane[3];
+	}
+	for (; i < n; i++)
+		autocorr_word(p[i], p[i + 1], w[i], r, differ);
+}
+
+static AUTOCORR_TARGET_AVX512 void autocorr_avx512(const uint64_t *w,
+						   size_t n, unsigned int k,
+						   uint64_t *differ)
+{
+	const uint64_t *p = w - k / 64 - 1;
+	const unsigned int r = k % 64;
+	__m512i acc[4], sl[4], sr[4], a, b, c, x;
+	unsigned int l;
+	size_t i;
+
+	for (l = 0; l < 4; l++) {
+		sl[l] = _mm512_set1_epi64(64 - r - l);
+		sr[l] = _mm512_set1_epi64(r + l);
+		acc[l] = _mm512_setzero_si512();
+	}
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		a = _mm512_loadu_si512(p + i);
+		b = _mm512_loadu_si512(p + i + 1);
+		c = _mm512_loadu_si512(w + i);
+		for (l = 0; l < 4; l++) {
+			/* the shifted halves don't overlap: c ^ hi ^ lo */
+			x = _mm512_ternarylogic_epi64(c,
+					_mm512_sllv_epi64(a, sl[l]),
+					_mm512_srlv_epi64(b, sr[l]), 0x96);
+			acc[l] = _mm512_add_epi64(acc[l],
+					_mm512_popcnt_epi64(x));
+		}
+	}
+	for (l = 0; l < 4; l++)
+		differ[l] += _mm512_reduce_add_epi64(acc[l]);
+	for (; i < n; i++)
+		autocorr_word(p[i], p[i + 1], w[i], r, differ);
+}
+#endif
+
+autocorr_ctx_t *autocorr_new(unsigned int lags)
+{
+	autocorr_ctx_t *ctx;
+
+	if ((lags < 1) || (lags > AUTOCORR_MAX_LAGS)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+	ctx->lags = lags;
+	ctx->hist = lags / 64 + 1;
+	ctx->w = calloc(ctx->hist + AUTOCORR_CHUNK, sizeof(*ctx->w));
+	/* lags 0 to lags, rounded up to groups of 4 */
+	ctx->differ = calloc(lags / 4 * 4 + 4, sizeof(*ctx->differ));
+	if (!ctx->w || !ctx->differ) {
+		autocorr_free(ctx);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	ctx->fn = autocorr_generic;
+#ifdef AUTOCORR_TARGET_AVX2
+	if (__builtin_cpu_supports("avx512vpopcntdq"))
+		ctx->fn = autocorr_avx512;
+	else if (__builtin_cpu_supports("avx2"))
+		ctx->fn = autocorr_avx2;
+#endif
+	return ctx;
+}
+
+void autocorr_free(autocorr_ctx_t *ctx)
+{
+	if (!ctx)
+		return;
+	free(ctx->w);
+	free(ctx->differ);
+	free(ctx);
+}
+
+static inline uint64_t load_be64(const unsigned char *p)
+{
+	uint64_t x;
+
+	memcpy(&x, p, sizeof(x));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	x = __builtin_bswap64(x);
+#endif
+	return x;
+}
+
+/* Compares the whole words of the bytes after the history, keeps the rest */
+static void autocorr_words(autocorr_ctx_t *ctx)
+{
+	uint64_t *w = ctx->w + ctx->hist;
+	unsigned char *bytes = (unsigned char *)w;
+	size_t i, n = ctx->fill / 8, skip;
+	unsigned int k;
+
+	for (i = 0; i < n; i++)
+		w[i] = load_be64(bytes + i * 8);
+
+	for (k = 0; k <= ctx->lags; k += 4) {
+		/* the first words have no bits k before them */
+		skip = 0;
+		if (ctx->words < k / 64 + 1)
+			skip = k / 64 + 1 - ctx->words;
+		if (skip >= n)
+			break;
+		ctx->fn(w + skip, n - skip, k, ctx->differ + k);
+	}
+
+	ctx->words += n;
+	memmove(ctx->w, ctx->w + n, ctx->hist * sizeof(*ctx->w));
+	memmove(bytes, bytes + n * 8, ctx->fill % 8);
+	ctx->fill %= 8;
+}
+
+int autocorr_update(autocorr_ctx_t *ctx, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	size_t take;
+
+	if (!ctx)
+		return -1;
+	if (!buf)
+		return -1;
+
+	while (len) {
+		take = AUTOCORR_CHUNK * 8 - ctx->fill;
+		if (take > len)
+			take = len;
+		memcpy((unsigned char *)(ctx->w + ctx->hist) + ctx->fill,
+		       p, take);
+		ctx->fill += take;
+		p += take;
+		len -= take;
+		if (ctx->fill >= 8)
+			autocorr_words(ctx);
+	}
+	return 0;
+}
+
+double autocorr_zscore(const autocorr_ctx_t *ctx, unsigned int lag)
+{
+	uint64_t bits;
+
+	if (!ctx || (lag < 1) || (lag > ctx->lags) ||
+	    (ctx->words <= lag / 64 + 1))
+		return 0.0;
+	bits = (ctx->words - lag / 64 - 1) * 64;
+	return ((double)bits - 2.0 * ctx->differ[lag]) / sqrt(bits);
+}
+
+int autocorr_summarize(const autocorr_ctx_t *ctx, double threshold,
+		       autocorr_summary_t *summary)
+{
+	unsigned int k, i;
+	double z;
+
+	if (!ctx)
+		return -1;
+	if (!summary)
+		return -1;
+
+	memset(summary, 0, sizeof(*summary));
+	summary->lags = ctx->lags;
+	if (ctx->words > 1)
+		summary->bits = (ctx->words - 1) * 64;
+	for (k = 1; k <= ctx->lags; k++) {
+		z = autocorr_zscore(ctx, k);
+		if (fabs(z) >= threshold)
+			summary->alerts++;
+
+		/* insert it, largest |z| first */
+		i = summary->top;
+		if (i == AUTOCORR_TOP) {
+			if (fabs(z) <= fabs(summary->lag[i - 1].z))
+				continue;
+			i--;
+		} else {
+			summary->top++;
+		}
+		for (; i && (fabs(summary->lag[i - 1].z) < fabs(z)); i--)
+			summary->lag[i] = summary->lag[i - 1];
+		summary->lag[i].lag = k;
+		summary->lag[i].z = z;
+	}
+	return 0;
+}
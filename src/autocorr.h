@@ -0,0 +1,78 @@
+/*
+ * autocorr.h -- multi-lag autocorrelation of a bit stream
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef AUTOCORR__H
+#define AUTOCORR__H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Compares every bit of a stream, taken most significant bit first,
+ * with the bits 1 to lags before it, across the whole stream.  With N
+ * bits compared at lag k and D of them differing, the z-score of the
+ * lag is (N - 2D) / sqrt(N), standard normal for independent bits,
+ * positive when bits tend to repeat the one k before them, negative
+ * when they tend to flip it.
+ */
+#define AUTOCORR_MAX_LAGS	8192
+#define AUTOCORR_TOP		16	/* Lags kept by autocorr_summarize() */
+
+typedef struct autocorr_ctx autocorr_ctx_t;
+
+struct autocorr_lag {
+	unsigned int lag;
+	double z;
+};
+
+typedef struct autocorr_summary {
+	unsigned int lags;		/* Lags tracked, 1 to lags */
+	uint64_t bits;			/* Bits compared at lag 1 */
+	unsigned int alerts;		/* Lags at or over the threshold */
+	unsigned int top;		/* Lags in lag[] */
+	struct autocorr_lag lag[AUTOCORR_TOP];	/* Largest |z| first */
+} autocorr_summary_t;
+
+/*
+ * A context tracking lags 1 to lags, at most AUTOCORR_MAX_LAGS.
+ * Returns NULL with errno set, EINVAL if lags is out of range.
+ */
+extern autocorr_ctx_t *autocorr_new(unsigned int lags);
+extern void autocorr_free(autocorr_ctx_t *ctx);
+
+/*
+ *  Adds len more bytes of buf to the stream.  Bits are compared a 64-bit
+ *  word at a time, so the last len % 8 bytes wait for the next call.
+ *
+ *  This function returns 0, or -1 if ctx or buf is NULL.
+ */
+extern int autocorr_update(autocorr_ctx_t *ctx, const void *buf, size_t len);
+
+/* The z-score of lag, 0 until bits were compared at that lag */
+extern double autocorr_zscore(const autocorr_ctx_t *ctx, unsigned int lag);
+
+/*
+ *  Fills summary with the lags of largest |z|, and counts the lags with
+ *  |z| at or over threshold.
+ *
+ *  This function returns 0, or -1 if ctx or summary is NULL.
+ */
+extern int autocorr_summarize(const autocorr_ctx_t *ctx, double threshold,
+			      autocorr_summary_t *summary);
+
+#endif /* AUTOCORR__H */
@@ -0,0 +1,364 @@
+/*
+ * dft.c -- NIST SP 800-22 discrete Fourier transform test
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "dft.h"
+
+/*
+ * The n bits of a window, as +1 and -1, are taken as n / 2 complex
+ * points, even bits real and odd bits imaginary.  Their FFT is a
+ * Stockham radix-4 one, with a radix-2 stage first if needs be,
+ * ping-ponging between two buffers with the real and imaginary parts
+ * apart, so every stage reads and writes in order and its butterflies
+ * are done 4 at a time.  The spectrum of the bits is split out of it at
+ * the end (Numerical Recipes 12.3).
+ *
+ * The FFT is built twice, with and without AVX2, which dft_new() picks
+ * from at run time, so the rest of librngd doesn't need any -m flags.
+ */
+#define DFT_INLINE static inline __attribute__((always_inline))
+#if defined(__x86_64__) || defined(__i386__)
+#define DFT_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+#define DFT_ALIGN		64
+
+typedef double dft_v4 __attribute__((vector_size(4 * sizeof(double))));
+
+struct dft_ctx;
+typedef unsigned int (*dft_fft_fn)(struct dft_ctx *ctx);
+
+struct dft_ctx {
+	uint64_t length;		/* Bits per window */
+	unsigned int n;			/* Complex points, length / 2 */
+	unsigned int fill;		/* Bytes of the window seen */
+	double threshold;		/* Of the squared magnitudes */
+	double *re[2], *im[2];		/* Ping-pong buffers */
+	double *twr, *twi;		/* See dft_fft_body() */
+	double *spr, *spi;		/* exp(-i pi j / n), j < n / 2 */
+	dft_fft_fn fft;
+};
+
+/* Per byte: its even and odd bits, as +1 and -1 */
+static double bits_tab[256][2][4];
+
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static void init_tables(void)
+{
+	unsigned int b, i;
+
+	for (b = 0; b < 256; b++)
+		for (i = 0; i < 4; i++) {
+			bits_tab[b][0][i] = ((b >> (7 - 2 * i)) & 1) ? 1.0 : -1.0;
+			bits_tab[b][1][i] = ((b >> (6 - 2 * i)) & 1) ? 1.0 : -1.0;
+		}
+}
+
+/* Not functions: vectors passed by value would change the ABI */
+#define DFT_LOAD(v, p)		memcpy(&(v), (p), sizeof(dft_v4))
+#define DFT_STORE(p, v)		memcpy((p), &(v), sizeof(dft_v4))
+
+/*
+ * A stage of radix R after sub-transforms of size h takes x[j + r n / R]
+ * for r < R, j = g h + k and k < h, turns them by w^(r k), w = exp(-2 pi
+ * i / R h), and puts their R-point DFT in y[g R h + k + r h].  The
+ * turns of a radix-4 stage are at tw[r h + k], r from 1 to 3.
+ */
+#define DFT_MUL(ar, ai, br, bi, wr, wi)				\
+	do {							\
+		(ar) = (br) * (wr) - (bi) * (wi);		\
+		(ai) = (br) * (wi) + (bi) * (wr);		\
+	} while (0)
+
+#define DFT_RADIX4(T, xr, xi, yr, yi, j, o, q, h, twr, twi, k, LOAD, STORE) \
+	do {								\
+		T a0r, a0i, a1r, a1i, a2r, a2i, a3r, a3i, br, bi, wr, wi; \
+		T t0r, t0i, t1r, t1i, t2r, t2i, t3r, t3i, v;		\
+									\
+		LOAD(a0r, xr + (j));					\
+		LOAD(a0i, xi + (j));					\
+		LOAD(br, xr + (j) + (q));				\
+		LOAD(bi, xi + (j) + (q));				\
+		LOAD(wr, twr + (h) + (k));				\
+		LOAD(wi, twi + (h) + (k));				\
+		DFT_MUL(a1r, a1i, br, bi, wr, wi);			\
+		LOAD(br, xr + (j) + 2 * (q));				\
+		LOAD(bi, xi + (j) + 2 * (q));				\
+		LOAD(wr, twr + 2 * (h) + (k));				\
+		LOAD(wi, twi + 2 * (h) + (k));				\
+		DFT_MUL(a2r, a2i, br, bi, wr, wi);			\
+		LOAD(br, xr + (j) + 3 * (q));				\
+		LOAD(bi, xi + (j) + 3 * (q));				\
+		LOAD(wr, twr + 3 * (h) + (k));				\
+		LOAD(wi, twi + 3 * (h) + (k));				\
+		DFT_MUL(a3r, a3i, br, bi, wr, wi);			\
+									\
+		/* (a1 - a3) is turned by -i */				\
+		t0r = a0r + a2r;					\
+		t0i = a0i + a2i;					\
+		t1r = a0r - a2r;					\
+		t1i = a0i - a2i;					\
+		t2r = a1r + a3r;					\
+		t2i = a1i + a3i;					\
+		t3r = a1i - a3i;					\
+		t3i = a3r - a1r;					\
+		v = t0r + t2r;						\
+		STORE(yr + (o), v);					\
+		v = t0i + t2i;						\
+		STORE(yi + (o), v);					\
+		v = t1r + t3r;						\
+		STORE(yr + (o) + (h), v);				\
+		v = t1i + t3i;						\
+		STORE(yi + (o) + (h), v);				\
+		v = t0r - t2r;						\
+		STORE(yr + (o) + 2 * (h), v);				\
+		v = t0i - t2i;						\
+		STORE(yi + (o) + 2 * (h), v);				\
+		v = t1r - t3r;						\
+		STORE(yr + (o) + 3 * (h), v);				\
+		v = t1i - t3i;						\
+		STORE(yi + (o) + 3 * (h), v);				\
+	} while (0)
+
+#define DFT_LOAD1(v, p)		((v) = *(p))
+#define DFT_STORE1(p, v)	(*(p) = (v))
+
+/* Returns the buffer with the result */
+DFT_INLINE unsigned int dft_fft_body(struct dft_ctx *ctx)
+{
+	const unsigned int n = ctx->n, q = n / 4;
+	const double *xr, *xi;
+	double *yr, *yi, ar, ai, br, bi;
+	unsigned int h = 1, g, k, x = 0;
+
+	/* radix 2, with no turns */
+	if (__builtin_ctz(n) & 1) {
+		xr = ctx->re[0];
+		xi = ctx->im[0];
+		yr = ctx->re[1];
+		yi = ctx->im[1];
+		for (g = 0; g < n / 2; g++) {
+			ar = xr[g];
+			ai = xi[g];
+			br = xr[g + n / 2];
+			bi = xi[g + n / 2];
+			yr[2 * g] = ar + br;
+			yi[2 * g] = ai + bi;
+			yr[2 * g + 1] = ar - br;
+			yi[2 * g + 1] = ai - bi;
+		}
+		h = 2;
+		x = 1;
+	}
+
+	for (; h < n; h *= 4, x = !x) {
+		xr = ctx->re[x];
+		xi = ctx->im[x];
+		yr = ctx->re[!x];
+		yi = ctx->im[!x];
+		if (h < 4) {
+			for (g = 0; g < q / h; g++)
+				for (k = 0; k < h; k++)
+					DFT_RADIX4(double, xr, xi, yr, yi,
+						   g * h + k, 4 * g * h + k, q,
+						   h, ctx->twr, ctx->twi, k,
+						   DFT_LOAD1, DFT_STORE1);
+			continue;
+		}
+		for (g = 0; g < q / h; g++)
+			for (k = 0; k < h; k += 4)
+				DFT_RADIX4(dft_v4, xr, xi, yr, yi,
+					   g * h + k, 4 * g * h + k, q,
+					   h, ctx->twr, ctx->twi, k,
+					   DFT_LOAD, DFT_STORE);
+	}
+	return x;
+}
+
+static unsigned int dft_fft_generic(struct dft_ctx *ctx)
+{
+	return dft_fft_body(ctx);
+}
+
+#ifdef DFT_TARGET_AVX2
+static DFT_TARGET_AVX2 unsigned int dft_fft_avx2(struct dft_ctx *ctx)
+{
+	return dft_fft_body(ctx);
+}
+#endif
+
+static void *dft_alloc(size_t n)
+{
+	void *p;
+
+	if (posix_memalign(&p, DFT_ALIGN, n * sizeof(double)))
+		return NULL;
+	return p;
+}
+
+dft_ctx_t *dft_new(uint64_t length)
+{
+	dft_ctx_t *ctx;
+	unsigned int n, h, r, k, i;
+
+	if ((length < DFT_MIN_LENGTH) || (length > DFT_MAX_LENGTH) ||
+	    (length & (length - 1))) {
+		errno = EINVAL;
+		return NULL;
+	}
+	pthread_once(&tables_once, init_tables);
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+	ctx->length = length;
+	ctx->n = n = length / 2;
+	ctx->threshold = log(1.0 / 0.05) * length;
+	for (i = 0; i < 2; i++) {
+		ctx->re[i] = dft_alloc(n);
+		ctx->im[i] = dft_alloc(n);
+	}
+	ctx->twr = dft_alloc(n);
+	ctx->twi = dft_alloc(n);
+	ctx->spr = dft_alloc(n / 2);
+	ctx->spi = dft_alloc(n / 2);
+	if (!ctx->re[0] || !ctx->im[0] || !ctx->re[1] || !ctx->im[1] ||
+	    !ctx->twr || !ctx->twi || !ctx->spr || !ctx->spi) {
+		dft_free(ctx);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	for (h = (__builtin_ctz(n) & 1) ? 2 : 1; h < n; h *= 4)
+		for (r = 1; r < 4; r++)
+			for (k = 0; k < h; k++) {
+				ctx->twr[r * h + k] = cos(M_PI * r * k / (2 * h));
+				ctx->twi[r * h + k] = -sin(M_PI * r * k / (2 * h));
+			}
+	for (k = 0; k < n / 2; k++) {
+		ctx->spr[k] = cos(M_PI * k / n);
+		ctx->spi[k] = -sin(M_PI * k / n);
+	}
+
+	ctx->fft = dft_fft_generic;
+#ifdef DFT_TARGET_AVX2
+	if (__builtin_cpu_supports("avx2"))
+		ctx->fft = dft_fft_avx2;
+#endif
+	return ctx;
+}
+
+void dft_free(dft_ctx_t *ctx)
+{
+	unsigned int i;
+
+	if (!ctx)
+		return;
+	for (i = 0; i < 2; i++) {
+		free(ctx->re[i]);
+		free(ctx->im[i]);
+	}
+	free(ctx->twr);
+	free(ctx->twi);
+	free(ctx->spr);
+	free(ctx->spi);
+	free(ctx);
+}
+
+/*
+ * With Z the FFT of the complex points, E = (Z[j] + conj(Z[n - j])) / 2
+ * and O = (Z[j] - conj(Z[n - j])) / 2i, the spectrum of the bits is
+ * E + W O at j, and conj(E - W O) at n - j, with W = exp(-i pi j / n).
+ * The P-value is that of the number of peaks below the threshold
+ * that 95% of them stay under.
+ */
+static double dft_window(dft_ctx_t *ctx)
+{
+	const unsigned int n = ctx->n;
+	const double *zr, *zi, *spr = ctx->spr, *spi = ctx->spi;
+	const double t = ctx->threshold;
+	double er, ei, odr, odi, pr, pi, n0, d;
+	unsigned int j, c, x, below = 0;
+
+	x = ctx->fft(ctx);
+	zr = ctx->re[x];
+	zi = ctx->im[x];
+
+	/* at 0 and n / 2, E and O are real and W is 1 and -i */
+	below = ((zr[0] + zi[0]) * (zr[0] + zi[0]) < t) +
+		(zr[n / 2] * zr[n / 2] + zi[n / 2] * zi[n / 2] < t);
+	for (j = 1; j < n / 2; j++) {
+		c = n - j;
+		er = 0.5 * (zr[j] + zr[c]);
+		ei = 0.5 * (zi[j] - zi[c]);
+		odr = 0.5 * (zi[j] + zi[c]);
+		odi = 0.5 * (zr[c] - zr[j]);
+		pr = spr[j] * odr - spi[j] * odi;
+		pi = spr[j] * odi + spi[j] * odr;
+		below += (er + pr) * (er + pr) + (ei + pi) * (ei + pi) < t;
+		below += (er - pr) * (er - pr) + (ei - pi) * (ei - pi) < t;
+	}
+
+	n0 = 0.95 * ctx->length / 2.0;
+	d = (below - n0) / sqrt(ctx->length * 0.95 * 0.05 / 4.0);
+	return erfc(fabs(d) / M_SQRT2);
+}
+
+int dft_update(dft_ctx_t *ctx, const void *buf, size_t len,
+	       double *pvalues)
+{
+	const unsigned char *p = buf;
+	unsigned int i, n, bytes;
+	int windows = 0;
+
+	if (!ctx) return -1;
+	if (!buf) return -1;
+	if (!pvalues) return -1;
+	bytes = ctx->length / 8;
+
+	while (len) {
+		n = bytes - ctx->fill;
+		if (n > len)
+			n = len;
+		for (i = 0; i < n; i++) {
+			memcpy(ctx->re[0] + 4 * (ctx->fill + i),
+			       bits_tab[p[i]][0], sizeof(bits_tab[0][0]));
+			memcpy(ctx->im[0] + 4 * (ctx->fill + i),
+			       bits_tab[p[i]][1], sizeof(bits_tab[0][1]));
+		}
+		ctx->fill += n;
+		p += n;
+		len -= n;
+		if (ctx->fill == bytes) {
+			pvalues[windows++] = dft_window(ctx);
+			ctx->fill = 0;
+		}
+	}
+
+	return windows;
+}
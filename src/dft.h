@@ -0,0 +1,56 @@
+/*
+ * dft.h -- NIST SP 800-22 discrete Fourier transform test
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DFT__H
+#define DFT__H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The spectral test of SP 800-22 rev. 1a (2.6), run on back-to-back
+ * windows of n bits of a stream, n a power of two, taken most
+ * significant bit first.  It finds the peaks that a periodic pattern
+ * leaves in the spectrum of a window.  A window takes about 28 bytes
+ * of memory per bit.
+ */
+#define DFT_MIN_LENGTH		(1 << 10)
+#define DFT_MAX_LENGTH		(1 << 20)
+
+/*
+ * A context testing windows of length bits, a power of two from
+ * DFT_MIN_LENGTH to DFT_MAX_LENGTH.  Returns NULL with errno set,
+ * EINVAL if length is out of range.
+ */
+typedef struct dft_ctx dft_ctx_t;
+
+extern dft_ctx_t *dft_new(uint64_t length);
+extern void dft_free(dft_ctx_t *ctx);
+
+/*
+ *  Runs the test on len more bytes of buf, storing the P-value of every
+ *  window completed in pvalues[], which must have room for
+ *  len * 8 / length + 1 of them.
+ *
+ *  This function returns the number of windows completed, or -1 if
+ *  ctx, buf or pvalues is NULL.
+ */
+extern int dft_update(dft_ctx_t *ctx, const void *buf, size_t len,
+		      double *pvalues);
+
+#endif /* DFT__H */
@@ -0,0 +1,351 @@
+/*
+ * entropy.c -- SP 800-90B min-entropy estimators
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "entropy.h"
+
+const struct entropy_estimator entropy_estimators[N_ENTROPY_ESTIMATORS] = {
+	[ENTROPY_MCV] = { "mcv", "SP 800-90B Most common value" },
+	[ENTROPY_COLLISION] = { "collision", "SP 800-90B Collision" },
+	[ENTROPY_MARKOV] = { "markov", "SP 800-90B Markov" },
+	[ENTROPY_COMPRESSION] = { "compression", "SP 800-90B Compression" },
+};
+
+/* Upper bound of the 99% confidence interval, as SP 800-90B has it */
+#define Z_ALPHA		2.576
+
+/*
+ * Collisions, a byte at a time: from any state (0: no bit of a
+ * collision yet, 1 and 2: a 0 or a 1, 3: two different bits) and byte,
+ * the collisions after 2 bits (bits 0-2), after 3 bits (bits 3-4), and
+ * the next state (bits 5-6).
+ */
+static uint8_t collision_tab[4][256];
+
+/* log2 of the distances short enough to look up */
+#define LOG2_TAB_SIZE	4096
+static double log2_tab[LOG2_TAB_SIZE];
+
+/*
+ * The mean log2 distance of the compression estimate, for blocks of
+ * min-entropy 6k/EXPECT_GRID bits.  It only depends on the window, so
+ * it is worked out once, and interpolated.
+ */
+#define EXPECT_GRID	128
+static double expect_tab[EXPECT_GRID + 1];
+
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static void init_collision_tab(void)
+{
+	unsigned int s, b, i, st, bit, n2, n3;
+
+	for (s = 0; s < 4; s++)
+		for (b = 0; b < 256; b++) {
+			st = s;
+			n2 = n3 = 0;
+			for (i = 0; i < 8; i++) {
+				bit = (b >> (7 - i)) & 1;
+				if (!st) {
+					st = 1 + bit;
+				} else if (st == 3) {
+					n3++;
+					st = 0;
+				} else if (st == 1 + bit) {
+					n2++;
+					st = 0;
+				} else {
+					st = 3;
+				}
+			}
+			collision_tab[s][b] = n2 | (n3 << 3) | (st << 5);
+		}
+}
+
+/*
+ * G(z) of SP 800-90B 6.3.4 step 7, for the L blocks of a window and
+ * its d dictionary blocks, with the sum over t taken inside:
+ *
+ *   v G(z) = z^2 sum(u = 1..L-1, log2(u) (1-z)^(u-1) (L - max(u, d)))
+ *	      + z sum(u = d+1..L, log2(u) (1-z)^(u-1))
+ *
+ * The terms are summed until (1-z)^(u-1) is too small to matter.
+ */
+static double expect_g(double z, const double *lg)
+{
+	const unsigned int L = ENTROPY_WINDOW_BLOCKS, d = ENTROPY_DICT_BLOCKS;
+	double pw = 1.0, s = 0.0, l;
+	unsigned int u;
+
+	for (u = 2; (u <= L) && (pw > 1e-30); u++) {
+		pw *= 1.0 - z;
+		l = lg ? lg[u] : log2(u);
+		if (u < L)
+			s += l * pw * z * z * (L - ((u > d) ? u : d));
+		if (u > d)
+			s += l * pw * z;
+	}
+	return s / (L - d);
+}
+
+/* G(p) + 63 G(q) over the grid, log2 looked up if there is room */
+static void init_expect_tab(void)
+{
+	double *lg, p;
+	unsigned int k;
+
+	lg = malloc((ENTROPY_WINDOW_BLOCKS + 1) * sizeof(*lg));
+	for (k = 2; lg && (k <= ENTROPY_WINDOW_BLOCKS); k++)
+		lg[k] = log2(k);
+	for (k = 0; k <= EXPECT_GRID; k++) {
+		p = exp2(-6.0 * k / EXPECT_GRID);
+		expect_tab[k] = expect_g(p, lg) +
+				63.0 * expect_g((1.0 - p) / 63.0, lg);
+	}
+	free(lg);
+}
+
+static void init_tables(void)
+{
+	unsigned int i;
+
+	init_collision_tab();
+	for (i = 1; i < LOG2_TAB_SIZE; i++)
+		log2_tab[i] = log2(i);
+	init_expect_tab();
+}
+
+int entropy_init(entropy_ctx_t *ctx)
+{
+	if (!ctx) return -1;
+
+	pthread_once(&tables_once, init_tables);
+	memset(ctx, 0, sizeof(*ctx));
+	return 0;
+}
+
+static inline uint64_t load_be64(const unsigned char *p)
+{
+	uint64_t x;
+
+	memcpy(&x, p, sizeof(x));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	x = __builtin_bswap64(x);
+#endif
+	return x;
+}
+
+/* Counts the ones of the bits in the low bits of x, and their pairs */
+static inline void count_bits(entropy_ctx_t *ctx, uint64_t x,
+			      unsigned int bits)
+{
+	uint64_t y = (x >> 1) | ((uint64_t)ctx->last << (bits - 1));
+	unsigned int ones = __builtin_popcountll(x);
+	unsigned int n11 = __builtin_popcountll(x & y);
+	unsigned int n1x = ones - (x & 1) + ctx->last;
+
+	/* each bit pairs with the one before it, in y */
+	ctx->pairs[3] += n11;
+	ctx->pairs[2] += n1x - n11;
+	ctx->pairs[1] += ones - n11;
+	ctx->pairs[0] += bits - n1x - ones + n11;
+	ctx->ones += ones;
+	ctx->last = x & 1;
+}
+
+/* Books the next 6-bit block s of the compression window */
+static inline void compress_block(entropy_ctx_t *ctx, unsigned int s)
+{
+	uint32_t i = ++ctx->index, d;
+	double l;
+
+	if (i > ENTROPY_DICT_BLOCKS) {
+		d = ctx->dict[s] ? i - ctx->dict[s] : i;
+		l = (d < LOG2_TAB_SIZE) ? log2_tab[d] : log2(d);
+		ctx->log_sum += l;
+		ctx->log_sq_sum += l * l;
+		ctx->distances++;
+	}
+	ctx->dict[s] = i;
+	if (i == ENTROPY_WINDOW_BLOCKS) {
+		memset(ctx->dict, 0, sizeof(ctx->dict));
+		ctx->index = 0;
+	}
+}
+
+int entropy_update(entropy_ctx_t *restrict ctx, const void *restrict buf,
+		   size_t len)
+{
+	const unsigned char *p = buf;
+	uint64_t x;
+	size_t i;
+	uint8_t t;
+
+	if (!ctx) return -1;
+	if (!buf) return -1;
+	if (!len) return 0;
+
+	/* the first bit has no bit before it, it pairs with itself below */
+	if (!ctx->bits) {
+		ctx->last = p[0] >> 7;
+		ctx->pairs[3 * ctx->last]--;
+	}
+	ctx->bits += 8 * (uint64_t)len;
+
+	for (i = 0; i + 8 <= len; i += 8)
+		count_bits(ctx, load_be64(p + i), 64);
+	if (i < len) {
+		for (x = 0; i < len; i++)
+			x = (x << 8) | p[i];
+		count_bits(ctx, x, 8 * (len & 7));
+	}
+
+	for (i = 0; i < len; i++) {
+		t = collision_tab[ctx->collision][p[i]];
+		ctx->collisions[0] += t & 7;
+		ctx->collisions[1] += (t >> 3) & 3;
+		ctx->collision = t >> 5;
+
+		ctx->acc = (ctx->acc << 8) | p[i];
+		ctx->acc_bits += 8;
+		while (ctx->acc_bits >= 6) {
+			ctx->acc_bits -= 6;
+			compress_block(ctx, (ctx->acc >> ctx->acc_bits) & 63);
+		}
+	}
+
+	return 0;
+}
+
+/* 6.3.1: the upper bound of the probability of the commonest bit */
+static double estimate_mcv(const entropy_ctx_t *ctx)
+{
+	double n = ctx->bits, p;
+
+	if (ctx->bits < 2)
+		return 0.0;
+	p = ((ctx->ones > ctx->bits - ctx->ones) ?
+	     ctx->ones : ctx->bits - ctx->ones) / n;
+	p += Z_ALPHA * sqrt(p * (1.0 - p) / (n - 1.0));
+	return (p < 1.0) ? -log2(p) : 0.0;
+}
+
+/*
+ * 6.3.2: a collision takes 3 - p^2 - q^2 bits on average, for bits
+ * that are 1 with probability p or q, which is solved for p instead
+ * of searched for
+ */
+static double estimate_collision(const entropy_ctx_t *ctx)
+{
+	double c2 = ctx->collisions[0], c3 = ctx->collisions[1];
+	double v = c2 + c3, mean, var, x;
+
+	if (v < 2.0)
+		return 0.0;
+	mean = (2.0 * c2 + 3.0 * c3) / v;
+	var = (4.0 * c2 + 9.0 * c3 - v * mean * mean) / (v - 1.0);
+	x = mean - Z_ALPHA * sqrt((var > 0.0) ? var / v : 0.0);
+	if (x >= 2.5)
+		return 1.0;
+	if (x <= 2.0)
+		return 0.0;
+	return -log2(0.5 + 0.5 * sqrt(5.0 - 2.0 * x));
+}
+
+static double log2p(double p)
+{
+	return (p > 0.0) ? log2(p) : -INFINITY;
+}
+
+/* 6.3.3: the likeliest 128-bit sequence of a first-order Markov chain */
+static double estimate_markov(const entropy_ctx_t *ctx)
+{
+	double p0, p1, p00, p01, p10, p11, from0, from1, m, seq[6];
+	int i;
+
+	if (ctx->bits < 2)
+		return 0.0;
+	p0 = log2p((double)(ctx->bits - ctx->ones) / ctx->bits);
+	p1 = log2p((double)ctx->ones / ctx->bits);
+	from0 = ctx->pairs[0] + ctx->pairs[1];
+	from1 = ctx->pairs[2] + ctx->pairs[3];
+	p00 = log2p(from0 ? ctx->pairs[0] / from0 : 0.0);
+	p01 = log2p(from0 ? ctx->pairs[1] / from0 : 0.0);
+	p10 = log2p(from1 ? ctx->pairs[2] / from1 : 0.0);
+	p11 = log2p(from1 ? ctx->pairs[3] / from1 : 0.0);
+
+	seq[0] = p0 + 127 * p00;
+	seq[1] = p0 + 64 * p01 + 63 * p10;
+	seq[2] = p0 + p01 + 126 * p11;
+	seq[3] = p1 + p10 + 126 * p00;
+	seq[4] = p1 + 64 * p10 + 63 * p01;
+	seq[5] = p1 + 127 * p11;
+	for (m = seq[0], i = 1; i < 6; i++)
+		if (seq[i] > m)
+			m = seq[i];
+	return (-m / 128 < 1.0) ? -m / 128 : 1.0;
+}
+
+/* 6.3.4: the min-entropy of blocks that many bits apart on average */
+static double estimate_compression(const entropy_ctx_t *ctx)
+{
+	double n = ctx->distances, mean, var, x, f;
+	unsigned int k;
+
+	if (ctx->distances < 2)
+		return 0.0;
+	mean = ctx->log_sum / n;
+	var = ctx->log_sq_sum / (n - 1.0) - mean * mean;
+	x = mean - Z_ALPHA * 0.5907 * sqrt((var > 0.0) ? var : 0.0) /
+	    sqrt(n);
+	if (x >= expect_tab[EXPECT_GRID])
+		return 1.0;
+	if (x <= expect_tab[0])
+		return 0.0;
+	for (k = 0; expect_tab[k + 1] <= x; k++)
+		;
+	f = (x - expect_tab[k]) / (expect_tab[k + 1] - expect_tab[k]);
+	return (k + f) / EXPECT_GRID;
+}
+
+double entropy_estimate(const entropy_ctx_t *ctx, double *est)
+{
+	double e[N_ENTROPY_ESTIMATORS], m;
+	int i;
+
+	if (!ctx) return 0.0;
+
+	e[ENTROPY_MCV] = estimate_mcv(ctx);
+	e[ENTROPY_COLLISION] = estimate_collision(ctx);
+	e[ENTROPY_MARKOV] = estimate_markov(ctx);
+	e[ENTROPY_COMPRESSION] = estimate_compression(ctx);
+	for (m = e[0], i = 1; i < N_ENTROPY_ESTIMATORS; i++)
+		if (e[i] < m)
+			m = e[i];
+	if (est)
+		memcpy(est, e, sizeof(e));
+	return m;
+}
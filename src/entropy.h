@@ -0,0 +1,96 @@
+/*
+ * entropy.h -- SP 800-90B min-entropy estimators
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef ENTROPY__H
+#define ENTROPY__H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Estimators of NIST SP 800-90B (section 6.3) for the min-entropy of a
+ * stream of bits, taken most significant bit first.  They keep counts
+ * of the stream in a fixed-size context, which may be given in pieces
+ * of any size, and estimate from these counts at any time.
+ *
+ * The compression estimate is computed on windows of
+ * ENTROPY_WINDOW_BLOCKS 6-bit blocks (2^20 bits, rounded down), the
+ * dictionary being initialized anew by the first ENTROPY_DICT_BLOCKS of
+ * each.  The distances of all windows are pooled.
+ */
+#define ENTROPY_WINDOW_BLOCKS	174762
+#define ENTROPY_DICT_BLOCKS	1000
+
+enum {
+	ENTROPY_MCV,			/* 6.3.1 most common value */
+	ENTROPY_COLLISION,		/* 6.3.2 collision */
+	ENTROPY_MARKOV,			/* 6.3.3 Markov */
+	ENTROPY_COMPRESSION,		/* 6.3.4 compression */
+	N_ENTROPY_ESTIMATORS
+};
+
+struct entropy_estimator {
+	const char *key;		/* For structured stats */
+	const char *name;		/* For humans */
+};
+
+extern const struct entropy_estimator
+	entropy_estimators[N_ENTROPY_ESTIMATORS];
+
+/* Context for estimating min-entropy */
+typedef struct entropy_ctx {
+	/* most common value, Markov */
+	uint64_t bits;			/* Bits seen */
+	uint64_t ones;
+	uint64_t pairs[4];		/* Bits followed by 0 or 1: 00, 01,
+					   10 and 11 */
+	unsigned int last;		/* Last bit */
+
+	/* collision */
+	unsigned int collision;		/* Bits of a collision under way */
+	uint64_t collisions[2];		/* Collisions after 2 and 3 bits */
+
+	/* compression */
+	uint32_t dict[64];		/* Last index of each block value in
+					   the window, 0 if not seen */
+	uint32_t index;			/* Blocks in the window */
+	uint32_t acc;			/* Bits not in a block yet */
+	unsigned int acc_bits;
+	uint64_t distances;		/* Distances of tested blocks */
+	double log_sum;			/* Sum of their log2, and squares */
+	double log_sq_sum;
+} entropy_ctx_t;
+
+/* Initializes the context.  Returns 0, or -1 if ctx is NULL. */
+extern int entropy_init(entropy_ctx_t *ctx);
+
+/*
+ * Counts the next len bytes of the stream.  Returns 0, or -1 if ctx
+ * or buf is NULL.
+ */
+extern int entropy_update(entropy_ctx_t *restrict ctx,
+			  const void *restrict buf, size_t len);
+
+/*
+ * Estimates the min-entropy per bit of the stream so far with every
+ * estimator, into est[] unless it is NULL, and returns the least
+ * estimate.  An estimator short of data estimates 0.
+ */
+extern double entropy_estimate(const entropy_ctx_t *ctx, double *est);
+
+#endif /* ENTROPY__H */
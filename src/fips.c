@@ -23,9 +23,14 @@
 #include "rng-tools-config.h"
 
 #include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
 
 #include "fips.h"
+#include "fips_engine.h"
 
 /*
  * Names for the FIPS tests, and bitmask
@@ -42,6 +47,19 @@ const unsigned int fips_test_mask[N_FIPS_TESTS] = {
 	FIPS_RNG_LONGRUN, FIPS_RNG_CONTINUOUS_RUN
 };
 
+/*
+ * Names for the FIPS test engines
+ */
+const char *fips_engine_names[FIPS_ENGINE_MAX] = {
+	"auto",
+	"reference",
+	"table",
+	"word64",
+	"sse4.2",
+	"avx2",
+	"avx512"
+};
+
 
 /* These are the startup tests suggested by the FIPS 140-1 spec section
 *  4.11.1 (http://csrc.nist.gov/fips/fips1401.htm), and updated by FIPS
@@ -108,29 +126,325 @@ static void fips_test_store(fips_ctx_t *ctx, unsigned int rng_data)
 	}
 }
 
-int fips_run_rng_test (fips_ctx_t *ctx, const void *buf)
+/*
+ * fips_test_reference - feed a block to the bit-at-a-time loop above.
+ * 			 Returns FIPS_RNG_CONTINUOUS_RUN if the continuous
+ * 			 run test failed.
+ */
+static int fips_test_reference(fips_ctx_t *ctx, const unsigned char *buf)
+{
+	int i;
+	int rng_test = 0;
+
+	for (i=0; i<FIPS_RNG_BUFFER_SIZE; i += 4) {
+		int new32 = buf[i] | 
+			    ( buf[i+1] << 8 ) | 
+			    ( buf[i+2] << 16 ) | 
+			    ( buf[i+3] << 24 );
+		if (new32 == ctx->last32) rng_test |= FIPS_RNG_CONTINUOUS_RUN;
+		ctx->last32 = new32;
+		fips_test_store(ctx, buf[i]);
+		fips_test_store(ctx, buf[i+1]);
+		fips_test_store(ctx, buf[i+2]);
+		fips_test_store(ctx, buf[i+3]);
+	}
+
+	return rng_test;
+}
+
+
+/*
+ * Byte-at-a-time engine
+ *
+ * Every byte is looked up in a 256-entry table holding its popcount,
+ * the length of the run starting at its MSB (lead) and ending at its
+ * LSB (trail), and a packed histogram of the runs that touch neither
+ * end of the byte.  Those inner runs are never longer than 6 bits, so
+ * they go straight to runs[] and can't fail the long run test.  Lead
+ * and trail runs are stitched to the run carried over from the
+ * previous byte.
+ *
+ * The inner run histogram is packed as one 8-bit counter per runs[]
+ * bucket: buckets 0-7 in inner_lo, 8-11 in inner_hi.  No bucket gets
+ * more than 3 counts from a single byte, so the accumulators are
+ * flushed to runs[] every FIPS_TABLE_FLUSH bytes.
+ */
+struct fips_byte_tab {
+	uint64_t inner_lo;		/* inner runs, buckets 0-7 */
+	uint32_t inner_hi;		/* inner runs, buckets 8-11 */
+	unsigned char ones;		/* number of bits set */
+	unsigned char lead;		/* run length from the MSB */
+	unsigned char trail;		/* run length from the LSB */
+};
+#define FIPS_TABLE_FLUSH 80
+
+static struct fips_byte_tab fips_byte_tab[256];
+
+static void fips_build_tables(void)
+{
+	unsigned int byte, i, bit, len, bucket;
+	struct fips_byte_tab *t;
+
+	for (byte = 0; byte < 256; byte++) {
+		t = &fips_byte_tab[byte];
+		memset(t, 0, sizeof(*t));
+
+		/* walk the byte MSB first, as fips_test_store() does */
+		bit = byte >> 7;
+		len = 0;
+		for (i = 0; i < 8; i++) {
+			if (((byte >> (7 - i)) & 1) == bit) {
+				len++;
+				continue;
+			}
+			if (len == i) {
+				t->lead = len;
+			} else {
+				bucket = (len < 6 ? len : 6) - 1 + 6 * (bit ^ 1);
+				if (bucket < 8)
+					t->inner_lo += 1ULL << (8 * bucket);
+				else
+					t->inner_hi += 1U << (8 * (bucket - 8));
+			}
+			bit ^= 1;
+			len = 1;
+		}
+		if (len == 8)
+			t->lead = 8;
+		t->trail = len;
+		t->ones = __builtin_popcount(byte);
+	}
+}
+
+/*
+ * Books a finished run of len bits of value bit.  fips_test_store()
+ * indexes runs[] with the bit that ends the run, so a finished run of
+ * zeros goes to runs[6-11] and vice-versa (only the last run of a block
+ * is booked under its own value).  The bounds are symmetric, so this
+ * makes no difference other than being bit-identical.
+ */
+static inline void fips_run_end(fips_ctx_t *ctx, unsigned int bit,
+				unsigned int len)
+{
+	ctx->runs[(len < 6 ? len : 6) - 1 + 6 * (bit ^ 1)]++;
+	if (len >= 26)
+		ctx->longrun = 1;
+}
+
+static inline void fips_inner_flush(fips_ctx_t *ctx,
+				    uint64_t *lo, uint32_t *hi)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		ctx->runs[i] += (*lo >> (8 * i)) & 0xff;
+	for (i = 0; i < 4; i++)
+		ctx->runs[8 + i] += (*hi >> (8 * i)) & 0xff;
+	*lo = 0;
+	*hi = 0;
+}
+
+static int fips_test_table(fips_ctx_t *ctx, const unsigned char *buf)
 {
 	int i, j;
 	int rng_test = 0;
-	const unsigned char *rngdatabuf;
+	unsigned int new32, byte, first, bit, len;
+	uint64_t inner_lo = 0;
+	uint32_t inner_hi = 0;
+	const struct fips_byte_tab *t;
 
-	if (!ctx) return -1;
-	if (!buf) return -1;
-	rngdatabuf = (const unsigned char *)buf;
+	bit = buf[0] >> 7;
+	len = 0;
+	fips_block_entry(ctx, bit);
 
-	for (i=0; i<FIPS_RNG_BUFFER_SIZE; i += 4) {
-		int new32 = rngdatabuf[i] | 
-			    ( rngdatabuf[i+1] << 8 ) | 
-			    ( rngdatabuf[i+2] << 16 ) | 
-			    ( rngdatabuf[i+3] << 24 );
+	for (i = 0; i < FIPS_RNG_BUFFER_SIZE; i += 4) {
+		new32 = buf[i] | (buf[i+1] << 8) |
+			(buf[i+2] << 16) | ((unsigned int)buf[i+3] << 24);
 		if (new32 == ctx->last32) rng_test |= FIPS_RNG_CONTINUOUS_RUN;
 		ctx->last32 = new32;
-		fips_test_store(ctx, rngdatabuf[i]);
-		fips_test_store(ctx, rngdatabuf[i+1]);
-		fips_test_store(ctx, rngdatabuf[i+2]);
-		fips_test_store(ctx, rngdatabuf[i+3]);
+
+		for (j = 0; j < 4; j++) {
+			byte = buf[i + j];
+			t = &fips_byte_tab[byte];
+			first = byte >> 7;
+
+			ctx->poker[byte >> 4]++;
+			ctx->poker[byte & 15]++;
+			ctx->ones += t->ones;
+
+			if (t->lead == 8) {
+				/* whole byte extends or replaces the run */
+				if (first != bit) {
+					fips_run_end(ctx, bit, len);
+					bit = first;
+					len = 0;
+				}
+				len += 8;
+				continue;
+			}
+
+			if (first == bit) {
+				fips_run_end(ctx, bit, len + t->lead);
+			} else {
+				fips_run_end(ctx, bit, len);
+				fips_run_end(ctx, first, t->lead);
+			}
+			inner_lo += t->inner_lo;
+			inner_hi += t->inner_hi;
+			bit = byte & 1;
+			len = t->trail;
+		}
+
+		if ((i + 4) % FIPS_TABLE_FLUSH == 0)
+			fips_inner_flush(ctx, &inner_lo, &inner_hi);
+	}
+	fips_inner_flush(ctx, &inner_lo, &inner_hi);
+	fips_block_exit(ctx, bit, len);
+
+	return rng_test;
+}
+
+
+/*
+ * 64-bit word-parallel engine, see fips_engine.h
+ */
+static void fips_poker_word64(fips_ctx_t *ctx, const unsigned char *buf)
+{
+	fips_poker_bytes(ctx, buf, 0);
+}
+
+static int fips_test_word64(fips_ctx_t *ctx, const unsigned char *buf)
+{
+	return fips_word_engine(ctx, buf, fips_poker_word64,
+				fips_word_runs, fips_word_longrun);
+}
+
+
+/*
+ * Engine dispatch
+ *
+ * The CPU-specific engines are only filled in if the CPU supports
+ * them.  FIPS_ENGINE_AUTO picks the first available engine from
+ * fips_engine_pref.
+ */
+static fips_engine_fn fips_engines[FIPS_ENGINE_MAX] = {
+	[FIPS_ENGINE_REFERENCE]	= fips_test_reference,
+	[FIPS_ENGINE_TABLE]	= fips_test_table,
+	[FIPS_ENGINE_WORD64]	= fips_test_word64,
+};
+static const fips_engine_t fips_engine_pref[] = {
+	FIPS_ENGINE_AVX512, FIPS_ENGINE_AVX2, FIPS_ENGINE_SSE42,
+	FIPS_ENGINE_WORD64
+};
+static fips_engine_fn fips_engine = fips_test_word64;
+static fips_engine_t fips_engine_auto = FIPS_ENGINE_WORD64;
+static pthread_once_t fips_once = PTHREAD_ONCE_INIT;
+
+static void fips_setup(void)
+{
+	unsigned int i;
+
+	fips_build_tables();
+#if defined(__x86_64__) || defined(__i386__)
+	fips_x86_probe(fips_engines);
+#endif
+	for (i = 0; i < sizeof(fips_engine_pref)/sizeof(fips_engine_pref[0]); i++)
+		if (fips_engines[fips_engine_pref[i]]) {
+			fips_engine_auto = fips_engine_pref[i];
+			break;
+		}
+	fips_engine = fips_engines[fips_engine_auto];
+}
+
+int fips_find_engine(const char *name)
+{
+	int i;
+
+	for (i = 0; i < FIPS_ENGINE_MAX; i++)
+		if (!strcmp(name, fips_engine_names[i]))
+			return i;
+	return -1;
+}
+
+int fips_set_engine(fips_engine_t engine)
+{
+	pthread_once(&fips_once, fips_setup);
+
+	if ((engine < 0) || (engine >= FIPS_ENGINE_MAX))
+		return -1;
+	if (engine == FIPS_ENGINE_AUTO)
+		engine = fips_engine_auto;
+	if (!fips_engines[engine])
+		return -1;
+	fips_engine = fips_engines[engine];
+	return engine;
+}
+
+/* The bounds of single tests, also run alone */
+static inline int fips_monobit_bounds(int ones)
+{
+	return ((ones >= 10275) || (ones <= 9725)) ? FIPS_RNG_MONOBIT : 0;
+}
+
+static inline int fips_poker_bounds(int poker)
+{
+	/* 16/5000*1563176-5000 = 2.1632  */
+	/* 16/5000*1576928-5000 = 46.1696 */
+	return ((poker > 1576928) || (poker < 1563176)) ? FIPS_RNG_POKER : 0;
+}
+
+/*
+ * fips_bounds - apply the FIPS 140-2 bounds of the monobit, poker
+ * 		 and runs tests to the statistics of a block
+ */
+static int fips_bounds(int ones, int poker, const int *runs)
+{
+	int rng_test = fips_monobit_bounds(ones) | fips_poker_bounds(poker);
+
+	if ((runs[0] < 2315) || (runs[0] > 2685) ||
+	    (runs[1] < 1114) || (runs[1] > 1386) ||
+	    (runs[2] < 527) || (runs[2] > 723) ||
+	    (runs[3] < 240) || (runs[3] > 384) ||
+	    (runs[4] < 103) || (runs[4] > 209) ||
+	    (runs[5] < 103) || (runs[5] > 209) ||
+	    (runs[6] < 2315) || (runs[6] > 2685) ||
+	    (runs[7] < 1114) || (runs[7] > 1386) ||
+	    (runs[8] < 527) || (runs[8] > 723) ||
+	    (runs[9] < 240) || (runs[9] > 384) ||
+	    (runs[10] < 103) || (runs[10] > 209) ||
+	    (runs[11] < 103) || (runs[11] > 209)) {
+		rng_test |= FIPS_RNG_RUNS;
 	}
 
+	return rng_test;
+}
+
+/*
+ * The first bit of buf if testing it books a spurious run (see
+ * fips_block_entry()), -1 otherwise.  Call before the engine runs.
+ */
+static inline int fips_spurious_run(const fips_ctx_t *ctx,
+				    const unsigned char *buf)
+{
+	unsigned int first = buf[0] >> 7;
+
+	return (first != (unsigned int)ctx->last_bit) ? (int)first : -1;
+}
+
+/*
+ * fips_finalize - close the last run, apply the FIPS 140-2 bounds,
+ * 		   store the raw statistics in stats (unless NULL)
+ * 		   and clear the context for the next block
+ *
+ * The FIPS tests count the spurious run of fips_block_entry() like the
+ * reference rngtest does, the raw statistics leave it out: it would
+ * shift their means, by about 150 for the poker sum.
+ */
+static int fips_finalize(fips_ctx_t *ctx, int rng_test,
+			 fips_block_stats_t *stats, int spurious)
+{
+	int i, j;
+
 	/* add in the last (possibly incomplete) run */
 	if (ctx->rlength < 5)
 		ctx->runs[ctx->rlength + (6 * ctx->current_bit)]++;
@@ -145,30 +459,20 @@ int fips_run_rng_test (fips_ctx_t *ctx, const void *buf)
 		ctx->longrun = 0;
 	}
 
-	/* Ones test */
-	if ((ctx->ones >= 10275) || (ctx->ones <= 9725))
-		rng_test |= FIPS_RNG_MONOBIT;
 	/* Poker calcs */
 	for (i = 0, j = 0; i < 16; i++)
 		j += ctx->poker[i] * ctx->poker[i];
-	/* 16/5000*1563176-5000 = 2.1632  */
-	/* 16/5000*1576928-5000 = 46.1696 */
-	if ((j > 1576928) || (j < 1563176))
-		rng_test |= FIPS_RNG_POKER;
-
-	if ((ctx->runs[0] < 2315) || (ctx->runs[0] > 2685) ||
-	    (ctx->runs[1] < 1114) || (ctx->runs[1] > 1386) ||
-	    (ctx->runs[2] < 527) || (ctx->runs[2] > 723) ||
-	    (ctx->runs[3] < 240) || (ctx->runs[3] > 384) ||
-	    (ctx->runs[4] < 103) || (ctx->runs[4] > 209) ||
-	    (ctx->runs[5] < 103) || (ctx->runs[5] > 209) ||
-	    (ctx->runs[6] < 2315) || (ctx->runs[6] > 2685) ||
-	    (ctx->runs[7] < 1114) || (ctx->runs[7] > 1386) ||
-	    (ctx->runs[8] < 527) || (ctx->runs[8] > 723) ||
-	    (ctx->runs[9] < 240) || (ctx->runs[9] > 384) ||
-	    (ctx->runs[10] < 103) || (ctx->runs[10] > 209) ||
-	    (ctx->runs[11] < 103) || (ctx->runs[11] > 209)) {
-		rng_test |= FIPS_RNG_RUNS;
+	rng_test |= fips_bounds(ctx->ones, j, ctx->runs);
+
+	if (stats) {
+		stats->ones = ctx->ones;
+		stats->poker = j;
+		for (i = 0; i < 12; i++)
+			stats->runs[i] = ctx->runs[i];
+		if (spurious == 1)
+			stats->runs[5]--;
+		else if (spurious == 0)
+			stats->poker -= 2 * ctx->poker[15] - 1;
 	}
 	
 	/* finally, clear out FIPS variables for start of next run */
@@ -181,8 +485,136 @@ int fips_run_rng_test (fips_ctx_t *ctx, const void *buf)
 	return rng_test;
 }
 
+int fips_run_rng_test (fips_ctx_t *ctx, const void *buf)
+{
+	if (!ctx) return -1;
+	if (!buf) return -1;
+
+	return fips_finalize(ctx,
+		fips_engine(ctx, (const unsigned char *)buf), NULL, -1);
+}
+
+int fips_run_rng_test_stats(fips_ctx_t *ctx, const void *buf,
+			    fips_block_stats_t *stats)
+{
+	int spurious;
+
+	if (!ctx) return -1;
+	if (!buf) return -1;
+
+	spurious = stats ? fips_spurious_run(ctx, buf) : -1;
+	return fips_finalize(ctx,
+		fips_engine(ctx, (const unsigned char *)buf), stats, spurious);
+}
+
+int fips_run_continuous_test(fips_ctx_t *ctx, const void *buf)
+{
+	const unsigned char *p = buf;
+	uint32_t new32, last32;
+	int i, rng_test = 0;
+
+	if (!ctx) return -1;
+	if (!buf) return -1;
+
+	last32 = ctx->last32;
+	for (i = 0; i < FIPS_RNG_BUFFER_SIZE; i += 4) {
+		new32 = fips_load_le32(p + i);
+		if (new32 == last32) rng_test |= FIPS_RNG_CONTINUOUS_RUN;
+		last32 = new32;
+	}
+	ctx->last32 = last32;
+
+	return rng_test;
+}
+
+int fips_run_monobit_test(const void *buf)
+{
+	const unsigned char *p = buf;
+	int i, ones = 0;
+
+	if (!buf) return -1;
+
+	for (i = 0; i + 8 <= FIPS_RNG_BUFFER_SIZE; i += 8)
+		ones += __builtin_popcountll(fips_load_le64(p + i));
+	ones += __builtin_popcount(fips_load_le32(p + i));
+
+	return fips_monobit_bounds(ones);
+}
+
+/*
+ * The bytes are counted in four histograms, so that back-to-back bytes
+ * never wait on the same counter, and the nibbles and ones are summed
+ * from them
+ */
+int fips_run_poker_test(fips_ctx_t *ctx, const void *buf)
+{
+	const unsigned char *p = buf;
+	unsigned short count[4][256];
+	int poker[16] = { 0 };
+	int i, j, n, ones = 0;
+
+	if (!ctx) return -1;
+	if (!buf) return -1;
+
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < FIPS_RNG_BUFFER_SIZE; i += 4) {
+		count[0][p[i]]++;
+		count[1][p[i + 1]]++;
+		count[2][p[i + 2]]++;
+		count[3][p[i + 3]]++;
+	}
+	for (i = 0; i < 256; i++) {
+		n = count[0][i] + count[1][i] + count[2][i] + count[3][i];
+		poker[i >> 4] += n;
+		poker[i & 15] += n;
+		ones += n * fips_byte_tab[i].ones;
+	}
+
+	/* the spurious run of fips_block_entry() */
+	if (!(p[0] >> 7) && ctx->last_bit)
+		poker[15]++;
+	ctx->last_bit = p[FIPS_RNG_BUFFER_SIZE - 1] & 1;
+
+	for (i = 0, j = 0; i < 16; i++)
+		j += poker[i] * poker[i];
+	return fips_monobit_bounds(ones) | fips_poker_bounds(j);
+}
+
+int fips_run_rng_test_batch(fips_ctx_t *ctx, const void *buf,
+			    unsigned int nblocks, int *results,
+			    fips_block_stats_t *stats)
+{
+	const unsigned char *block;
+	fips_engine_fn engine = fips_engine;
+	unsigned int i, j;
+	int failed = 0, spurious;
+
+	if (!ctx) return -1;
+	if (!buf) return -1;
+	if (!results) return -1;
+	block = (const unsigned char *)buf;
+
+	for (i = 0; i < nblocks; i++, block += FIPS_RNG_BUFFER_SIZE) {
+		/* pull the next block in while this one is tested */
+		if (i + 1 < nblocks)
+			for (j = 0; j < FIPS_RNG_BUFFER_SIZE; j += 64)
+				__builtin_prefetch(block +
+					FIPS_RNG_BUFFER_SIZE + j, 0, 0);
+
+		spurious = stats ? fips_spurious_run(ctx, block) : -1;
+		results[i] = fips_finalize(ctx, engine(ctx, block),
+					   stats ? &stats[i] : NULL, spurious);
+		if (results[i])
+			failed++;
+	}
+
+	return failed;
+}
+
 void fips_init(fips_ctx_t *ctx, unsigned int last32)
 {
+	pthread_once(&fips_once, fips_setup);
+
 	if (ctx) {
 		memset (ctx->poker, 0, sizeof (ctx->poker));
 		memset (ctx->runs, 0, sizeof (ctx->runs));
@@ -195,3 +627,240 @@ void fips_init(fips_ctx_t *ctx, unsigned int last32)
 	}
 }
 
+void fips_resume(fips_ctx_t *ctx, unsigned int last32)
+{
+	fips_init(ctx, last32);
+	/* the last bit of the block is the LSB of its last byte */
+	if (ctx)
+		ctx->last_bit = (last32 >> 24) & 1;
+}
+
+
+/*
+ * Sliding window
+ *
+ * The window keeps the bytes it covers, and the statistics of their
+ * bits.  A byte entering or leaving it updates ones and poker[] with
+ * one lookup each, and the inner runs of the byte (see
+ * fips_byte_tab) with three 64-bit adds: the window has 16-bit
+ * counters, wide enough for a whole block, so packed lanes never carry
+ * nor borrow.
+ *
+ * Runs that touch a byte boundary are booked in runs[] once, when a
+ * byte entering the window closes them, and queued in run[] until the
+ * byte holding their last bit leaves it.  Only the two runs cut by the
+ * ends of the window are booked with the wrong length, and a test
+ * fixes them up: the oldest one has lost cut bits, and the newest one
+ * (tail) is still open.
+ */
+#define FIPS_WINDOW_RUNS	8192	/* > 2 runs per byte, power of 2 */
+
+struct fips_window_run {
+	uint64_t len;			/* Input may hold runs of any length */
+	unsigned int bit;
+};
+
+struct fips_window {
+	unsigned int stride;
+	unsigned int fill;		/* Bytes in data[], up to a block */
+	unsigned int pos;		/* Next byte of data[] to replace */
+	unsigned int next;		/* Bytes to enter before a test */
+
+	int ones;
+	int poker[16];
+	uint64_t inner[3];		/* Inner runs, 16-bit counters */
+	int runs[12];			/* Closed boundary runs, by bucket */
+	int longruns;			/* Closed boundary runs of 26+ bits */
+
+	struct fips_window_run run[FIPS_WINDOW_RUNS];
+	unsigned int run_head, run_count;
+	struct fips_window_run tail;	/* Open run, of length 0 at first */
+	uint64_t cut;			/* Bits of the oldest run gone */
+
+	uint64_t tab[256][3];		/* Inner runs of a byte, widened */
+	unsigned char data[FIPS_RNG_BUFFER_SIZE];
+};
+
+/* Runs are booked under their own bit, as FIPS 140-2 has them */
+static inline unsigned int fips_window_bucket(uint64_t len, unsigned int bit)
+{
+	return (len < 6 ? len : 6) - 1 + 6 * bit;
+}
+
+static inline void fips_window_close(fips_window_t *w, uint64_t len,
+				     unsigned int bit)
+{
+	struct fips_window_run *r;
+
+	w->runs[fips_window_bucket(len, bit)]++;
+	w->longruns += (len >= 26);
+	r = &w->run[(w->run_head + w->run_count++) % FIPS_WINDOW_RUNS];
+	r->len = len;
+	r->bit = bit;
+}
+
+static inline void fips_window_enter(fips_window_t *w, unsigned int byte)
+{
+	const struct fips_byte_tab *t = &fips_byte_tab[byte];
+	unsigned int first = byte >> 7;
+
+	w->ones += t->ones;
+	w->poker[byte >> 4]++;
+	w->poker[byte & 15]++;
+	w->inner[0] += w->tab[byte][0];
+	w->inner[1] += w->tab[byte][1];
+	w->inner[2] += w->tab[byte][2];
+
+	if (w->tail.bit == first) {
+		w->tail.len += t->lead;
+	} else {
+		if (w->tail.len)
+			fips_window_close(w, w->tail.len, w->tail.bit);
+		w->tail.len = t->lead;
+		w->tail.bit = first;
+	}
+	if (t->lead == 8)
+		return;
+	fips_window_close(w, w->tail.len, first);
+	w->tail.len = t->trail;
+	w->tail.bit = byte & 1;
+}
+
+static inline void fips_window_drop(fips_window_t *w)
+{
+	const struct fips_window_run *r = &w->run[w->run_head];
+
+	w->runs[fips_window_bucket(r->len, r->bit)]--;
+	w->longruns -= (r->len >= 26);
+	w->run_head = (w->run_head + 1) % FIPS_WINDOW_RUNS;
+	w->run_count--;
+}
+
+static inline void fips_window_leave(fips_window_t *w, unsigned int byte)
+{
+	const struct fips_byte_tab *t = &fips_byte_tab[byte];
+
+	w->ones -= t->ones;
+	w->poker[byte >> 4]--;
+	w->poker[byte & 15]--;
+	w->inner[0] -= w->tab[byte][0];
+	w->inner[1] -= w->tab[byte][1];
+	w->inner[2] -= w->tab[byte][2];
+
+	if (t->lead == 8) {
+		w->cut += 8;
+	} else {
+		/* the oldest run ends within the byte, so it was closed */
+		fips_window_drop(w);
+		w->cut = t->trail;
+	}
+	/* and the next one may end with it */
+	if (w->run_count && (w->run[w->run_head].len == w->cut)) {
+		fips_window_drop(w);
+		w->cut = 0;
+	}
+}
+
+static int fips_window_test(const fips_window_t *w)
+{
+	const struct fips_window_run *r;
+	int runs[12], longruns = w->longruns;
+	uint64_t len;
+	int i, j;
+
+	for (i = 0; i < 12; i++)
+		runs[i] = w->runs[i] +
+			  ((w->inner[i / 4] >> (16 * (i % 4))) & 0xffff);
+
+	/* book the edge runs with their length in the window */
+	if (w->run_count) {
+		r = &w->run[w->run_head];
+		if (w->cut) {
+			runs[fips_window_bucket(r->len, r->bit)]--;
+			longruns -= (r->len >= 26);
+			len = r->len - w->cut;
+			runs[fips_window_bucket(len, r->bit)]++;
+			longruns += (len >= 26);
+		}
+		len = w->tail.len;
+	} else {
+		len = w->tail.len - w->cut;
+	}
+	runs[fips_window_bucket(len, w->tail.bit)]++;
+	longruns += (len >= 26);
+
+	for (i = 0, j = 0; i < 16; i++)
+		j += w->poker[i] * w->poker[i];
+
+	return fips_bounds(w->ones, j, runs) |
+	       (longruns ? FIPS_RNG_LONGRUN : 0);
+}
+
+fips_window_t *fips_window_new(unsigned int stride)
+{
+	fips_window_t *w;
+	unsigned int byte, i, bucket;
+	uint64_t count;
+
+	if (!stride || (stride > FIPS_RNG_BUFFER_SIZE)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	pthread_once(&fips_once, fips_setup);
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return NULL;
+	w->stride = stride;
+	w->next = 1;
+
+	/* fips_byte_tab books inner runs under the other bit, swap back */
+	for (byte = 0; byte < 256; byte++) {
+		for (i = 0; i < 12; i++) {
+			if (i < 8)
+				count = (fips_byte_tab[byte].inner_lo >>
+					 (8 * i)) & 0xff;
+			else
+				count = (fips_byte_tab[byte].inner_hi >>
+					 (8 * (i - 8))) & 0xff;
+			bucket = (i + 6) % 12;
+			w->tab[byte][bucket / 4] += count << (16 * (bucket % 4));
+		}
+	}
+	return w;
+}
+
+void fips_window_free(fips_window_t *w)
+{
+	free(w);
+}
+
+int fips_window_slide(fips_window_t *w, const void *buf, unsigned int len,
+		      int *results)
+{
+	const unsigned char *p = buf;
+	unsigned int i;
+	int n = 0;
+
+	if (!w) return -1;
+	if (!buf) return -1;
+	if (!results) return -1;
+
+	for (i = 0; i < len; i++) {
+		if (w->fill == FIPS_RNG_BUFFER_SIZE)
+			fips_window_leave(w, w->data[w->pos]);
+		else
+			w->fill++;
+		fips_window_enter(w, p[i]);
+		w->data[w->pos] = p[i];
+		if (++w->pos == FIPS_RNG_BUFFER_SIZE)
+			w->pos = 0;
+
+		if ((w->fill == FIPS_RNG_BUFFER_SIZE) && !--w->next) {
+			results[n++] = fips_window_test(w);
+			w->next = w->stride;
+		}
+	}
+
+	return n;
+}
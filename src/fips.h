@@ -35,6 +35,12 @@ typedef struct fips_ctx {
  * 32 bits of RNG data to init the continuous run test */
 extern void fips_init(fips_ctx_t *ctx, unsigned int last32);
 
+/* Initializes the context to test a block that follows another
+ * block, whose last 32 bits (as read by the continuous run test) are
+ * last32.  The results are the same as if the previous block had been
+ * tested with this context.  Used to test blocks out of order. */
+extern void fips_resume(fips_ctx_t *ctx, unsigned int last32);
+
 /*
  * Return values for fips_run_rng_test.  These values are OR'ed together
  * for all tests that failed.
@@ -52,6 +58,35 @@ extern void fips_init(fips_ctx_t *ctx, unsigned int last32);
 extern const char *fips_test_names[N_FIPS_TESTS];
 extern const unsigned int fips_test_mask[N_FIPS_TESTS];
 
+/*
+ * Engines for fips_run_rng_test().  All engines return exactly the
+ * same results; they only differ in speed.
+ */
+typedef enum {
+	FIPS_ENGINE_AUTO,		/* Fastest engine the CPU supports */
+	FIPS_ENGINE_REFERENCE,		/* Bit-at-a-time reference loop */
+	FIPS_ENGINE_TABLE,		/* Byte-at-a-time, table driven */
+	FIPS_ENGINE_WORD64,		/* 64-bit word-parallel */
+	FIPS_ENGINE_SSE42,		/* word64 with SSE2 poker and POPCNT */
+	FIPS_ENGINE_AVX2,		/* AVX2 */
+	FIPS_ENGINE_AVX512,		/* AVX-512BW and VPOPCNTDQ */
+	FIPS_ENGINE_MAX
+} fips_engine_t;
+
+/* Names for the engines, and lookup by name (-1 if not found) */
+extern const char *fips_engine_names[FIPS_ENGINE_MAX];
+extern int fips_find_engine(const char *name);
+
+/*
+ * Selects the engine used by fips_run_rng_test().  The default is
+ * FIPS_ENGINE_AUTO, picked on first use from what the CPU supports.
+ * Not thread-safe, call it before any tests run.
+ *
+ * Returns the engine selected (FIPS_ENGINE_AUTO is resolved), or -1 if
+ * the engine is unknown or not supported by this CPU.
+ */
+extern int fips_set_engine(fips_engine_t engine);
+
 /*
  *  Runs the FIPS 140-1 4.11.1 and 4.11.2 tests, as updated by
  *  FIPS 140-2 4.9, errata from 2001-10-10 (which set more strict
@@ -68,4 +103,98 @@ extern const unsigned int fips_test_mask[N_FIPS_TESTS];
  */
 extern int fips_run_rng_test(fips_ctx_t *ctx, const void *buf);
 
+/*
+ * Raw statistics of a block, that the FIPS tests are decided on
+ */
+typedef struct fips_block_stats {
+	unsigned int ones;		/* Monobit: bits set */
+	unsigned int poker;		/* Poker: sum of the squared counts
+					   of the 16 4-bit values */
+	unsigned short runs[12];	/* Runs test buckets: runs of 1-5
+					   and 6+ bits, twice */
+} fips_block_stats_t;
+
+/* Statistics in a fips_block_stats_t, in the order above */
+#define N_FIPS_BLOCK_STATS 14
+
+/*
+ *  Same as fips_run_rng_test(), and stores the raw statistics of the
+ *  block in stats.  They come from the tests anyway, at no extra cost.
+ */
+extern int fips_run_rng_test_stats(fips_ctx_t *ctx, const void *buf,
+				   fips_block_stats_t *stats);
+
+/*
+ *  Runs only the continuous run test of fips_run_rng_test() on a
+ *  block, for a fraction of the cost.  Only last32 of the context is
+ *  used and updated.
+ *
+ *  This function returns 0 or FIPS_RNG_CONTINUOUS_RUN, or -1 if
+ *  either ctx or buf is NULL.
+ */
+extern int fips_run_continuous_test(fips_ctx_t *ctx, const void *buf);
+
+/*
+ *  Runs only the monobit test of fips_run_rng_test() on a block, a
+ *  popcount of its words.
+ *
+ *  This function returns 0 or FIPS_RNG_MONOBIT, or -1 if buf is NULL.
+ */
+extern int fips_run_monobit_test(const void *buf);
+
+/*
+ *  Runs only the monobit and poker tests of fips_run_rng_test() on a
+ *  block, from a histogram of its bytes.  Only the last bit of the
+ *  context is used and updated: the spurious run of a block that
+ *  starts with a zero after a one counts in the poker sum, as it does
+ *  there.
+ *
+ *  This function returns 0 or a mask of FIPS_RNG_MONOBIT and
+ *  FIPS_RNG_POKER, or -1 if either ctx or buf is NULL.
+ */
+extern int fips_run_poker_test(fips_ctx_t *ctx, const void *buf);
+
+/*
+ *  Runs fips_run_rng_test() on nblocks back-to-back blocks of size
+ *  FIPS_RNG_BUFFER_SIZE in buf, storing the result of every block in
+ *  results[], and its raw statistics in stats[] unless stats is NULL.
+ *  The continuous run test carries on across the blocks, exactly as if
+ *  they were tested one by one.
+ *
+ *  This function returns the number of blocks that failed, or -1 if
+ *  ctx, buf or results is NULL.
+ */
+extern int fips_run_rng_test_batch(fips_ctx_t *ctx, const void *buf,
+				   unsigned int nblocks, int *results,
+				   fips_block_stats_t *stats);
+
+/*
+ *  Sliding window testing.  A window keeps the statistics of the last
+ *  FIPS_RNG_BUFFER_SIZE bytes it was given, updating them as bytes
+ *  enter and leave it, and runs the monobit, poker, runs and long run
+ *  tests every stride bytes.  That costs about as much as testing each
+ *  byte twice, whatever the stride.
+ *
+ *  Windows book runs as FIPS 140-2 does, which fips_run_rng_test()
+ *  only approximates (see fips_engine.h), so a window that happens to
+ *  cover a block can give a different result in rare cases.
+ */
+typedef struct fips_window fips_window_t;
+
+/* Returns NULL with errno set, EINVAL if stride is out of range */
+extern fips_window_t *fips_window_new(unsigned int stride);
+extern void fips_window_free(fips_window_t *w);
+
+/*
+ *  Slides the window over len more bytes of buf, storing the result of
+ *  every window test in results[], which must have room for
+ *  len / stride + 1 of them.  The first test is done once the window is
+ *  full, at a block boundary of the data given.
+ *
+ *  This function returns the number of tests done, or -1 if w, buf or
+ *  results is NULL.
+ */
+extern int fips_window_slide(fips_window_t *w, const void *buf,
+			     unsigned int len, int *results);
+
 #endif /* FIPS__H */
@@ -0,0 +1,301 @@
+/*
+ * fips_engine.h -- FIPS test engine internals, shared by the
+ *                  portable and the CPU-specific engines
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef FIPS_ENGINE__H
+#define FIPS_ENGINE__H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "fips.h"
+
+/*
+ * An engine feeds one block to the context, and returns
+ * FIPS_RNG_CONTINUOUS_RUN if the continuous run test failed.
+ * fips_finalize() does the rest.
+ */
+typedef int (*fips_engine_fn)(fips_ctx_t *ctx, const unsigned char *buf);
+
+/* Fills in the engines this CPU supports (x86 only) */
+extern void fips_x86_probe(fips_engine_fn *engines);
+
+/* Helpers below must be inlined into the CPU-specific engines */
+#define FIPS_INLINE static inline __attribute__((always_inline))
+
+/*
+ * The reference loop enters every block with rlength == -1, so when the
+ * first bit of a block differs from the last bit of the previous one, a
+ * spurious run is booked into runs[5] (for a one) or runs[-1], which is
+ * poker[15] (for a zero).  The fast engines must stay bit-identical to
+ * the reference, so they replicate this.
+ */
+FIPS_INLINE void fips_block_entry(fips_ctx_t *ctx, unsigned int first_bit)
+{
+	if (first_bit != (unsigned int)ctx->last_bit) {
+		if (first_bit)
+			ctx->runs[5]++;
+		else
+			ctx->poker[15]++;
+	}
+}
+
+/*
+ * Leaves the run that is still open at the end of the block in the
+ * context, where fips_finalize() expects to find it
+ */
+FIPS_INLINE void fips_block_exit(fips_ctx_t *ctx, unsigned int bit,
+				 unsigned int len)
+{
+	ctx->current_bit = ctx->last_bit = bit;
+	ctx->rlength = len - 1;
+}
+
+FIPS_INLINE void fips_poker_bytes(fips_ctx_t *ctx, const unsigned char *buf,
+				  int from)
+{
+	int i;
+
+	for (i = from; i < FIPS_RNG_BUFFER_SIZE; i++) {
+		ctx->poker[buf[i] >> 4]++;
+		ctx->poker[buf[i] & 15]++;
+	}
+}
+
+
+/*
+ * Word-parallel engines
+ *
+ * The block is loaded as 64-bit words in stream order (the MSB of the
+ * first byte is the MSB of the first word).  It is 312.5 words long, so
+ * the last word only holds 32 valid bits, and the rest of it is zero.
+ *
+ * Runs are counted separately for ones (y = w) and zeros (y = ~w),
+ * from the mask of the bits that start a run, s = y & ~(y >> 1), and the
+ * masks of the bits that are followed by at least k-1 equal bits,
+ * a[k] = y & y<<1 & ... & y<<(k-1) (carrying in bits from the next
+ * word).  popcount(s & a[k]) is the number of runs of k bits or more.
+ * The long run test is a shift-and-AND reduction of a[6].
+ *
+ * The word arrays have FIPS_WORDS_LEAD zero words in front of the block
+ * and are zero-padded up to FIPS_WORDS_ALLOC, so that vector kernels
+ * can load the previous and next words of any lane without checks.
+ */
+#define FIPS_WORDS ((FIPS_RNG_BUFFER_SIZE + 7) / 8)
+#define FIPS_WORDS_LEAD 8
+#define FIPS_WORDS_ALLOC (FIPS_WORDS_LEAD + ((FIPS_WORDS + 7) & ~7) + 8)
+
+typedef void (*fips_poker_fn)(fips_ctx_t *ctx, const unsigned char *buf);
+typedef void (*fips_runs_fn)(const uint64_t *y, uint64_t *a6, uint64_t *ge,
+			     uint64_t *ones);
+typedef int (*fips_longrun_fn)(const uint64_t *a6);
+
+FIPS_INLINE uint64_t fips_load_le64(const unsigned char *p)
+{
+	uint64_t x;
+
+	memcpy(&x, p, sizeof(x));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	x = __builtin_bswap64(x);
+#endif
+	return x;
+}
+
+FIPS_INLINE uint32_t fips_load_le32(const unsigned char *p)
+{
+	uint32_t x;
+
+	memcpy(&x, p, sizeof(x));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	x = __builtin_bswap32(x);
+#endif
+	return x;
+}
+
+/* y shifted towards the MSB by n (1-63) bits, pulling in next */
+#define FIPS_SHL(y, next, n) (((y) << (n)) | ((next) >> (64 - (n))))
+
+/*
+ * Loads the block into w[] and its complement into nw[], running the
+ * continuous run test on the way
+ */
+FIPS_INLINE int fips_word_load(fips_ctx_t *ctx, const unsigned char *buf,
+			       uint64_t *w, uint64_t *nw)
+{
+	int i, rng_test = 0;
+	uint64_t raw;
+	uint32_t lo, hi, last32 = ctx->last32;
+
+	for (i = 0; i < FIPS_WORDS - 1; i++) {
+		raw = fips_load_le64(buf + 8 * i);
+		lo = raw;
+		hi = raw >> 32;
+		if (lo == last32) rng_test |= FIPS_RNG_CONTINUOUS_RUN;
+		if (hi == lo) rng_test |= FIPS_RNG_CONTINUOUS_RUN;
+		last32 = hi;
+		w[i] = __builtin_bswap64(raw);
+		nw[i] = ~w[i];
+	}
+	/* the last 4 bytes; the padding isn't part of any run */
+	lo = fips_load_le32(buf + 8 * i);
+	if (lo == last32) rng_test |= FIPS_RNG_CONTINUOUS_RUN;
+	ctx->last32 = lo;
+	w[i] = (uint64_t)__builtin_bswap32(lo) << 32;
+	nw[i] = ~w[i] & 0xffffffff00000000ULL;
+
+	return rng_test;
+}
+
+/*
+ * Counts the runs of set bits in y[], adding the number of runs of at
+ * least k bits to ge[k-1], and the number of set bits to *ones (if
+ * not NULL).  Returns the a[6] masks in a6[].
+ */
+FIPS_INLINE void fips_word_runs(const uint64_t *y, uint64_t *a6,
+				uint64_t *ge, uint64_t *ones)
+{
+	int i;
+	uint64_t cur, next, s, a, n = 0;
+
+	for (i = 0; i < FIPS_WORDS; i++) {
+		cur = y[i];
+		next = y[i + 1];
+
+		s = cur & ~((cur >> 1) | (y[i - 1] << 63));
+		a = cur;
+		ge[0] += __builtin_popcountll(s);
+		a &= FIPS_SHL(cur, next, 1);
+		ge[1] += __builtin_popcountll(s & a);
+		a &= FIPS_SHL(cur, next, 2);
+		ge[2] += __builtin_popcountll(s & a);
+		a &= FIPS_SHL(cur, next, 3);
+		ge[3] += __builtin_popcountll(s & a);
+		a &= FIPS_SHL(cur, next, 4);
+		ge[4] += __builtin_popcountll(s & a);
+		a &= FIPS_SHL(cur, next, 5);
+		ge[5] += __builtin_popcountll(s & a);
+		a6[i] = a;
+		if (ones)
+			n += __builtin_popcountll(cur);
+	}
+	if (ones)
+		*ones += n;
+}
+
+/* Returns non-zero if a6[] has a run of 26 bits or more */
+FIPS_INLINE int fips_word_longrun(const uint64_t *a6)
+{
+	int i;
+	uint64_t cur, next, r = 0;
+
+	for (i = 0; i < FIPS_WORDS; i++) {
+		cur = a6[i];
+		if (!cur)
+			continue;
+		next = a6[i + 1];
+		r |= cur & FIPS_SHL(cur, next, 6) & FIPS_SHL(cur, next, 12) &
+		     FIPS_SHL(cur, next, 18) & FIPS_SHL(cur, next, 20);
+	}
+	return r != 0;
+}
+
+/*
+ * Books the per-length run counts of one bit value.  ge[k-1] is the
+ * number of runs of at least k bits.  Finished runs are booked under
+ * the bit that ends them, see fips_run_end().
+ */
+FIPS_INLINE void fips_word_book(fips_ctx_t *ctx, unsigned int bit,
+				const uint64_t *ge)
+{
+	int k;
+
+	for (k = 0; k < 5; k++)
+		ctx->runs[k + 6 * (bit ^ 1)] += ge[k] - ge[k + 1];
+	ctx->runs[5 + 6 * (bit ^ 1)] += ge[5];
+}
+
+/*
+ * The last run was booked as a finished run, take it back out and
+ * hand it to fips_finalize() instead
+ */
+FIPS_INLINE void fips_word_last_run(fips_ctx_t *ctx, const uint64_t *w,
+				    const uint64_t *nw)
+{
+	int i = FIPS_WORDS - 1;
+	unsigned int bit, len;
+	const uint64_t *y;
+
+	bit = (w[i] >> 32) & 1;
+	y = bit ? w : nw;
+	len = __builtin_ctzll(~(y[i] >> 32));
+	if (len == 32) {
+		while ((--i >= 0) && (y[i] == ~0ULL))
+			len += 64;
+		if (i >= 0)
+			len += __builtin_ctzll(~y[i]);
+	}
+	ctx->runs[(len < 6 ? len : 6) - 1 + 6 * (bit ^ 1)]--;
+	fips_block_exit(ctx, bit, len);
+}
+
+/*
+ * The word-parallel engine, with the poker, runs and long run kernels
+ * plugged in.  The CPU-specific engines are instances of this.
+ */
+FIPS_INLINE int fips_word_engine(fips_ctx_t *ctx, const unsigned char *buf,
+				 fips_poker_fn poker, fips_runs_fn runs,
+				 fips_longrun_fn longrun)
+{
+	uint64_t wbuf[FIPS_WORDS_ALLOC] __attribute__((aligned(64)));
+	uint64_t nwbuf[FIPS_WORDS_ALLOC] __attribute__((aligned(64)));
+	uint64_t a6buf[FIPS_WORDS_ALLOC] __attribute__((aligned(64)));
+	uint64_t *w = wbuf + FIPS_WORDS_LEAD;
+	uint64_t *nw = nwbuf + FIPS_WORDS_LEAD;
+	uint64_t *a6 = a6buf + FIPS_WORDS_LEAD;
+	uint64_t ge1[6] = { 0 }, ge0[6] = { 0 }, ones = 0;
+	int rng_test;
+
+	/* clear the padding */
+	w[-1] = nw[-1] = 0;
+	memset(w + FIPS_WORDS, 0,
+	       (FIPS_WORDS_ALLOC - FIPS_WORDS_LEAD - FIPS_WORDS) * 8);
+	memset(nw + FIPS_WORDS, 0,
+	       (FIPS_WORDS_ALLOC - FIPS_WORDS_LEAD - FIPS_WORDS) * 8);
+	memset(a6 + FIPS_WORDS, 0,
+	       (FIPS_WORDS_ALLOC - FIPS_WORDS_LEAD - FIPS_WORDS) * 8);
+
+	rng_test = fips_word_load(ctx, buf, w, nw);
+	poker(ctx, buf);
+	fips_block_entry(ctx, w[0] >> 63);
+
+	runs(w, a6, ge1, &ones);
+	if (longrun(a6))
+		ctx->longrun = 1;
+	runs(nw, a6, ge0, NULL);
+	if (longrun(a6))
+		ctx->longrun = 1;
+	fips_word_book(ctx, 1, ge1);
+	fips_word_book(ctx, 0, ge0);
+	ctx->ones += ones;
+
+	fips_word_last_run(ctx, w, nw);
+
+	return rng_test;
+}
+
+#endif /* FIPS_ENGINE__H */
@@ -0,0 +1,410 @@
+/*
+ * fips_x86.c -- SSE4.2, AVX2 and AVX-512 FIPS test engines
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define _GNU_SOURCE
+
+#include "rng-tools-config.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <stdint.h>
+#include <string.h>
+#include <cpuid.h>
+#include <immintrin.h>
+
+#include "fips.h"
+#include "fips_engine.h"
+
+/*
+ * These engines are instances of fips_word_engine(), with vector
+ * kernels for the poker test, the run counting (which also does the
+ * monobit popcount) and the long run test.  They are built with
+ * target attributes, so the rest of librngd doesn't need any -m flags,
+ * and are only handed out by fips_x86_probe() if the CPU and the OS
+ * support them.
+ */
+#define FIPS_TARGET_SSE42  __attribute__((target("sse4.2,popcnt")))
+#define FIPS_TARGET_AVX2   __attribute__((target("avx2,popcnt")))
+#define FIPS_TARGET_AVX512 \
+	__attribute__((target("avx512f,avx512bw,avx512vpopcntdq,avx2,popcnt")))
+
+
+/*
+ * SSE4.2: the portable word kernels with POPCNT, and a poker test
+ * counting nibbles with byte compares
+ */
+
+/*
+ * Vector poker test.  Every nibble value k has a vector of byte
+ * counters, decremented by the compare mask (-1) of the nibbles equal
+ * to k, and summed up with psadbw before they can overflow.
+ */
+static FIPS_TARGET_SSE42 void fips_poker_sse42(fips_ctx_t *ctx,
+					       const unsigned char *buf)
+{
+	const __m128i mask = _mm_set1_epi8(0x0f), zero = _mm_setzero_si128();
+	__m128i acc[16], v, lo, hi, s;
+	int i, k, n = 0;
+
+	for (k = 0; k < 16; k++)
+		acc[k] = zero;
+
+	for (i = 0; i + 16 <= FIPS_RNG_BUFFER_SIZE; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(buf + i));
+		lo = _mm_and_si128(v, mask);
+		hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+		for (k = 0; k < 16; k++) {
+			const __m128i kk = _mm_set1_epi8(k);
+			acc[k] = _mm_sub_epi8(acc[k], _mm_cmpeq_epi8(lo, kk));
+			acc[k] = _mm_sub_epi8(acc[k], _mm_cmpeq_epi8(hi, kk));
+		}
+		/* at most 2 counts per byte counter per vector */
+		if ((++n == 127) || (i + 32 > FIPS_RNG_BUFFER_SIZE)) {
+			for (k = 0; k < 16; k++) {
+				s = _mm_sad_epu8(acc[k], zero);
+				ctx->poker[k] += _mm_cvtsi128_si32(s) +
+					_mm_extract_epi16(s, 4);
+				acc[k] = zero;
+			}
+			n = 0;
+		}
+	}
+	fips_poker_bytes(ctx, buf, i);
+}
+
+static FIPS_TARGET_SSE42 void fips_runs_sse42(const uint64_t *y, uint64_t *a6,
+					      uint64_t *ge, uint64_t *ones)
+{
+	fips_word_runs(y, a6, ge, ones);
+}
+
+static FIPS_TARGET_SSE42 int fips_longrun_sse42(const uint64_t *a6)
+{
+	return fips_word_longrun(a6);
+}
+
+static FIPS_TARGET_SSE42 int fips_test_sse42(fips_ctx_t *ctx,
+					     const unsigned char *buf)
+{
+	return fips_word_engine(ctx, buf, fips_poker_sse42,
+				fips_runs_sse42, fips_longrun_sse42);
+}
+
+
+/*
+ * AVX2: 4 words per vector.  There is no vector popcount, so bits are
+ * counted per byte with a pshufb nibble table, and the byte counts are
+ * summed into 64-bit lanes with psadbw before they can overflow.
+ */
+static FIPS_TARGET_AVX2 void fips_poker_avx2(fips_ctx_t *ctx,
+					     const unsigned char *buf)
+{
+	const __m256i mask = _mm256_set1_epi8(0x0f);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc[16], v, lo, hi;
+	uint64_t lane[4];
+	int i, k;
+
+	/* 78 vectors, at most 2 counts per byte counter each: no flush */
+	for (k = 0; k < 16; k++)
+		acc[k] = zero;
+
+	for (i = 0; i + 32 <= FIPS_RNG_BUFFER_SIZE; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(buf + i));
+		lo = _mm256_and_si256(v, mask);
+		hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), mask);
+		for (k = 0; k < 16; k++) {
+			const __m256i kk = _mm256_set1_epi8(k);
+			acc[k] = _mm256_sub_epi8(acc[k],
+					_mm256_cmpeq_epi8(lo, kk));
+			acc[k] = _mm256_sub_epi8(acc[k],
+					_mm256_cmpeq_epi8(hi, kk));
+		}
+	}
+	for (k = 0; k < 16; k++) {
+		_mm256_storeu_si256((__m256i *)lane,
+				    _mm256_sad_epu8(acc[k], zero));
+		ctx->poker[k] += lane[0] + lane[1] + lane[2] + lane[3];
+	}
+	fips_poker_bytes(ctx, buf, i);
+}
+
+/* Per-byte popcount */
+FIPS_INLINE FIPS_TARGET_AVX2 __m256i fips_popcnt8_avx2(__m256i v)
+{
+	const __m256i lut = _mm256_setr_epi8(
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i mask = _mm256_set1_epi8(0x0f);
+
+	return _mm256_add_epi8(
+		_mm256_shuffle_epi8(lut, _mm256_and_si256(v, mask)),
+		_mm256_shuffle_epi8(lut, _mm256_and_si256(
+				_mm256_srli_epi16(v, 4), mask)));
+}
+
+/* FIPS_SHL() on every lane */
+#define FIPS_SHL_AVX2(y, next, n) \
+	_mm256_or_si256(_mm256_slli_epi64(y, n), _mm256_srli_epi64(next, 64 - (n)))
+
+/* Up to 31 vectors of per-byte counts (8 max) fit in a byte counter */
+#define FIPS_AVX2_FLUSH 31
+
+static FIPS_TARGET_AVX2 void fips_runs_avx2(const uint64_t *y, uint64_t *a6,
+					    uint64_t *ge, uint64_t *ones)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc8[7], acc64[7], cur, next, prev, s, a;
+	uint64_t lane[4];
+	int i, k, n = 0;
+
+	for (k = 0; k < 7; k++)
+		acc8[k] = acc64[k] = zero;
+
+	for (i = 0; i < FIPS_WORDS; i += 4) {
+		cur = _mm256_load_si256((const __m256i *)(y + i));
+		next = _mm256_loadu_si256((const __m256i *)(y + i + 1));
+		prev = _mm256_loadu_si256((const __m256i *)(y + i - 1));
+
+		s = _mm256_andnot_si256(_mm256_or_si256(
+				_mm256_srli_epi64(cur, 1),
+				_mm256_slli_epi64(prev, 63)), cur);
+		acc8[0] = _mm256_add_epi8(acc8[0], fips_popcnt8_avx2(s));
+		a = _mm256_and_si256(cur, FIPS_SHL_AVX2(cur, next, 1));
+		acc8[1] = _mm256_add_epi8(acc8[1],
+				fips_popcnt8_avx2(_mm256_and_si256(s, a)));
+		a = _mm256_and_si256(a, FIPS_SHL_AVX2(cur, next, 2));
+		acc8[2] = _mm256_add_epi8(acc8[2],
+				fips_popcnt8_avx2(_mm256_and_si256(s, a)));
+		a = _mm256_and_si256(a, FIPS_SHL_AVX2(cur, next, 3));
+		acc8[3] = _mm256_add_epi8(acc8[3],
+				fips_popcnt8_avx2(_mm256_and_si256(s, a)));
+		a = _mm256_and_si256(a, FIPS_SHL_AVX2(cur, next, 4));
+		acc8[4] = _mm256_add_epi8(acc8[4],
+				fips_popcnt8_avx2(_mm256_and_si256(s, a)));
+		a = _mm256_and_si256(a, FIPS_SHL_AVX2(cur, next, 5));
+		acc8[5] = _mm256_add_epi8(acc8[5],
+				fips_popcnt8_avx2(_mm256_and_si256(s, a)));
+		_mm256_store_si256((__m256i *)(a6 + i), a);
+		if (ones)
+			acc8[6] = _mm256_add_epi8(acc8[6],
+					fips_popcnt8_avx2(cur));
+
+		if ((++n == FIPS_AVX2_FLUSH) || (i + 4 >= FIPS_WORDS)) {
+			for (k = 0; k < 7; k++) {
+				acc64[k] = _mm256_add_epi64(acc64[k],
+					_mm256_sad_epu8(acc8[k], zero));
+				acc8[k] = zero;
+			}
+			n = 0;
+		}
+	}
+
+	for (k = 0; k < 7; k++) {
+		_mm256_storeu_si256((__m256i *)lane, acc64[k]);
+		if (k < 6)
+			ge[k] += lane[0] + lane[1] + lane[2] + lane[3];
+		else if (ones)
+			*ones += lane[0] + lane[1] + lane[2] + lane[3];
+	}
+}
+
+static FIPS_TARGET_AVX2 int fips_longrun_avx2(const uint64_t *a6)
+{
+	__m256i cur, next, r = _mm256_setzero_si256();
+	int i;
+
+	for (i = 0; i < FIPS_WORDS; i += 4) {
+		cur = _mm256_load_si256((const __m256i *)(a6 + i));
+		next = _mm256_loadu_si256((const __m256i *)(a6 + i + 1));
+		cur = _mm256_and_si256(cur, _mm256_and_si256(
+			_mm256_and_si256(FIPS_SHL_AVX2(cur, next, 6),
+					 FIPS_SHL_AVX2(cur, next, 12)),
+			_mm256_and_si256(FIPS_SHL_AVX2(cur, next, 18),
+					 FIPS_SHL_AVX2(cur, next, 20))));
+		r = _mm256_or_si256(r, cur);
+	}
+	return !_mm256_testz_si256(r, r);
+}
+
+static FIPS_TARGET_AVX2 int fips_test_avx2(fips_ctx_t *ctx,
+					   const unsigned char *buf)
+{
+	return fips_word_engine(ctx, buf, fips_poker_avx2,
+				fips_runs_avx2, fips_longrun_avx2);
+}
+
+
+/*
+ * AVX-512: 8 words per vector, with VPOPCNTQ, and the poker test
+ * counting through compare masks
+ */
+static FIPS_TARGET_AVX512 void fips_poker_avx512(fips_ctx_t *ctx,
+						 const unsigned char *buf)
+{
+	const __m512i mask = _mm512_set1_epi8(0x0f);
+	const __m512i one = _mm512_set1_epi8(1);
+	const __m512i zero = _mm512_setzero_si512();
+	__m512i acc[16], v, lo, hi;
+	int i, k;
+
+	/* 39 vectors, at most 2 counts per byte counter each: no flush */
+	for (k = 0; k < 16; k++)
+		acc[k] = zero;
+
+	for (i = 0; i + 64 <= FIPS_RNG_BUFFER_SIZE; i += 64) {
+		v = _mm512_loadu_si512((const void *)(buf + i));
+		lo = _mm512_and_si512(v, mask);
+		hi = _mm512_and_si512(_mm512_srli_epi16(v, 4), mask);
+		for (k = 0; k < 16; k++) {
+			const __m512i kk = _mm512_set1_epi8(k);
+			acc[k] = _mm512_mask_add_epi8(acc[k],
+				_mm512_cmpeq_epi8_mask(lo, kk), acc[k], one);
+			acc[k] = _mm512_mask_add_epi8(acc[k],
+				_mm512_cmpeq_epi8_mask(hi, kk), acc[k], one);
+		}
+	}
+	for (k = 0; k < 16; k++)
+		ctx->poker[k] += _mm512_reduce_add_epi64(
+				_mm512_sad_epu8(acc[k], zero));
+	fips_poker_bytes(ctx, buf, i);
+}
+
+#define FIPS_SHL_AVX512(y, next, n) \
+	_mm512_or_si512(_mm512_slli_epi64(y, n), _mm512_srli_epi64(next, 64 - (n)))
+
+static FIPS_TARGET_AVX512 void fips_runs_avx512(const uint64_t *y,
+						uint64_t *a6, uint64_t *ge,
+						uint64_t *ones)
+{
+	__m512i acc[7], cur, next, prev, s, a;
+	int i, k;
+
+	for (k = 0; k < 7; k++)
+		acc[k] = _mm512_setzero_si512();
+
+	for (i = 0; i < FIPS_WORDS; i += 8) {
+		cur = _mm512_load_si512((const void *)(y + i));
+		next = _mm512_loadu_si512((const void *)(y + i + 1));
+		prev = _mm512_loadu_si512((const void *)(y + i - 1));
+
+		s = _mm512_andnot_si512(_mm512_or_si512(
+				_mm512_srli_epi64(cur, 1),
+				_mm512_slli_epi64(prev, 63)), cur);
+		acc[0] = _mm512_add_epi64(acc[0], _mm512_popcnt_epi64(s));
+		a = _mm512_and_si512(cur, FIPS_SHL_AVX512(cur, next, 1));
+		acc[1] = _mm512_add_epi64(acc[1],
+				_mm512_popcnt_epi64(_mm512_and_si512(s, a)));
+		a = _mm512_and_si512(a, FIPS_SHL_AVX512(cur, next, 2));
+		acc[2] = _mm512_add_epi64(acc[2],
+				_mm512_popcnt_epi64(_mm512_and_si512(s, a)));
+		a = _mm512_and_si512(a, FIPS_SHL_AVX512(cur, next, 3));
+		acc[3] = _mm512_add_epi64(acc[3],
+				_mm512_popcnt_epi64(_mm512_and_si512(s, a)));
+		a = _mm512_and_si512(a, FIPS_SHL_AVX512(cur, next, 4));
+		acc[4] = _mm512_add_epi64(acc[4],
+				_mm512_popcnt_epi64(_mm512_and_si512(s, a)));
+		a = _mm512_and_si512(a, FIPS_SHL_AVX512(cur, next, 5));
+		acc[5] = _mm512_add_epi64(acc[5],
+				_mm512_popcnt_epi64(_mm512_and_si512(s, a)));
+		_mm512_store_si512((void *)(a6 + i), a);
+		if (ones)
+			acc[6] = _mm512_add_epi64(acc[6],
+					_mm512_popcnt_epi64(cur));
+	}
+
+	for (k = 0; k < 6; k++)
+		ge[k] += _mm512_reduce_add_epi64(acc[k]);
+	if (ones)
+		*ones += _mm512_reduce_add_epi64(acc[6]);
+}
+
+static FIPS_TARGET_AVX512 int fips_longrun_avx512(const uint64_t *a6)
+{
+	__m512i cur, next, r = _mm512_setzero_si512();
+	int i;
+
+	for (i = 0; i < FIPS_WORDS; i += 8) {
+		cur = _mm512_load_si512((const void *)(a6 + i));
+		next = _mm512_loadu_si512((const void *)(a6 + i + 1));
+		r = _mm512_ternarylogic_epi64(r, cur,
+			_mm512_and_si512(
+			_mm512_and_si512(FIPS_SHL_AVX512(cur, next, 6),
+					 FIPS_SHL_AVX512(cur, next, 12)),
+			_mm512_and_si512(FIPS_SHL_AVX512(cur, next, 18),
+					 FIPS_SHL_AVX512(cur, next, 20))),
+			0xf8);		/* r | (cur & x) */
+	}
+	return _mm512_test_epi64_mask(r, r) != 0;
+}
+
+static FIPS_TARGET_AVX512 int fips_test_avx512(fips_ctx_t *ctx,
+					       const unsigned char *buf)
+{
+	return fips_word_engine(ctx, buf, fips_poker_avx512,
+				fips_runs_avx512, fips_longrun_avx512);
+}
+
+
+/*
+ * CPU feature detection
+ */
+#define FIPS_XCR0_AVX		0x06	/* XMM and YMM state */
+#define FIPS_XCR0_AVX512	0xe6	/* and opmask, ZMM state */
+
+static uint64_t fips_xgetbv(void)
+{
+	uint32_t lo, hi;
+
+	__asm__ volatile ("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+void fips_x86_probe(fips_engine_fn *engines)
+{
+	unsigned int eax, ebx, ecx, edx, max;
+	uint64_t xcr0 = 0;
+
+	max = __get_cpuid_max(0, NULL);
+	if (max < 1)
+		return;
+	__cpuid(1, eax, ebx, ecx, edx);
+
+	if (!(ecx & bit_SSE4_2) || !(ecx & bit_POPCNT))
+		return;
+	engines[FIPS_ENGINE_SSE42] = fips_test_sse42;
+
+	if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX) || (max < 7))
+		return;
+	xcr0 = fips_xgetbv();
+	if ((xcr0 & FIPS_XCR0_AVX) != FIPS_XCR0_AVX)
+		return;
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+
+	if (!(ebx & bit_AVX2))
+		return;
+	engines[FIPS_ENGINE_AVX2] = fips_test_avx2;
+
+	if (((xcr0 & FIPS_XCR0_AVX512) != FIPS_XCR0_AVX512) ||
+	    !(ebx & bit_AVX512F) || !(ebx & bit_AVX512BW) ||
+	    !(ecx & bit_AVX512VPOPCNTDQ))
+		return;
+	engines[FIPS_ENGINE_AVX512] = fips_test_avx512;
+}
+
+#endif /* __x86_64__ || __i386__ */
@@ -0,0 +1,238 @@
+/*
+ * health.c -- SP 800-90B continuous health tests
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "health.h"
+
+/*
+ * The stream is tested 64 bits at a time, in words aligned on its
+ * start.  A word holds 64 / width samples, or lanes, the first one in
+ * the most significant bits; a lane is flagged by its lowest bit.
+ */
+static const uint64_t lane_lsb[9] = {
+	[1] = 0xffffffffffffffffULL,
+	[2] = 0x5555555555555555ULL,
+	[4] = 0x1111111111111111ULL,
+	[8] = 0x0101010101010101ULL,
+};
+
+/* Flags the lanes of d that aren't zero */
+static inline uint64_t lanes_nonzero(uint64_t d, unsigned int width)
+{
+	unsigned int s;
+
+	for (s = 1; s < width; s <<= 1)
+		d |= d >> s;
+	return d & lane_lsb[width];
+}
+
+static inline uint64_t load_be64(const unsigned char *p)
+{
+	uint64_t x;
+
+	memcpy(&x, p, sizeof(x));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	x = __builtin_bswap64(x);
+#endif
+	return x;
+}
+
+/* C = 1 + ceil(-log2(alpha) / H) */
+static unsigned int rct_cutoff(double entropy)
+{
+	return 1 + (unsigned int)ceil(HEALTH_ALPHA_LOG2 / entropy);
+}
+
+/*
+ * C = 1 + CRITBINOM(W, 2^-H, 1 - alpha): the least count that W
+ * samples, each equal to the first one with probability 2^-H, reach
+ * with probability at most alpha.
+ */
+static unsigned int apt_cutoff(unsigned int window, double entropy)
+{
+	double p = pow(2.0, -entropy), alpha = ldexp(1.0, -HEALTH_ALPHA_LOG2);
+	double tail = 0.0;
+	unsigned int c;
+
+	for (c = window; c > 0; c--) {
+		tail += exp(lgamma(window + 1.0) - lgamma(c + 1.0) -
+			    lgamma(window - c + 1.0) +
+			    c * log(p) + (window - c) * log1p(-p));
+		if (tail > alpha)
+			break;
+	}
+	return c + 1;
+}
+
+int health_init(health_ctx_t *ctx, unsigned int width, double entropy)
+{
+	unsigned int have, s;
+
+	if (!ctx) return -1;
+	if ((width != 1) && (width != 2) && (width != 4) && (width != 8))
+		return -1;
+	if (!(entropy > 0.0) || (entropy > width))
+		return -1;
+
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->width = width;
+	ctx->apt_window = (width == 1) ? 1024 : 512;
+	ctx->rct_cutoff = rct_cutoff(entropy);
+	ctx->apt_cutoff = apt_cutoff(ctx->apt_window, entropy);
+	ctx->apt_left = ctx->apt_window;
+
+	/*
+	 * Shifts that AND together cutoff - 1 lanes in a row, by doubling;
+	 * only needed if a run of cutoff fits in a word
+	 */
+	for (have = 1; (ctx->rct_cutoff <= 64) &&
+		       (have < ctx->rct_cutoff - 1); have += s) {
+		s = (have < ctx->rct_cutoff - 1 - have) ?
+		    have : ctx->rct_cutoff - 1 - have;
+		ctx->rct_step[ctx->rct_steps++] = s * width;
+	}
+	return 0;
+}
+
+/*
+ * Tests the samples in the low bits of x.  APT windows span whole
+ * words, so they start and end on a call.  Inlined for each width, so
+ * that lane shifts and divisions by w are constant.
+ */
+static inline __attribute__((always_inline))
+int health_word(health_ctx_t *ctx, uint64_t x, unsigned int bits,
+		const unsigned int w)
+{
+	unsigned int n = bits / w, lead, i;
+	uint64_t lsb, nz, m;
+	int r = 0;
+
+	lsb = lane_lsb[w];
+	if (bits < 64)
+		lsb &= (1ULL << bits) - 1;
+
+	/* RCT: flag the lanes that differ from the one before them */
+	nz = lanes_nonzero(x ^ ((x >> w) | (ctx->last << (bits - w))), w) &
+	     lsb;
+	if (!nz) {
+		ctx->rct_count += n;
+	} else {
+		/*
+		 * the run going on ends before the first flagged lane; one
+		 * that ended with the last word was checked there
+		 */
+		lead = (__builtin_clzll(nz) - (64 - bits) + 1) / w - 1;
+		if (lead && (ctx->rct_count + lead >= ctx->rct_cutoff))
+			r |= HEALTH_RCT;
+		ctx->rct_count = __builtin_ctzll(nz) / w + 1;
+
+		/* cutoff - 1 repetitions in a row in between */
+		if (ctx->rct_cutoff <= n) {
+			m = ~nz & lsb;
+			for (i = 0; i < ctx->rct_steps; i++)
+				m &= m >> ctx->rct_step[i];
+			if (m)
+				r |= HEALTH_RCT;
+		}
+	}
+	if (ctx->rct_count >= ctx->rct_cutoff)
+		r |= HEALTH_RCT;
+	ctx->last = x & ((1ULL << w) - 1);
+
+	/* APT: count the lanes equal to the first one of the window */
+	if (ctx->apt_left == ctx->apt_window) {
+		ctx->apt_sample = (x >> (bits - w)) * lane_lsb[w];
+		ctx->apt_count = 0;
+	}
+	nz = lanes_nonzero(x ^ ctx->apt_sample, w) & lsb;
+	ctx->apt_count += n - __builtin_popcountll(nz);
+	if (ctx->apt_count >= ctx->apt_cutoff)
+		r |= HEALTH_APT;
+	ctx->apt_left -= n;
+	if (!ctx->apt_left)
+		ctx->apt_left = ctx->apt_window;
+
+	return r;
+}
+
+/* Tests the len (1-7) bytes at p, in a word of their own */
+static int health_bytes(health_ctx_t *ctx, const unsigned char *p,
+			unsigned int len)
+{
+	uint64_t x = 0;
+	unsigned int i;
+
+	for (i = 0; i < len; i++)
+		x = (x << 8) | p[i];
+	ctx->phase = (ctx->phase + len) & 7;
+	switch (ctx->width) {
+	case 1:  return health_word(ctx, x, 8 * len, 1);
+	case 2:  return health_word(ctx, x, 8 * len, 2);
+	case 4:  return health_word(ctx, x, 8 * len, 4);
+	default: return health_word(ctx, x, 8 * len, 8);
+	}
+}
+
+#define HEALTH_WORDS(w)							\
+	for (; len >= 8; p += 8, len -= 8)				\
+		r |= health_word(ctx, load_be64(p), 64, w)
+
+int health_test(health_ctx_t *restrict ctx, const void *restrict buf,
+		size_t len)
+{
+	const unsigned char *p = buf;
+	unsigned int head;
+	int r = 0;
+
+	if (!ctx) return -1;
+	if (!buf) return -1;
+	if (!len) return 0;
+
+	/* the first sample starts a run, as if it differed from the last */
+	if (!ctx->started) {
+		ctx->last = ~(p[0] >> (8 - ctx->width)) &
+			    ((1U << ctx->width) - 1);
+		ctx->started = 1;
+	}
+
+	/* up to the next word of the stream */
+	if (ctx->phase) {
+		head = 8 - ctx->phase;
+		if (head > len)
+			head = len;
+		r |= health_bytes(ctx, p, head);
+		p += head;
+		len -= head;
+	}
+	switch (ctx->width) {
+	case 1:  HEALTH_WORDS(1); break;
+	case 2:  HEALTH_WORDS(2); break;
+	case 4:  HEALTH_WORDS(4); break;
+	default: HEALTH_WORDS(8); break;
+	}
+	if (len)
+		r |= health_bytes(ctx, p, len);
+
+	return r;
+}
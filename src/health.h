@@ -0,0 +1,81 @@
+/*
+ * health.h -- SP 800-90B continuous health tests
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef HEALTH__H
+#define HEALTH__H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The Repetition Count Test and the Adaptive Proportion Test of NIST
+ * SP 800-90B (section 4.4), run on a stream of samples of 1, 2, 4 or 8
+ * bits each, taken most significant bits first.  Both tests keep their
+ * state across calls, so the stream may be given in pieces of any size.
+ *
+ * The cutoffs follow from the min-entropy claimed per sample, for a
+ * false positive probability of 2^-HEALTH_ALPHA_LOG2 per sample.
+ */
+#define HEALTH_ALPHA_LOG2	30
+
+/*
+ * Return values for health_test.  These values are OR'ed together for
+ * all tests that failed.
+ */
+#define HEALTH_RCT		0x0001 /* SP 800-90B 4.4.1 repetition count */
+#define HEALTH_APT		0x0002 /* SP 800-90B 4.4.2 adaptive proportion */
+
+/* Context for running health tests */
+typedef struct health_ctx {
+	unsigned int width;		/* Bits per sample */
+	unsigned int rct_cutoff;	/* C of the RCT */
+	unsigned int apt_window;	/* W of the APT, in samples */
+	unsigned int apt_cutoff;	/* C of the APT */
+	unsigned int rct_steps;		/* Shifts to find a run in a word */
+	unsigned int rct_step[6];
+
+	int started;			/* A sample was seen */
+	unsigned int phase;		/* Bytes seen, modulo 8 */
+	uint64_t last;			/* Last sample */
+	uint64_t rct_count;		/* Times last was repeated */
+	uint64_t apt_sample;		/* First sample of the APT window,
+					   in every lane */
+	unsigned int apt_count;		/* Times it was seen in the window */
+	unsigned int apt_left;		/* Samples left in the window */
+} health_ctx_t;
+
+/*
+ * Initializes the context for samples of width bits (1, 2, 4 or 8),
+ * each carrying entropy bits of min-entropy (more than 0, at most
+ * width).  Returns 0, or -1 if either is out of range.
+ */
+extern int health_init(health_ctx_t *ctx, unsigned int width,
+		       double entropy);
+
+/*
+ * Runs the health tests on the next len bytes of the stream, 64 bits
+ * at a time.  A test fails on every piece that holds a sample past its
+ * cutoff: a long run fails all the pieces it covers.
+ *
+ * This function returns -1 if ctx or buf is NULL, otherwise it
+ * returns 0 if all tests passed, or a mask of the failed tests.
+ */
+extern int health_test(health_ctx_t *restrict ctx, const void *restrict buf,
+		       size_t len);
+
+#endif /* HEALTH__H */
@@ -0,0 +1,284 @@
+/*
+ * ring.c -- Lock-free rings for handing blocks between threads
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define _GNU_SOURCE
+
+#include "rng-tools-config.h"
+
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+
+#include <assert.h>
+
+#include "stats.h"
+#include "ring.h"
+
+#define RING_CACHELINE 64
+
+/*
+ * Slots are cache-line aligned, so threads working on neighbouring
+ * slots don't share cache lines.  seq is only used by MPMC rings.
+ */
+struct rng_ring_slot {
+	uint64_t seq;
+	void *item;
+} __attribute__((aligned(RING_CACHELINE)));
+
+/*
+ * Producer and consumer state live on cache lines of their own.  The
+ * cached positions let SPSC rings go without reading the other side's
+ * position until the ring looks full (or empty).
+ */
+struct rng_ring {
+	rng_ring_type_t type;
+	unsigned int size;
+	uint64_t mask;
+	struct rng_ring_slot *slots;
+
+	/* producer side */
+	uint64_t head __attribute__((aligned(RING_CACHELINE)));
+	uint64_t tail_cache;
+	uint64_t pushes;
+	uint64_t push_stalls;
+	uint64_t occupancy_sum;
+	uint64_t occupancy_max;
+
+	/* consumer side */
+	uint64_t tail __attribute__((aligned(RING_CACHELINE)));
+	uint64_t head_cache;
+	uint64_t pops;
+	uint64_t pop_stalls;
+};
+
+#define RING_LOAD(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define RING_STORE(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define RING_PEEK(p)		__atomic_load_n(p, __ATOMIC_RELAXED)
+#define RING_COUNT(p, v)	__atomic_fetch_add(p, v, __ATOMIC_RELAXED)
+
+struct rng_ring *rng_ring_new(rng_ring_type_t type, unsigned int size)
+{
+	struct rng_ring *ring;
+	unsigned int i, n = 1;
+	void *p;
+
+	while (n < size)
+		n <<= 1;
+
+	if (posix_memalign(&p, RING_CACHELINE, sizeof(*ring)))
+		return NULL;
+	ring = p;
+	memset(ring, 0, sizeof(*ring));
+	if (posix_memalign(&p, RING_CACHELINE, n * sizeof(*ring->slots))) {
+		free(ring);
+		return NULL;
+	}
+	ring->slots = p;
+	memset(ring->slots, 0, n * sizeof(*ring->slots));
+
+	ring->type = type;
+	ring->size = n;
+	ring->mask = n - 1;
+	for (i = 0; i < n; i++)
+		ring->slots[i].seq = i;
+
+	return ring;
+}
+
+void rng_ring_free(struct rng_ring *ring)
+{
+	if (ring) {
+		free(ring->slots);
+		free(ring);
+	}
+}
+
+static void ring_note_push(struct rng_ring *ring, uint64_t pos)
+{
+	uint64_t occupancy = pos + 1 - RING_PEEK(&ring->tail);
+
+	RING_COUNT(&ring->pushes, 1);
+	RING_COUNT(&ring->occupancy_sum, occupancy);
+	if (occupancy > RING_PEEK(&ring->occupancy_max))
+		__atomic_store_n(&ring->occupancy_max, occupancy,
+				 __ATOMIC_RELAXED);
+}
+
+int rng_ring_push(struct rng_ring *ring, void *item)
+{
+	struct rng_ring_slot *slot;
+	uint64_t pos, seq;
+	int64_t dif;
+
+	assert(ring != NULL && item != NULL);
+
+	if (ring->type == RNG_RING_SPSC) {
+		pos = ring->head;
+		if (pos - ring->tail_cache >= ring->size) {
+			ring->tail_cache = RING_LOAD(&ring->tail);
+			if (pos - ring->tail_cache >= ring->size)
+				return -1;
+		}
+		ring->slots[pos & ring->mask].item = item;
+		RING_STORE(&ring->head, pos + 1);
+		ring_note_push(ring, pos);
+		return 0;
+	}
+
+	pos = RING_PEEK(&ring->head);
+	for (;;) {
+		slot = &ring->slots[pos & ring->mask];
+		seq = RING_LOAD(&slot->seq);
+		dif = (int64_t)(seq - pos);
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&ring->head, &pos,
+					pos + 1, 1, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			return -1;
+		} else {
+			pos = RING_PEEK(&ring->head);
+		}
+	}
+	slot->item = item;
+	RING_STORE(&slot->seq, pos + 1);
+	ring_note_push(ring, pos);
+	return 0;
+}
+
+void *rng_ring_pop(struct rng_ring *ring)
+{
+	struct rng_ring_slot *slot;
+	uint64_t pos, seq;
+	int64_t dif;
+	void *item;
+
+	assert(ring != NULL);
+
+	if (ring->type == RNG_RING_SPSC) {
+		pos = ring->tail;
+		if (pos == ring->head_cache) {
+			ring->head_cache = RING_LOAD(&ring->head);
+			if (pos == ring->head_cache)
+				return NULL;
+		}
+		item = ring->slots[pos & ring->mask].item;
+		RING_STORE(&ring->tail, pos + 1);
+		RING_COUNT(&ring->pops, 1);
+		return item;
+	}
+
+	pos = RING_PEEK(&ring->tail);
+	for (;;) {
+		slot = &ring->slots[pos & ring->mask];
+		seq = RING_LOAD(&slot->seq);
+		dif = (int64_t)(seq - (pos + 1));
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&ring->tail, &pos,
+					pos + 1, 1, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			return NULL;
+		} else {
+			pos = RING_PEEK(&ring->tail);
+		}
+	}
+	item = slot->item;
+	RING_STORE(&slot->seq, pos + ring->mask + 1);
+	RING_COUNT(&ring->pops, 1);
+	return item;
+}
+
+/*
+ * Waits a little longer on every call: spins first, then yields the
+ * CPU, then sleeps for up to RING_MAX_SLEEP nanoseconds.
+ */
+#define RING_SPINS	64
+#define RING_YIELDS	(RING_SPINS + 64)
+#define RING_MAX_SLEEP	200000
+
+static void ring_backoff(unsigned int *round)
+{
+	struct timespec ts;
+	unsigned int r = (*round)++;
+
+	if (r < RING_SPINS) {
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#endif
+	} else if (r < RING_YIELDS) {
+		sched_yield();
+	} else {
+		ts.tv_sec = 0;
+		ts.tv_nsec = 1000L << ((r - RING_YIELDS) < 8 ?
+				       (r - RING_YIELDS) : 8);
+		if (ts.tv_nsec > RING_MAX_SLEEP)
+			ts.tv_nsec = RING_MAX_SLEEP;
+		nanosleep(&ts, NULL);
+	}
+}
+
+int rng_ring_push_wait(struct rng_ring *ring, void *item,
+		       const volatile int *stop)
+{
+	unsigned int round = 0;
+
+	if (!rng_ring_push(ring, item))
+		return 0;
+	RING_COUNT(&ring->push_stalls, 1);
+	do {
+		if (stop && __atomic_load_n(stop, __ATOMIC_ACQUIRE))
+			return -1;
+		ring_backoff(&round);
+	} while (rng_ring_push(ring, item));
+	return 0;
+}
+
+void *rng_ring_pop_wait(struct rng_ring *ring, const volatile int *stop)
+{
+	unsigned int round = 0;
+	void *item;
+
+	if ((item = rng_ring_pop(ring)))
+		return item;
+	RING_COUNT(&ring->pop_stalls, 1);
+	do {
+		if (stop && __atomic_load_n(stop, __ATOMIC_ACQUIRE))
+			return NULL;
+		ring_backoff(&round);
+	} while (!(item = rng_ring_pop(ring)));
+	return item;
+}
+
+void rng_ring_get_stat(struct rng_ring *ring, struct rng_ring_stat *stat)
+{
+	assert(ring != NULL && stat != NULL);
+
+	stat->size = ring->size;
+	stat->pushes = RING_PEEK(&ring->pushes);
+	stat->pops = RING_PEEK(&ring->pops);
+	stat->push_stalls = RING_PEEK(&ring->push_stalls);
+	stat->pop_stalls = RING_PEEK(&ring->pop_stalls);
+	stat->occupancy_sum = RING_PEEK(&ring->occupancy_sum);
+	stat->occupancy_max = RING_PEEK(&ring->occupancy_max);
+}
@@ -0,0 +1,67 @@
+/*
+ * ring.h -- Lock-free rings for handing blocks between threads
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef RING__H
+#define RING__H
+
+#include "stats.h"
+
+/*
+ * A bounded ring of pointers.  Items are handed over, never copied.
+ *
+ * RNG_RING_SPSC rings allow one producer and one consumer thread.
+ * RNG_RING_MPMC rings allow any number of both: every slot carries a
+ * sequence number that tells whose turn it is, so producers and
+ * consumers only contend on the ring position they claim.
+ */
+typedef enum {
+	RNG_RING_SPSC,			/* Single producer, single consumer */
+	RNG_RING_MPMC			/* Multiple producers and consumers */
+} rng_ring_type_t;
+
+struct rng_ring;
+
+/*
+ * Allocates a ring of at least size slots (rounded up to a power of
+ * two).  Returns NULL if out of memory.
+ */
+extern struct rng_ring *rng_ring_new(rng_ring_type_t type, unsigned int size);
+extern void rng_ring_free(struct rng_ring *ring);
+
+/*
+ * Non-blocking push and pop.  rng_ring_push returns -1 if the ring is
+ * full, rng_ring_pop returns NULL if it is empty.  item can't be NULL.
+ */
+extern int rng_ring_push(struct rng_ring *ring, void *item);
+extern void *rng_ring_pop(struct rng_ring *ring);
+
+/*
+ * Blocking push and pop: spin, then yield, then sleep until they
+ * succeed, or until *stop becomes non-zero (in which case they return
+ * -1 and NULL).  Every call that has to wait counts as a stall.
+ */
+extern int rng_ring_push_wait(struct rng_ring *ring, void *item,
+			      const volatile int *stop);
+extern void *rng_ring_pop_wait(struct rng_ring *ring,
+			       const volatile int *stop);
+
+/* Copies the ring counters to stat */
+extern void rng_ring_get_stat(struct rng_ring *ring,
+			      struct rng_ring_stat *stat);
+
+#endif /* RING__H */
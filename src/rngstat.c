@@ -0,0 +1,359 @@
+/*
+ * rngstat.c -- Show the statistics of running rngtest instances
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define _GNU_SOURCE
+
+#include "rng-tools-config.h"
+
+#include <unistd.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <argp.h>
+
+#include "fips.h"
+#include "tests.h"
+#include "sts.h"
+#include "stats.h"
+#include "shmstats.h"
+#include "exits.h"
+
+#define PROGNAME "rngstat"
+const char* logprefix = PROGNAME ": ";
+
+/*
+ * argp stuff
+ */
+
+const char *argp_program_version =
+	PROGNAME " " VERSION "\n"
+	"This is free software; see the source for copying conditions.  There is NO "
+	"warranty; not even for MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.";
+
+const char *argp_program_bug_address = PACKAGE_BUGREPORT;
+error_t argp_err_exit_status = EXIT_USAGE;
+
+static char doc[] =
+	"Show the statistics that rngtest instances keep in shared memory.\n"
+	"\v"
+	"Each name is the one given to rngtest --stats-shm.  Reading them "
+	"takes nothing from rngtest: no system calls, no signals, no "
+	"context switches.\n\n"
+	"The exit status is 0 if every instance could be read, 1 otherwise.\n";
+
+static struct argp_option options[] = {
+	{ "format", 'f', "format", 0,
+	  "Show statistics as text, json (one object per line) or csv "
+	  "(default: text)" },
+
+	{ "watch", 'w', "n", 0,
+	  "Show them again every n seconds, until interrupted (default: 0)" },
+
+	{ 0 },
+};
+
+struct arguments {
+	stat_format_t format;
+	unsigned int watch;
+	char **names;
+	int count;
+};
+
+static struct arguments default_arguments = {
+	.format		= STAT_FORMAT_TEXT,
+	.watch		= 0,
+	.names		= NULL,
+	.count		= 0,
+};
+
+static error_t parse_opt (int key, char *arg, struct argp_state *state)
+{
+	struct arguments *arguments = state->input;
+
+	switch(key) {
+	case 'f': {
+		int i;
+		for (i = 0; i < STAT_FORMAT_MAX; i++)
+			if (!strcmp(arg, stat_format_names[i]))
+				break;
+		if (i >= STAT_FORMAT_MAX)
+			argp_usage(state);
+		else
+			arguments->format = i;
+		break;
+	}
+	case 'w': {
+		long int n;
+		char *p;
+		n = strtol(arg, &p, 10);
+		if ((p == arg) || (*p != 0) || (n < 0) || (n > 86400))
+			argp_usage(state);
+		else
+			arguments->watch = n;
+		break;
+	}
+
+	case ARGP_KEY_ARGS:
+		arguments->names = state->argv + state->next;
+		arguments->count = state->argc - state->next;
+		break;
+
+	case ARGP_KEY_NO_ARGS:
+		argp_usage(state);
+		break;
+
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static struct argp argp = { options, parse_opt, "name...", doc };
+
+static double bits_per_sec(uint64_t bits, uint64_t nsec)
+{
+	return nsec ? (1000000000.0 * bits) / nsec : 0.0;
+}
+
+static void show_text(const char *name, const struct rng_shm_stats *s)
+{
+	char buf[256], prefix[256], label[128];
+	int j;
+
+	snprintf(prefix, sizeof(prefix), "%s: ", name);
+	set_stat_prefix(prefix);
+
+	printf("%spid %" PRId32 ", %s, up %" PRIu64 " microseconds\n",
+	       prefix, s->pid, s->done ? "exited" : "running",
+	       s->uptime_ns / 1000);
+	printf("%s\n", dump_stat_counter(buf, sizeof(buf),
+	       "bits received from input", s->bits_received));
+	printf("%s\n", dump_stat_counter(buf, sizeof(buf),
+	       "bits sent to output", s->bits_sent));
+	printf("%s\n", dump_stat_counter(buf, sizeof(buf),
+	       "blocks tested", s->blocks));
+	if (s->tests & RNG_TESTS_FIPS) {
+		printf("%s\n", dump_stat_counter(buf, sizeof(buf),
+		       "FIPS 140-2 successes", s->good_fips_blocks));
+		printf("%s\n", dump_stat_counter(buf, sizeof(buf),
+		       "FIPS 140-2 failures", s->bad_fips_blocks));
+	}
+	for (j = 0; j < N_RNG_TESTS; j++)
+		if (rng_tests[j].mask & RNG_TESTS_FIPS & s->tests)
+			printf("%s\n", dump_stat_counter(buf, sizeof(buf),
+			       rng_tests[j].name, s->test_failures[j]));
+	if (s->features & RNG_SHM_WINDOWS) {
+		printf("%s\n", dump_stat_counter(buf, sizeof(buf),
+		       "FIPS 140-2 windows tested", s->windows));
+		printf("%s\n", dump_stat_counter(buf, sizeof(buf),
+		       "FIPS 140-2 window failures", s->bad_windows));
+		for (j = 0; j < N_FIPS_TESTS - 1; j++) {
+			snprintf(label, sizeof(label), "%s (windows)",
+				 rng_tests[j].name);
+			printf("%s\n", dump_stat_counter(buf, sizeof(buf),
+			       label, s->window_failures[j]));
+		}
+	}
+	if (s->tests & RNG_TESTS_HEALTH) {
+		printf("%s\n", dump_stat_counter(buf, sizeof(buf),
+		       "SP 800-90B health test failures",
+		       s->bad_health_blocks));
+		for (j = 0; j < N_RNG_TESTS; j++)
+			if (rng_tests[j].mask & RNG_TESTS_HEALTH & s->tests)
+				printf("%s\n", dump_stat_counter(buf,
+				       sizeof(buf), rng_tests[j].name,
+				       s->test_failures[j]));
+	}
+	if (s->features & RNG_SHM_SEQUENCES) {
+		printf("%s\n", dump_stat_counter(buf, sizeof(buf),
+		       "SP 800-22 sequences tested", s->sequences));
+		for (j = 0; j < N_STS_PVALUES; j++)
+			if (s->sequence_tests & (1 << sts_pvalues[j].test))
+				printf("%s\n", dump_stat_counter(buf,
+				       sizeof(buf), sts_pvalues[j].name,
+				       s->sequence_failures[j]));
+	}
+	if (s->features & RNG_SHM_SPECTRAL) {
+		printf("%s\n", dump_stat_counter(buf, sizeof(buf),
+		       "SP 800-22 DFT windows tested", s->spectral_windows));
+		printf("%s\n", dump_stat_counter(buf, sizeof(buf),
+		       "SP 800-22 Discrete Fourier transform",
+		       s->spectral_failures));
+	}
+	printf("%s\n", dump_stat_bw(buf, sizeof(buf),
+	       "input channel speed", "bits", &s->source,
+	       s->source.num_samples ?
+	       s->bits_received / s->source.num_samples : 0));
+	printf("%s\n", dump_stat_latency(buf, sizeof(buf),
+	       "input channel latency", &s->source));
+	printf("%s\n", dump_stat_bw(buf, sizeof(buf),
+	       "FIPS tests speed", "bits", &s->fips, FIPS_RNG_BUFFER_SIZE*8));
+	printf("%s\n", dump_stat_latency(buf, sizeof(buf),
+	       "FIPS tests latency", &s->fips));
+	if (s->sink.num_samples) {
+		printf("%s\n", dump_stat_bw(buf, sizeof(buf),
+		       "output channel speed", "bits", &s->sink,
+		       FIPS_RNG_BUFFER_SIZE*8));
+		printf("%s\n", dump_stat_latency(buf, sizeof(buf),
+		       "output channel latency", &s->sink));
+	}
+}
+
+/*
+ * Same keys as rngtest --stats-format, less the interval ones.  Every
+ * key is always there, 0 for what the instance does not run, so that
+ * the CSV columns of all instances line up.
+ */
+static void show_record(struct stat_record *rec, int header,
+			const char *name, const struct rng_shm_stats *s)
+{
+	static const double quantile[] = { 0.5, 0.9, 0.99, 0.999 };
+	static const char *qkey[] = { "p50", "p90", "p99", "p999" };
+	const struct {
+		const char *key;
+		const struct rng_stat *stat;
+		uint64_t bits;
+	} timer[3] = {
+		{ "input", &s->source, s->bits_received },
+		{ "fips", &s->fips,
+		  s->fips.num_samples * FIPS_RNG_BUFFER_SIZE * 8 },
+		{ "output", &s->sink,
+		  s->sink.num_samples * FIPS_RNG_BUFFER_SIZE * 8 },
+	};
+	char key[64];
+	unsigned int i, j;
+
+	stat_record_begin(rec, header);
+	stat_record_string(rec, "instance", name);
+	stat_record_u64(rec, "pid", s->pid);
+	stat_record_u64(rec, "done", s->done);
+	stat_record_u64(rec, "run_time_us", s->uptime_ns / 1000);
+	stat_record_u64(rec, "bits_received", s->bits_received);
+	stat_record_u64(rec, "bits_sent", s->bits_sent);
+	stat_record_u64(rec, "fips_successes", s->good_fips_blocks);
+	stat_record_u64(rec, "fips_failures", s->bad_fips_blocks);
+	for (i = 0; i < N_RNG_TESTS; i++) {
+		if (!(rng_tests[i].mask & RNG_TESTS_FIPS))
+			continue;
+		snprintf(key, sizeof(key), "fips_%s", rng_tests[i].key);
+		stat_record_u64(rec, key, s->test_failures[i]);
+	}
+	for (i = 0; i < 3; i++) {
+		snprintf(key, sizeof(key), "%s_bps", timer[i].key);
+		stat_record_double(rec, key,
+			bits_per_sec(timer[i].bits, timer[i].stat->sum));
+	}
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < sizeof(quantile)/sizeof(quantile[0]); j++) {
+			uint64_t v = hist_percentile(&timer[i].stat->hist,
+						     quantile[j]);
+
+			if (v > timer[i].stat->max)
+				v = timer[i].stat->max;
+			snprintf(key, sizeof(key), "%s_%s_ns",
+				 timer[i].key, qkey[j]);
+			stat_record_u64(rec, key, v);
+		}
+		snprintf(key, sizeof(key), "%s_max_ns", timer[i].key);
+		stat_record_u64(rec, key, timer[i].stat->max);
+	}
+	stat_record_u64(rec, "health_failures", s->bad_health_blocks);
+	for (i = 0; i < N_RNG_TESTS; i++) {
+		if (!(rng_tests[i].mask & RNG_TESTS_HEALTH))
+			continue;
+		snprintf(key, sizeof(key), "health_%s", rng_tests[i].key);
+		stat_record_u64(rec, key, s->test_failures[i]);
+	}
+	stat_record_u64(rec, "windows", s->windows);
+	stat_record_u64(rec, "window_failures", s->bad_windows);
+	for (i = 0; i < N_FIPS_TESTS - 1; i++) {
+		snprintf(key, sizeof(key), "window_%s", rng_tests[i].key);
+		stat_record_u64(rec, key, s->window_failures[i]);
+	}
+	stat_record_u64(rec, "sequences", s->sequences);
+	for (i = 0; i < N_STS_PVALUES; i++) {
+		snprintf(key, sizeof(key), "sequence_%s", sts_pvalues[i].key);
+		stat_record_u64(rec, key, s->sequence_failures[i]);
+	}
+	stat_record_u64(rec, "spectral_windows", s->spectral_windows);
+	stat_record_u64(rec, "spectral_failures", s->spectral_failures);
+	stat_record_end(rec);
+}
+
+/* Shows one instance, returns non-zero if it could not be read */
+static int show(struct arguments *arguments, const char *name, int *header)
+{
+	static struct rng_shm_stats copy;
+	const struct rng_shm_stats *shm;
+	struct stat_record rec;
+	char buf[8192];
+	int r;
+
+	shm = rng_shm_open(name);
+	if (!shm) {
+		fprintf(stderr, "%s%s: %s\n", logprefix, name,
+			(errno == EPROTO) ? "not an rngtest statistics segment" :
+			strerror(errno));
+		return 1;
+	}
+	r = rng_shm_read(shm, &copy);
+	rng_shm_close(shm);
+	if (r) {
+		fprintf(stderr, "%s%s: writer is stuck, no consistent copy\n",
+			logprefix, name);
+		return 1;
+	}
+
+	if (arguments->format == STAT_FORMAT_TEXT) {
+		show_text(name, &copy);
+		return 0;
+	}
+	stat_record_init(&rec, arguments->format, buf, sizeof(buf));
+	if (!*header && (arguments->format == STAT_FORMAT_CSV)) {
+		show_record(&rec, 1, name, &copy);
+		*header = 1;
+	}
+	show_record(&rec, 0, name, &copy);
+	fputs(buf, stdout);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct arguments *arguments = &default_arguments;
+	int header = 0, failed;
+	int i;
+
+	argp_parse(&argp, argc, argv, 0, 0, arguments);
+
+	for (;;) {
+		failed = 0;
+		for (i = 0; i < arguments->count; i++)
+			failed |= show(arguments, arguments->names[i], &header);
+		fflush(stdout);
+		if (!arguments->watch)
+			break;
+		sleep(arguments->watch);
+	}
+
+	exit(failed ? EXIT_FAIL : EXIT_SUCCESS);
+}
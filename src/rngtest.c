@@ -33,15 +33,34 @@
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
 #include <time.h>
 #include <string.h>
 #include <signal.h>
 #include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <argp.h>
 
+#include <assert.h>
+
 #include "fips.h"
+#include "tests.h"
+#include "entropy.h"
+#include "sts.h"
+#include "dft.h"
+#include "autocorr.h"
 #include "stats.h"
+#include "ring.h"
+#include "uring.h"
+#include "shmstats.h"
 #include "util.h"
 #include "exits.h"
 
@@ -64,7 +83,8 @@ error_t argp_err_exit_status = EXIT_USAGE;
 static char doc[] =
 	"Check the randomness of data using FIPS 140-2 RNG tests.\n"
 	"\v"
-	"FIPS tests operate on 20000-bit blocks.  Data is read from stdin.  Statistics "
+	"FIPS tests operate on 20000-bit blocks.  Data is read from stdin, or from "
+	"the file given with --input.  Statistics "
 	"and messages are sent to stderr.\n\n"
 	"If no errors happen nor any blocks fail the FIPS tests, the program will return "
 	"exit status 0.  If any blocks fail the tests, the exit status will be 1.\n";
@@ -82,14 +102,117 @@ static struct argp_option options[] = {
 	{ "blockstats", 'b', "n", 0,
 	  "Dump statistics every n blocks (default: 0)" },
 
+	{ "stats-format", 'f', "format", 0,
+	  "Dump statistics as text, json (one object per line) or csv "
+	  "(default: text)" },
+
+	{ "threads", 'T', "n", 0,
+	  "Test blocks with n threads, in a reader/tester/writer pipeline "
+	  "(default: 1, no pipeline)" },
+
+	{ "engine", 'e', "name", 0,
+	  "FIPS test engine: auto, reference, table, word64, sse4.2, avx2 "
+	  "or avx512 (default: auto)" },
+
+	{ "input", 'i', "file", 0,
+	  "Read data from file instead of stdin.  Regular files are mapped "
+	  "into memory, and tested in parallel with --threads" },
+
+	{ "sample", 's', "n", 0,
+	  "Time one block in n for the speed statistics (default: 1)" },
+
+	{ "metrics-socket", 'm', "path", 0,
+	  "Serve statistics in Prometheus text format on a Unix socket "
+	  "at path" },
+
+	{ "drift", 'd', 0, 0,
+	  "Track the mean and spread of the raw FIPS test statistics, "
+	  "to see a source drift before its blocks fail" },
+
+	{ "stride", 'w', "n", 0,
+	  "Also test a 20000-bit window that slides over the input n "
+	  "bytes at a time, from 1 to 2500 (default: 0, off)" },
+
+	{ "health", 'H', "n", 0,
+	  "Also run the SP 800-90B repetition count and adaptive "
+	  "proportion tests on samples of n bits: 1, 2, 4 or 8.  Blocks "
+	  "that fail them are not echoed in pipe mode (default: 0, off)" },
+
+	{ "entropy", 'E', "h", 0,
+	  "Min-entropy claimed per sample for --health, which sets the "
+	  "test cutoffs (default: n, full entropy)" },
+
+	{ "tests", 'x', "list", 0,
+	  "Run only the tests in list, comma-separated: monobit, poker, "
+	  "runs, long_run, continuous_run, rct and apt (default: the FIPS "
+	  "140-2 tests, and rct and apt with --health)" },
+
+	{ "min-entropy", 'M', 0, 0,
+	  "Estimate the min-entropy per bit of the input, with the SP "
+	  "800-90B most common value, collision, Markov and compression "
+	  "estimators" },
+
+	{ "sequence", 'q', "n", 0,
+	  "Also run the SP 800-22 tests on back-to-back sequences of n "
+	  "bits of input, a multiple of 8 from 20000 (default: 0, off)" },
+
+	{ "sequence-tests", 'Q', "list", 0,
+	  "SP 800-22 tests run by --sequence, comma-separated: frequency, "
+	  "block_frequency, runs, longest_run, rank, linear_complexity, "
+	  "serial, approximate_entropy and cusum (default: all, rank from "
+	  "38912 bits, linear_complexity from 1000000)" },
+
+	{ "sequence-sample", 'k', "n", 0,
+	  "Only test one sequence in n for --sequence (default: 1)" },
+
+	{ "spectral", 'F', "n", 0,
+	  "Also run the SP 800-22 discrete Fourier transform test on "
+	  "back-to-back windows of n bits of input, a power of two from "
+	  "1024 to 1048576 (default: 0, off)" },
+
+	{ "autocorrelation", 'a', "n", 0,
+	  "Also track the correlation of every input bit with the n bits "
+	  "before it, n up to 8192 (default: 0, off)" },
+
+	{ "autocorrelation-alert", 'A', "z", 0,
+	  "Report the lags of --autocorrelation whose z-score is z or more "
+	  "in magnitude (default: 6)" },
+
+	{ "stats-shm", 'S', "name", 0,
+	  "Keep statistics in the shared memory segment name, for rngstat" },
+
+	{ "read-size", 'r', "size", 0,
+	  "Read up to size bytes of input at a time, suffixes K, M and G "
+	  "are allowed (default: 256K)" },
+
 	{ 0 },
 };
 
 struct arguments {
 	unsigned long int blockstats;
-	uint64_t timedstats;		/* microseconds */
+	uint64_t timedstats;		/* nanoseconds */
 	int pipemode;
 	unsigned long int blockcount;
+	int engine;
+	unsigned int threads;
+	size_t readsize;
+	const char *input;
+	unsigned long int sample;
+	stat_format_t statsformat;
+	const char *metrics;
+	const char *shm;
+	int drift;
+	unsigned int stride;
+	unsigned int health;
+	double entropy;
+	unsigned int tests;
+	int minentropy;
+	uint64_t sequence;
+	unsigned int sequencetests;
+	unsigned int sequencesample;
+	uint64_t spectral;
+	unsigned int autocorr;
+	double autocorralert;
 };
 
 static struct arguments default_arguments = {
@@ -97,6 +220,26 @@ static struct arguments default_arguments = {
 	.timedstats	= 0,
 	.pipemode	= 0,
 	.blockcount	= 0,
+	.engine		= FIPS_ENGINE_AUTO,
+	.threads	= 1,
+	.readsize	= 256 * 1024,
+	.input		= NULL,
+	.sample		= 1,
+	.statsformat	= STAT_FORMAT_TEXT,
+	.metrics	= NULL,
+	.shm		= NULL,
+	.drift		= 0,
+	.stride		= 0,
+	.health		= 0,
+	.entropy	= 0.0,
+	.tests		= 0,
+	.minentropy	= 0,
+	.sequence	= 0,
+	.sequencetests	= 0,		/* sts_tests_default() */
+	.sequencesample	= 1,
+	.spectral	= 0,
+	.autocorr	= 0,
+	.autocorralert	= 6.0,
 };
 
 static error_t parse_opt (int key, char *arg, struct argp_state *state)
@@ -128,10 +271,90 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
 		long int n;
 		char *p;
 		n = strtol(arg, &p, 10);
-		if ((p == arg) || (*p != 0) || (n < 0))
+		if ((p == arg) || (*p != 0) || (n < 0) ||
+		    (n > INT64_MAX / 1000000000LL))
+			argp_usage(state);
+		else
+			arguments->timedstats = 1000000000ULL * n;
+		break;
+	}
+
+	case 'f': {
+		int i;
+		for (i = 0; i < STAT_FORMAT_MAX; i++)
+			if (!strcmp(arg, stat_format_names[i]))
+				break;
+		if (i >= STAT_FORMAT_MAX)
+			argp_usage(state);
+		else
+			arguments->statsformat = i;
+		break;
+	}
+
+	case 'T': {
+		long int n;
+		char *p;
+		n = strtol(arg, &p, 10);
+		if ((p == arg) || (*p != 0) || (n < 1) || (n > 256))
+			argp_usage(state);
+		else
+			arguments->threads = n;
+		break;
+	}
+	case 'e': {
+		int n = fips_find_engine(arg);
+		if (n < 0)
+			argp_usage(state);
+		else
+			arguments->engine = n;
+		break;
+	}
+
+	case 'r': {
+		unsigned long long n;
+		unsigned int shift = 0;
+		char *p;
+		n = strtoull(arg, &p, 10);
+		switch (*p) {
+		case 'G': case 'g':
+			shift += 10;
+			/* fall through */
+		case 'M': case 'm':
+			shift += 10;
+			/* fall through */
+		case 'K': case 'k':
+			shift += 10;
+			p++;
+		}
+		/* range check before the shift, which could wrap */
+		if ((p == arg) || (*p != 0) || (n > (1ULL << 30) >> shift) ||
+		    ((n << shift) < FIPS_RNG_BUFFER_SIZE))
+			argp_usage(state);
+		else
+			arguments->readsize = n << shift;
+		break;
+	}
+
+	case 'i':
+		arguments->input = arg;
+		break;
+
+	case 'm':
+		arguments->metrics = arg;
+		break;
+
+	case 'S':
+		arguments->shm = arg;
+		break;
+
+	case 's': {
+		long int n;
+		char *p;
+		n = strtol(arg, &p, 10);
+		if ((p == arg) || (*p != 0) || (n < 1))
 			argp_usage(state);
 		else
-			arguments->timedstats = 1000000ULL * n;
+			arguments->sample = n;
 		break;
 	}
 
@@ -139,6 +362,118 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
 		arguments->pipemode = 1;
 		break;
 
+	case 'd':
+		arguments->drift = 1;
+		break;
+
+	case 'w': {
+		long int n;
+		char *p;
+		n = strtol(arg, &p, 10);
+		if ((p == arg) || (*p != 0) || (n < 0) ||
+		    (n > FIPS_RNG_BUFFER_SIZE))
+			argp_usage(state);
+		else
+			arguments->stride = n;
+		break;
+	}
+	case 'H': {
+		long int n;
+		char *p;
+		n = strtol(arg, &p, 10);
+		if ((p == arg) || (*p != 0) ||
+		    ((n != 0) && (n != 1) && (n != 2) && (n != 4) && (n != 8)))
+			argp_usage(state);
+		else
+			arguments->health = n;
+		break;
+	}
+	case 'E': {
+		double h;
+		char *p;
+		h = strtod(arg, &p);
+		if ((p == arg) || (*p != 0) || !(h > 0.0) || (h > 8.0))
+			argp_usage(state);
+		else
+			arguments->entropy = h;
+		break;
+	}
+	case 'M':
+		arguments->minentropy = 1;
+		break;
+
+	case 'q': {
+		unsigned long long n;
+		char *p;
+		n = strtoull(arg, &p, 10);
+		if ((p == arg) || (*p != 0) || ((n != 0) &&
+		    ((n < STS_MIN_LENGTH) || (n > STS_MAX_LENGTH) || (n % 8))))
+			argp_usage(state);
+		else
+			arguments->sequence = n;
+		break;
+	}
+	case 'Q': {
+		unsigned int tests = sts_tests_parse(arg);
+		if (!tests)
+			argp_usage(state);
+		else
+			arguments->sequencetests = tests;
+		break;
+	}
+	case 'k': {
+		long int n;
+		char *p;
+		n = strtol(arg, &p, 10);
+		if ((p == arg) || (*p != 0) || (n < 1) || (n > INT_MAX))
+			argp_usage(state);
+		else
+			arguments->sequencesample = n;
+		break;
+	}
+	case 'F': {
+		unsigned long long n;
+		char *p;
+		n = strtoull(arg, &p, 10);
+		if ((p == arg) || (*p != 0) || ((n != 0) &&
+		    ((n < DFT_MIN_LENGTH) || (n > DFT_MAX_LENGTH) ||
+		     (n & (n - 1)))))
+			argp_usage(state);
+		else
+			arguments->spectral = n;
+		break;
+	}
+	case 'a': {
+		long int n;
+		char *p;
+		n = strtol(arg, &p, 10);
+		if ((p == arg) || (*p != 0) || (n < 0) ||
+		    (n > AUTOCORR_MAX_LAGS))
+			argp_usage(state);
+		else
+			arguments->autocorr = n;
+		break;
+	}
+	case 'A': {
+		double z;
+		char *p;
+		z = strtod(arg, &p);
+		if ((p == arg) || (*p != 0) || !(z > 0.0))
+			argp_usage(state);
+		else
+			arguments->autocorralert = z;
+		break;
+	}
+
+	case 'x': {
+		unsigned int tests = rng_tests_parse(arg);
+		if (!tests)
+			argp_usage(state);
+		else
+			arguments->tests = tests;
+		break;
+	}
+
 	default:
 		return ARGP_ERR_UNKNOWN;
 	}
@@ -150,30 +485,105 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
  * Globals
  */
 
-/* RNG Buffers */
-unsigned char rng_buffer[FIPS_RNG_BUFFER_SIZE];
+/* Input buffer, see input_get() */
+static struct {
+	unsigned char *buf;		/* arguments->readsize bytes, or
+					   the whole input file if mapped */
+	size_t head, tail;		/* Unconsumed data is buf[head..tail) */
+	uint64_t left;			/* Bytes left to read, see -c */
+	int mapped;			/* buf maps the input file */
+} input;
+
+/* Pipe-mode output, see xwrite() */
+static struct {
+	int splice;			/* stdout is a pipe, vmsplice() */
+	int spliced;			/* Blocks were vmspliced, see
+					   renew_buffer() */
+} output;
 
 /* Statistics */
-struct {
+struct rng_stats {
 	/* simple counters */
-	uint64_t bad_fips_blocks;	/* Blocks reproved by FIPS 140-2 */
-	uint64_t good_fips_blocks;	/* Blocks approved by FIPS 140-2 */
-	uint64_t fips_failures[N_FIPS_TESTS]; 	/* Breakdown of block
-					   failures per FIPS test */
+	uint64_t blocks;		/* Blocks tested */
+	uint64_t bad_fips_blocks;	/* Blocks reproved by FIPS 140-2, */
+	uint64_t good_fips_blocks;	/* approved by it, both 0 without
+					   FIPS tests (see --tests) */
+	uint64_t test_failures[N_RNG_TESTS];	/* Breakdown of block
+					   failures per test */
 	
 	uint64_t bytes_received;	/* Bytes read from input */
 	uint64_t bytes_sent;		/* Bytes sent to output */
 
 	/* performance timers */
-	struct rng_stat source_blockfill;	/* Block-receive time */
+	struct rng_stat source_blockfill;	/* Per-read() time */
 	struct rng_stat fips_blockfill;		/* FIPS run time */
 	struct rng_stat sink_blockfill;		/* Block-send time */
 
-	struct timeval progstart;	/* Program start time */
+	/* raw FIPS test statistics per block, see --drift */
+	struct rng_moments drift[N_FIPS_BLOCK_STATS];
+
+	/* sliding windows, see --stride */
+	uint64_t windows;		/* Windows tested */
+	uint64_t bad_windows;		/* Windows reproved by FIPS 140-2 */
+	uint64_t window_failures[N_FIPS_TESTS];
+
+	/* SP 800-90B health tests, see --health */
+	uint64_t bad_health_blocks;	/* Blocks failing any of them */
+
+	/* min-entropy estimators, see --min-entropy */
+	entropy_ctx_t entropy;
+
+	/* SP 800-22 tests, see --sequence */
+	uint64_t sequences;		/* Sequences tested */
+	uint64_t sequence_failures[N_STS_PVALUES];	/* P-values below
+					   STS_ALPHA */
+	uint64_t sequence_bins[N_STS_PVALUES][STS_BINS];	/* P-values,
+					   see sts_bin() */
+
+	/* SP 800-22 DFT test, see --spectral */
+	uint64_t spectral_windows;	/* Windows tested */
+	uint64_t spectral_failures;	/* P-values below STS_ALPHA */
+	uint64_t spectral_bins[STS_BINS];	/* P-values */
+
+	/* bit autocorrelation, see --autocorrelation */
+	autocorr_summary_t autocorr;
+
+	uint64_t progstart;		/* Program start time, in ticks */
+	uint64_t taken;			/* Time of a snapshot, in ticks */
 } rng_stats;
 
 /* Logic and contexts */
-static fips_ctx_t fipsctx;		/* Context for the FIPS tests */
+static struct {				/* Tests run, see --tests */
+	unsigned int tests;
+	unsigned int engines;		/* Engines run on any block */
+	unsigned int ordered;		/* Engines run in input order */
+	struct rng_test_params params;
+	rng_test_set_t *blocks;		/* engines, in the serial loop */
+	rng_test_set_t *stream;		/* ordered, in the booking thread */
+} testing;
+static struct {				/* Sliding window, see --stride */
+	fips_window_t *w;
+	int *results;			/* Per window, for one block */
+} window;
+static struct {				/* SP 800-22, see --sequence */
+	sts_ctx_t *ctx;
+	double *pvalues;		/* Per sequence, for one block */
+} sequence;
+static struct {				/* SP 800-22 DFT, see --spectral */
+	dft_ctx_t *ctx;
+	double *pvalues;		/* Per window, for one block */
+} spectral;
+static autocorr_ctx_t *autocorr;	/* See --autocorrelation */
+static struct {				/* Pipelined mode, see below */
+	struct rng_batch *batches;
+	unsigned int size;		/* Batches allocated */
+	pthread_t *thread;		/* Reader, then testers */
+	unsigned int nthreads;		/* Threads started */
+	volatile int stop;		/* Reader and testers must return */
+	struct rng_ring *free;		/* writer -> reader */
+	struct rng_ring *filled;	/* reader -> testers */
+	struct rng_ring *tested;	/* testers -> writer */
+} pipeline;
 static int exitstatus = EXIT_SUCCESS;	/* Exit status */
 
 /* Command line arguments and processing */
@@ -216,13 +626,46 @@ static void init_sighandlers(void)
 }
 
 
-static int xread(void *buf, size_t size)
+/*
+ * Reads at least min and at most max bytes into buf, as few read() calls
+ * as it takes.  Each read() is timed into *timer and counted in
+ * *received.  Returns the number of bytes read, or -1 on error, signal,
+ * or end of input.
+ */
+static void stats_idle(void);
+
+/*
+ * The pipeline reader can only be cancelled in read(), see
+ * stop_pipeline(): it holds nothing there, stdio locks included.
+ */
+static ssize_t xread_once(void *buf, size_t size)
+{
+	ssize_t r;
+	int state;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &state);
+	r = read(0, buf, size);
+	pthread_setcancelstate(state, NULL);
+	return r;
+}
+
+static ssize_t xread(void *buf, size_t min, size_t max,
+		     struct rng_stat *timer, uint64_t *received)
 {
+	uint64_t start;
 	size_t off = 0;
 	ssize_t r;
 
-	while (size) {
-		r = read(0, (unsigned char *)buf + off, size);
+	/* don't read past the last block -c asks for */
+	if ((max > input.left) && (input.left >= min))
+		max = input.left;
+
+	while (off < min) {
+		/* the pipeline reader is not the thread that keeps stats */
+		if (arguments->threads == 1)
+			stats_idle();
+		start = clock_ticks();
+		r = xread_once((unsigned char *)buf + off, max - off);
 		if (r < 0) {
 			if (gotsigterm) return -1;
 			if ((errno == EAGAIN) || (errno == EINTR)) continue;
@@ -234,197 +677,2447 @@ static int xread(void *buf, size_t size)
 					logprefix);
 			return -1;
 		}
+		update_nsectimer_stat(timer, start, clock_ticks());
 		off += r;
-		size -= r;
-		rng_stats.bytes_received += r;
+		input.left -= r;
+		*received += r;
 	}
 
-	if (size) {
+	if (off < min) {
 		fprintf(stderr,
 			"%serror reading input: %s\n", logprefix,
 			strerror(errno));
 		exitstatus = EXIT_IOERR;
 		return -1;
 	}
-	return 0;
+	return off;
 }
 
-static int xwrite(void *buf, size_t size)
+/*
+ * Zero-copy output
+ *
+ * When stdout is a pipe, good blocks are vmspliced into it: the pipe
+ * takes references to the pages of the buffer they sit in, rather than
+ * a copy.  A buffer must not change while those pages are queued, and
+ * there is no telling when that ends: the reader may splice them on
+ * into another pipe, which leaves ours empty.  So once any block was
+ * spliced, a buffer is never written to again: it is unmapped (the
+ * pipes keep its pages) and a fresh one mapped in before every refill.
+ */
+static void init_output(void)
 {
-	size_t off = 0;
-	ssize_t r;
-
-	while (size) {
-		r = write(1, (unsigned char *)buf + off, size);
-		if (r < 0) {
-			if (gotsigterm) return -1;
-			if ((errno == EAGAIN) || (errno == EINTR)) continue;
-			break;
-		} else if (!r) {
-			fprintf(stderr, 
-				"%swrite channel stuck\n", logprefix);
-			exitstatus = EXIT_IOERR;
-			return -1;
-		}
-		off += r;
-		size -= r;
-		rng_stats.bytes_sent += r;
-	}
+#ifdef __linux__
+	struct stat st;
 
-	if (size) {
-		fprintf(stderr,
-			"%serror writing to output: %s\n", logprefix,
-			strerror(errno));
-		exitstatus = EXIT_IOERR;
-		return -1;
-	}
-	return 0;
+	output.splice = arguments->pipemode && !fstat(1, &st) &&
+			S_ISFIFO(st.st_mode);
+#endif
 }
 
+/* Whether blocks may have been spliced from any buffer */
+static int output_spliced(void)
+{
+	return __atomic_load_n(&output.spliced, __ATOMIC_RELAXED);
+}
 
-static void init_rng_stats(void)
+static void *alloc_buffer(size_t size)
 {
-	memset(&rng_stats, 0, sizeof(rng_stats));
-	gettimeofday(&rng_stats.progstart, 0);
-	set_stat_prefix(logprefix);
+	void *p;
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "%sout of memory\n", logprefix);
+		exit(EXIT_OSERR);
+	}
+	return p;
 }
 
-static void dump_rng_stats(void)
+/* Returns buf if it can be written to, or else a fresh buffer */
+static void *renew_buffer(void *buf, size_t size)
 {
-	int j;
-	char buf[256];
-	struct timeval now;
+	if (!output_spliced())
+		return buf;
+	munmap(buf, size);
+	return alloc_buffer(size);
+}
 
-	fprintf(stderr, "%s\n", dump_stat_counter(buf, sizeof(buf),
-			"bits received from input",
-			rng_stats.bytes_received * 8));
-	if (arguments->pipemode)
-		fprintf(stderr, "%s\n", dump_stat_counter(buf, sizeof(buf),
-			"bits sent to output",
-			rng_stats.bytes_sent * 8));
-	fprintf(stderr, "%s\n", dump_stat_counter(buf, sizeof(buf),
-			"FIPS 140-2 successes",
-			rng_stats.good_fips_blocks));
-	fprintf(stderr, "%s\n", dump_stat_counter(buf, sizeof(buf),
-			"FIPS 140-2 failures",
-			rng_stats.bad_fips_blocks));
-	for (j = 0; j < N_FIPS_TESTS; j++)
-		fprintf(stderr, "%s\n", dump_stat_counter(buf, sizeof(buf),
-					fips_test_names[j],
-					rng_stats.fips_failures[j]));
-	fprintf(stderr, "%s\n", dump_stat_bw(buf, sizeof(buf),
-			"input channel speed", "bits",
-			&rng_stats.source_blockfill, FIPS_RNG_BUFFER_SIZE*8));
-	fprintf(stderr, "%s\n", dump_stat_bw(buf, sizeof(buf),
-			"FIPS tests speed", "bits",
-			&rng_stats.fips_blockfill, FIPS_RNG_BUFFER_SIZE*8));
-	if (arguments->pipemode)
-		fprintf(stderr, "%s\n", dump_stat_bw(buf, sizeof(buf),
-			"output channel speed", "bits",
-			&rng_stats.sink_blockfill, FIPS_RNG_BUFFER_SIZE*8));
+#ifdef HAVE_IO_URING
+/*
+ * io_uring backend
+ *
+ * Takes over read() and write() in the serial loop, if the kernel has
+ * io_uring.  Input is read into URING_SEGMENTS buffers of
+ * arguments->readsize bytes.  Regular files have reads in flight on
+ * every free segment, at explicit offsets; pipes and other streams have
+ * one at a time, since their reads must complete in order.  A segment is
+ * handed out only once it ends on a block boundary, so blocks never
+ * straddle two segments.
+ *
+ * Good blocks are echoed by one writev per segment, once the loop is
+ * done with it, and the segment is refilled only after its writev
+ * completes.  Writes go out one at a time, in order.  When stdout is a
+ * pipe, blocks are vmspliced by xwrite() instead.
+ */
+#define URING_SEGMENTS	4
+#define URING_WRITE	0x100		/* Tag bit for writes */
+
+enum {
+	SEG_FREE,			/* Ready to be read into */
+	SEG_READING,			/* Read in flight */
+	SEG_READY,			/* Being handed out */
+	SEG_DONE,			/* Handed out, not yet echoed */
+	SEG_WRITING			/* writev in flight */
+};
 
-	gettimeofday(&now, 0);
-	fprintf(stderr, "%sProgram run time: %" PRIu64 " microseconds\n",
-		logprefix, elapsed_time(&rng_stats.progstart, &now));
+struct uring_segment {
+	unsigned char *buf;
+	int state;
+	int eof;			/* Input ends in this segment */
+	uint64_t offset;		/* Input position of buf[0] */
+	size_t want;			/* Bytes to read into buf */
+	size_t fill;			/* Bytes read so far */
+	size_t pos;			/* Next byte to hand out */
+	struct iovec iov;		/* Read in flight */
+	uint64_t start;			/* When the request was queued */
+	struct iovec *out;		/* Good blocks, coalesced */
+	unsigned int nout, outdone;	/* iovecs queued, and written */
+};
+
+static struct {
+	struct rng_uring *ring;
+	struct uring_segment seg[URING_SEGMENTS];
+	unsigned int cur;		/* Segment being handed out */
+	unsigned int next;		/* Next segment to read into */
+	unsigned int wnext;		/* Next segment to echo */
+	uint64_t offset;		/* Input position of the next read */
+	uint64_t first;			/* Input position of the first block */
+	uint64_t limit;			/* Don't read past here, see -c */
+	int seekable;			/* Read at explicit offsets */
+	int reading, writing;		/* Requests in flight */
+	int eof, failed;
+} uring;
+
+static void init_uring(void)
+{
+	struct stat st;
+	off_t off = -1;
+	unsigned int i;
+
+	uring.ring = rng_uring_new(2 * URING_SEGMENTS);
+	if (!uring.ring)
+		return;		/* plain syscalls then */
+
+	if (!fstat(0, &st) && (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)))
+		off = lseek(0, 0, SEEK_CUR);
+	uring.seekable = (off >= 0);
+	uring.offset = uring.seekable ? off : 0;
+	uring.first = uring.offset + (arguments->pipemode ? 8 : 4);
+	uring.limit = UINT64_MAX;
+	if (input.left != UINT64_MAX)
+		uring.limit = uring.offset + input.left;
+
+	for (i = 0; i < URING_SEGMENTS; i++) {
+		uring.seg[i].buf = alloc_buffer(arguments->readsize);
+		uring.seg[i].out = calloc(arguments->readsize /
+					  FIPS_RNG_BUFFER_SIZE + 1,
+					  sizeof(struct iovec));
+		if (!uring.seg[i].out) {
+			fprintf(stderr, "%sout of memory\n", logprefix);
+			exit(EXIT_OSERR);
+		}
+	}
 }
 
-/* Return 32 bits of bootstrap data */
-static unsigned int discard_initial_data(void)
+/* Bytes from input position pos to the next block boundary */
+static size_t uring_misalign(uint64_t pos)
 {
-	unsigned char tempbuf[4];
+	if (pos < uring.first)
+		return uring.first - pos;
+	return (FIPS_RNG_BUFFER_SIZE -
+		(pos - uring.first) % FIPS_RNG_BUFFER_SIZE) %
+		FIPS_RNG_BUFFER_SIZE;
+}
 
-	/* Do full startup discards when in pipe mode */
-	if (arguments->pipemode)
-		if (xread(tempbuf, sizeof tempbuf)) exit(EXIT_FAIL);
+static void uring_queue_read(unsigned int i)
+{
+	struct uring_segment *s = &uring.seg[i];
+	size_t len = s->want - s->fill;
+
+	/* a stream segment is ready at any boundary, read up to one */
+	if (!uring.seekable && s->fill && uring_misalign(s->offset + s->fill))
+		len = uring_misalign(s->offset + s->fill);
+
+	s->iov.iov_base = s->buf + s->fill;
+	s->iov.iov_len = len;
+	s->start = clock_ticks();
+	rng_uring_readv(uring.ring, 0, &s->iov, 1,
+			uring.seekable ? (int64_t)(s->offset + s->fill) : -1,
+			i);
+}
 
-	/* Bootstrap data for FIPS tests */
-	if (xread(tempbuf, sizeof tempbuf)) exit(EXIT_FAIL);
+static void uring_queue_write(unsigned int i)
+{
+	struct uring_segment *s = &uring.seg[i];
 
-	return tempbuf[0] | (tempbuf[1] << 8) | 
-		(tempbuf[2] << 16) | (tempbuf[3] << 24);
+	s->start = clock_ticks();
+	rng_uring_writev(uring.ring, 1, s->out + s->outdone,
+			 s->nout - s->outdone, -1, i | URING_WRITE);
 }
 
-static void do_rng_fips_test_loop( void )
+/* Starts reads into free segments, and the next write */
+static void uring_start(void)
 {
-	int j;
-	int fips_result;
-	struct timeval start, stop, statdump, now;
-	unsigned long int statruns, runs;
+	struct uring_segment *s;
+	size_t size;
 
-	runs = statruns = 0;
-	gettimeofday(&statdump, 0);
-	while (!gotsigterm) {
-		gettimeofday(&start, 0);
-		if (xread(rng_buffer, sizeof(rng_buffer))) return;
-		gettimeofday(&stop, 0);
-		update_usectimer_stat(&rng_stats.source_blockfill, 
-				&start, &stop);
-
-		gettimeofday(&start, 0);
-		fips_result = fips_run_rng_test(&fipsctx, &rng_buffer);
-		gettimeofday (&stop, 0);
-		update_usectimer_stat(&rng_stats.fips_blockfill,
-				&start, &stop);
-
-		if (fips_result) {
-			rng_stats.bad_fips_blocks++;
-			for (j = 0; j < N_FIPS_TESTS; j++)
-				if (fips_result & fips_test_mask[j])
-					rng_stats.fips_failures[j]++;
-		} else {
-			rng_stats.good_fips_blocks++;
-			if (arguments->pipemode) {
-				gettimeofday(&start, 0);
-				if (xwrite(rng_buffer, sizeof(rng_buffer)))
-					return;
-				gettimeofday (&stop, 0);
-				update_usectimer_stat(
-					&rng_stats.sink_blockfill,
-					&start, &stop);
-			}
-		}
+	while (!uring.eof && !uring.failed &&
+	       (uring.seekable || !uring.reading)) {
+		s = &uring.seg[uring.next];
+		if ((s->state != SEG_FREE) || (uring.offset >= uring.limit))
+			break;
 
-		if (arguments->blockcount &&
-		    (++runs >= arguments->blockcount)) break;
+		/* whole blocks, after the bootstrap bytes */
+		size = arguments->readsize;
+		if (uring.offset < uring.first)
+			size -= uring.first - uring.offset;
+		size -= size % FIPS_RNG_BUFFER_SIZE;
+		if (uring.offset < uring.first)
+			size += uring.first - uring.offset;
+		if (size > uring.limit - uring.offset)
+			size = uring.limit - uring.offset;
+
+		s->buf = renew_buffer(s->buf, arguments->readsize);
+		s->offset = uring.offset;
+		s->want = size;
+		s->fill = s->pos = 0;
+		s->nout = s->outdone = 0;
+		s->eof = 0;
+		s->state = SEG_READING;
+		uring_queue_read(uring.next);
+		uring.reading++;
+		if (uring.seekable)
+			uring.offset += size;
+		uring.next = (uring.next + 1) % URING_SEGMENTS;
+	}
 
-		gettimeofday(&now, 0);
-		if ((arguments->blockstats && 
-		     (++statruns >= arguments->blockstats)) ||
-		    (arguments->timedstats &&
-		     (elapsed_time(&statdump, &now) > arguments->timedstats))) {
-			dump_rng_stats();
-			gettimeofday(&statdump, 0);
-			statruns = 0;
+	while (!uring.writing && !uring.failed) {
+		s = &uring.seg[uring.wnext];
+		if (s->state != SEG_DONE)
+			break;
+		if (s->nout) {
+			s->state = SEG_WRITING;
+			uring_queue_write(uring.wnext);
+			uring.writing++;
+		} else {
+			s->state = SEG_FREE;
 		}
+		uring.wnext = (uring.wnext + 1) % URING_SEGMENTS;
 	}
 }
 
-int main(int argc, char **argv)
+static void uring_read_done(unsigned int i, int res)
 {
-	argp_parse(&argp, argc, argv, 0, 0, arguments);
+	struct uring_segment *s = &uring.seg[i];
+
+	uring.reading--;
+	if ((res == -EINTR) || (res == -EAGAIN)) {
+		uring_queue_read(i);
+		uring.reading++;
+		return;
+	} else if (res < 0) {
+		fprintf(stderr, "%serror reading input: %s\n", logprefix,
+			strerror(-res));
+		exitstatus = EXIT_IOERR;
+		uring.failed = 1;
+		return;
+	}
 
-	if (!arguments->pipemode)
-		fprintf(stderr, "%s\n\n",
-			argp_program_version);
+	if (res) {
+		update_nsectimer_stat(&rng_stats.source_blockfill,
+				      s->start, clock_ticks());
+		rng_stats.bytes_received += res;
+		s->fill += res;
+	} else {
+		s->eof = uring.eof = 1;
+	}
 
-	init_sighandlers();
+	if (s->eof || (s->fill == s->want) ||
+	    (!uring.seekable && !uring_misalign(s->offset + s->fill))) {
+		s->state = SEG_READY;
+		if (!uring.seekable)
+			uring.offset = s->offset + s->fill;
+	} else {
+		uring_queue_read(i);
+		uring.reading++;
+	}
+}
 
-	/* Init data structures */
-	init_rng_stats();
+static void uring_write_done(unsigned int i, int res)
+{
+	struct uring_segment *s = &uring.seg[i];
+	uint64_t blocks = 0, nsec;
+	unsigned int j;
+
+	uring.writing--;
+	if ((res == -EINTR) || (res == -EAGAIN)) {
+		res = 0;
+	} else if (res < 0) {
+		fprintf(stderr, "%serror writing to output: %s\n", logprefix,
+			strerror(-res));
+		exitstatus = EXIT_IOERR;
+		uring.failed = 1;
+		return;
+	}
 
-	if (!arguments->pipemode)
-		fprintf(stderr, "%sstarting FIPS tests...\n",
-			logprefix);
+	rng_stats.bytes_sent += res;
+	while ((s->outdone < s->nout) &&
+	       ((size_t)res >= s->out[s->outdone].iov_len)) {
+		res -= s->out[s->outdone].iov_len;
+		blocks += s->out[s->outdone].iov_len / FIPS_RNG_BUFFER_SIZE;
+		s->outdone++;
+	}
+	if (s->outdone < s->nout) {
+		/* short write, carry on from where it stopped */
+		s->out[s->outdone].iov_base =
+			(unsigned char *)s->out[s->outdone].iov_base + res;
+		s->out[s->outdone].iov_len -= res;
+	}
 
-	/* Bootstrap FIPS tests */
-	fips_init(&fipsctx, discard_initial_data());
+	/* book every block the writev finished */
+	nsec = elapsed_ns(s->start, clock_ticks());
+	for (j = 0; j < blocks; j++)
+		update_stat(&rng_stats.sink_blockfill, nsec / blocks);
 
-	do_rng_fips_test_loop();
-	
-	dump_rng_stats();
+	if (s->outdone < s->nout) {
+		uring_queue_write(i);
+		uring.writing++;
+	} else {
+		s->state = SEG_FREE;
+	}
+}
+
+/*
+ * Submits what's queued and handles the completions that came in,
+ * waiting for one if wait is non-zero.  Returns -1 on signals.
+ */
+static int uring_run(int wait)
+{
+	uint64_t tag;
+	int res;
+
+	uring_start();
+	if (rng_uring_submit(uring.ring, wait) && (errno != EINTR)) {
+		fprintf(stderr, "%sio_uring: %s\n", logprefix,
+			strerror(errno));
+		exitstatus = EXIT_OSERR;
+		uring.failed = 1;
+	}
+	while (!rng_uring_reap(uring.ring, &tag, &res)) {
+		if (tag & URING_WRITE)
+			uring_write_done(tag & ~URING_WRITE, res);
+		else
+			uring_read_done(tag, res);
+	}
+	return gotsigterm ? -1 : 0;
+}
+
+/* See input_get_some() */
+static size_t uring_get(unsigned char **data, size_t size, size_t max)
+{
+	struct uring_segment *s;
+	size_t have;
+
+	for (;;) {
+		s = &uring.seg[uring.cur];
+		if (uring.failed)
+			return 0;
+		if (s->state == SEG_READY) {
+			have = s->fill - s->pos;
+			if (have >= size) {
+				if (have > max)
+					have = max;
+				have -= have % size;
+				*data = s->buf + s->pos;
+				s->pos += have;
+				return have;
+			}
+			if (s->eof) {
+				if (!arguments->pipemode)
+					fprintf(stderr, "%sentropy source "
+						"exhausted!\n", logprefix);
+				return 0;
+			}
+			/* used up, on to the next one */
+			s->state = SEG_DONE;
+			uring.cur = (uring.cur + 1) % URING_SEGMENTS;
+			if (uring_run(0))
+				return 0;
+		} else {
+			/* wait for the read, or for the write that
+			 * frees the segment for it */
+			uring_start();
+			stats_idle();
+			if ((!uring.reading && !uring.writing) ||
+			    uring_run(1))
+				return 0;
+		}
+	}
+}
+
+/*
+ * Queues a good block for output, it must come from the last call of
+ * uring_get()
+ */
+static void uring_output(const void *buf)
+{
+	struct uring_segment *s = &uring.seg[uring.cur];
+	struct iovec *iov;
+
+	/* grow the last run of blocks if buf follows it */
+	if (s->nout) {
+		iov = &s->out[s->nout - 1];
+		if ((const unsigned char *)iov->iov_base + iov->iov_len == buf) {
+			iov->iov_len += FIPS_RNG_BUFFER_SIZE;
+			return;
+		}
+	}
+	iov = &s->out[s->nout++];
+	iov->iov_base = (void *)buf;
+	iov->iov_len = FIPS_RNG_BUFFER_SIZE;
+}
+
+/* Waits for all good blocks to be written out */
+static void uring_flush(void)
+{
+	struct uring_segment *s = &uring.seg[uring.cur];
+
+	if (s->state == SEG_READY) {
+		s->state = SEG_DONE;
+		uring.cur = (uring.cur + 1) % URING_SEGMENTS;
+	}
+	/* no new reads */
+	uring.eof = 1;
+	while (!uring.failed &&
+	       (uring.writing || (uring.seg[uring.wnext].state == SEG_DONE)))
+		if (uring_run(uring.writing))
+			break;
+}
+#endif /* HAVE_IO_URING */
+
+/*
+ * Input is read up to arguments->readsize bytes at a time into one
+ * buffer, and handed out from there without copying.  Only an incomplete
+ * block at the end of the buffer is moved to its start, to make room
+ * for the next read.
+ *
+ * A regular file given with --input is mapped instead, and handed out
+ * straight from the mapping.  Anything else is read like stdin.
+ */
+static void map_input(void)
+{
+	struct stat st;
+	void *p;
+	int fd;
+
+	fd = open(arguments->input, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%sunable to open %s: %s\n", logprefix,
+			arguments->input, strerror(errno));
+		exit(EXIT_IOERR);
+	}
+
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode) && (st.st_size > 0) &&
+	    ((uint64_t)st.st_size <= SIZE_MAX)) {
+		p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (p != MAP_FAILED) {
+			madvise(p, st.st_size, MADV_SEQUENTIAL);
+			input.buf = p;
+			input.tail = st.st_size;
+			input.mapped = 1;
+			close(fd);
+			return;
+		}
+	}
+
+	if (dup2(fd, 0) < 0) {
+		fprintf(stderr, "%sunable to read %s: %s\n", logprefix,
+			arguments->input, strerror(errno));
+		exit(EXIT_IOERR);
+	}
+	close(fd);
+}
+
+static void init_input(void)
+{
+	input.head = input.tail = 0;
+	input.left = UINT64_MAX;
+	if (arguments->blockcount)
+		input.left = (arguments->pipemode ? 8 : 4) +
+			(uint64_t)arguments->blockcount * FIPS_RNG_BUFFER_SIZE;
+
+	if (arguments->input)
+		map_input();
+	if (input.mapped) {
+		/* what a streaming run would read */
+		if (input.tail > input.left)
+			input.tail = input.left;
+		return;
+	}
+
+#ifdef HAVE_IO_URING
+	if (arguments->threads == 1) {
+		init_uring();
+		if (uring.ring)
+			return;
+	}
+#endif
+	input.buf = alloc_buffer(arguments->readsize);
+}
+
+/* Books what's left of a mapped input, which ends there */
+static void input_end(uint64_t *received)
+{
+	*received += input.tail - input.head;
+	input.head = input.tail;
+	if (!arguments->pipemode)
+		fprintf(stderr, "%sentropy source exhausted!\n", logprefix);
+}
+
+/*
+ * Hands out as many multiples of size bytes of input as there are
+ * buffered, up to max, in *data.  If there is less than size, more is
+ * read first.  size is at most FIPS_RNG_BUFFER_SIZE, and max at most
+ * arguments->readsize.
+ *
+ * Returns how many bytes, or 0 on error or end of input.  The data
+ * stays valid until the next call.
+ */
+static size_t input_get_some(unsigned char **data, size_t size, size_t max)
+{
+	unsigned char *p;
+	size_t have = input.tail - input.head;
+	ssize_t r;
+
+#ifdef HAVE_IO_URING
+	if (uring.ring)
+		return uring_get(data, size, max);
+#endif
+	if (input.mapped) {
+		if (have < size) {
+			input_end(&rng_stats.bytes_received);
+			return 0;
+		}
+	} else if (have < size) {
+		if (input.head && output_spliced()) {
+			p = alloc_buffer(arguments->readsize);
+			memcpy(p, input.buf + input.head, have);
+			munmap(input.buf, arguments->readsize);
+			input.buf = p;
+			input.head = 0;
+			input.tail = have;
+		} else if (input.head) {
+			memmove(input.buf, input.buf + input.head, have);
+			input.head = 0;
+			input.tail = have;
+		}
+		r = xread(input.buf + have, size - have,
+			  arguments->readsize - have,
+			  &rng_stats.source_blockfill,
+			  &rng_stats.bytes_received);
+		if (r < 0)
+			return 0;
+		input.tail += r;
+		have += r;
+	}
+	if (have > max)
+		have = max;
+	have -= have % size;
+	if (input.mapped)
+		rng_stats.bytes_received += have;
+	*data = input.buf + input.head;
+	input.head += have;
+	return have;
+}
+
+/* Returns the next size bytes of input, as input_get_some() would */
+static unsigned char *input_get(size_t size)
+{
+	unsigned char *p;
+
+	return input_get_some(&p, size, size) ? p : NULL;
+}
+
+/*
+ * Hands out up to size bytes of complete blocks from a mapped input, in
+ * *data.  Returns how many, 0 at the end of the input.
+ */
+static size_t input_get_blocks(unsigned char **data, size_t size,
+			       uint64_t *received)
+{
+	size_t have = input.tail - input.head;
+
+	if (have > size)
+		have = size;
+	have -= have % FIPS_RNG_BUFFER_SIZE;
+	if (!have) {
+		input_end(received);
+		return 0;
+	}
+	*data = input.buf + input.head;
+	input.head += have;
+	*received += have;
+	return have;
+}
+
+/*
+ * Moves up to size bytes of buffered input to buf, returns how many.
+ * Once all of it has been taken, input_unget() can put back an
+ * incomplete block.
+ */
+static size_t input_take(void *buf, size_t size)
+{
+	size_t have = input.tail - input.head;
+
+	if (size > have)
+		size = have;
+	memcpy(buf, input.buf + input.head, size);
+	input.head += size;
+	return size;
+}
+
+static void input_unget(const void *buf, size_t size)
+{
+	if (!size)
+		return;
+	/* only written to here, it never goes to the output */
+	assert(input.head == input.tail && size < FIPS_RNG_BUFFER_SIZE);
+	memcpy(input.buf, buf, size);
+	input.head = 0;
+	input.tail = size;
+}
+
+static int xwrite(const void *buf, size_t size)
+{
+	size_t off = 0;
+	ssize_t r;
+
+	while (size) {
+#ifdef __linux__
+		if (output.splice) {
+			struct iovec iov = {
+				.iov_base = (unsigned char *)buf + off,
+				.iov_len = size,
+			};
+
+			r = vmsplice(1, &iov, 1, 0);
+			if ((r < 0) && (errno != EAGAIN) && (errno != EINTR) &&
+			    !gotsigterm) {
+				/* not supported here, copy instead */
+				output.splice = 0;
+				continue;
+			}
+			if ((r > 0) && !output.spliced)
+				__atomic_store_n(&output.spliced, 1,
+						 __ATOMIC_RELAXED);
+		} else
+#endif
+		r = write(1, (const unsigned char *)buf + off, size);
+		if (r < 0) {
+			if (gotsigterm) return -1;
+			if ((errno == EAGAIN) || (errno == EINTR)) continue;
+			break;
+		} else if (!r) {
+			fprintf(stderr, 
+				"%swrite channel stuck\n", logprefix);
+			exitstatus = EXIT_IOERR;
+			return -1;
+		}
+		off += r;
+		size -= r;
+		rng_stats.bytes_sent += r;
+	}
+
+	if (size) {
+		fprintf(stderr,
+			"%serror writing to output: %s\n", logprefix,
+			strerror(errno));
+		exitstatus = EXIT_IOERR;
+		return -1;
+	}
+	return 0;
+}
+
+
+/*
+ * The raw statistics of fips_block_stats_t, and their means for random
+ * data.  A run of exactly n equal bits is bounded by different bits, or
+ * by the ends of the block: there are (20000-n-1)/2^(n+2) + 2/2^(n+1)
+ * of them on average, in either half of the runs test buckets.
+ */
+static const struct {
+	const char *name;
+	const char *key;
+	double expected;
+} drift_stats[N_FIPS_BLOCK_STATS] = {
+	{ "monobit ones", "ones", 10000.0 },
+	{ "poker sum of squares", "poker", 1567187.5 },
+	{ "runs of 1 (bucket 1)", "runs_1", 2500.25 },
+	{ "runs of 2 (bucket 2)", "runs_2", 1250.0625 },
+	{ "runs of 3 (bucket 3)", "runs_3", 625.0 },
+	{ "runs of 4 (bucket 4)", "runs_4", 312.484375 },
+	{ "runs of 5 (bucket 5)", "runs_5", 156.234375 },
+	{ "runs of 6+ (bucket 6)", "runs_6", 156.21875 },
+	{ "runs of 1 (bucket 7)", "runs_7", 2500.25 },
+	{ "runs of 2 (bucket 8)", "runs_8", 1250.0625 },
+	{ "runs of 3 (bucket 9)", "runs_9", 625.0 },
+	{ "runs of 4 (bucket 10)", "runs_10", 312.484375 },
+	{ "runs of 5 (bucket 11)", "runs_11", 156.234375 },
+	{ "runs of 6+ (bucket 12)", "runs_12", 156.21875 },
+};
+
+/*
+ * Structured statistics dumps, see --stats-format.  Every dump has the
+ * totals so far, and the change since the previous dump.
+ */
+static const char *counter_keys[4] = {
+	"bits_received", "bits_sent", "fips_successes", "fips_failures"
+};
+
+#define N_STAT_COUNTERS (4 + N_FIPS_TESTS)
+
+static struct {
+	int header;			/* CSV header written */
+	uint64_t time;			/* Time of the last dump, ticks */
+	uint64_t counter[N_STAT_COUNTERS];
+	uint64_t timer_sum[3];
+	uint64_t timer_samples[3];
+	char buf[8192];
+} statdump;
+
+static double bits_per_sec(uint64_t bits, uint64_t nsec)
+{
+	return nsec ? (1000000000.0 * bits) / nsec : 0.0;
+}
+
+/*
+ * Adds every statistic to rec.  Unless rec is taking a CSV header, the
+ * totals are kept for the interval fields of the next dump.
+ */
+static void record_rng_stats(struct stat_record *rec,
+			     const struct rng_stats *stats)
+{
+	static const double quantile[] = { 0.5, 0.9, 0.99, 0.999 };
+	static const char *qkey[] = { "p50", "p90", "p99", "p999" };
+	const struct {
+		const char *key;
+		const struct rng_stat *stat;
+	} timer[3] = {
+		{ "input", &stats->source_blockfill },
+		{ "fips", &stats->fips_blockfill },
+		{ "output", &stats->sink_blockfill },
+	};
+	uint64_t counter[N_STAT_COUNTERS];
+	uint64_t now = stats->taken;
+	char key[64];
+	unsigned int i, j;
+
+	counter[0] = stats->bytes_received * 8;
+	counter[1] = stats->bytes_sent * 8;
+	counter[2] = stats->good_fips_blocks;
+	counter[3] = stats->bad_fips_blocks;
+	for (i = 0; i < N_FIPS_TESTS; i++)
+		counter[4 + i] = stats->test_failures[i];
+
+	stat_record_u64(rec, "run_time_us",
+			elapsed_ns(stats->progstart, now) / 1000);
+	stat_record_u64(rec, "interval_us",
+			elapsed_ns(statdump.time, now) / 1000);
+	for (j = 0; j < 2; j++) {
+		const char *pre = j ? "interval_" : "";
+
+		for (i = 0; i < N_STAT_COUNTERS; i++) {
+			if (i < 4)
+				snprintf(key, sizeof(key), "%s%s",
+					 pre, counter_keys[i]);
+			else
+				snprintf(key, sizeof(key), "%sfips_%s",
+					 pre, rng_tests[i - 4].key);
+			stat_record_u64(rec, key, counter[i] -
+					(j ? statdump.counter[i] : 0));
+		}
+
+		for (i = 0; i < 3; i++) {
+			uint64_t sum, samples, bits;
+
+			sum = timer[i].stat->sum;
+			samples = timer[i].stat->num_samples;
+			if (j) {
+				sum -= statdump.timer_sum[i];
+				samples -= statdump.timer_samples[i];
+			}
+			/* reads vary in size, rate them by what they got */
+			if (!i)
+				bits = counter[0] - (j ? statdump.counter[0] : 0);
+			else
+				bits = samples * FIPS_RNG_BUFFER_SIZE * 8;
+			snprintf(key, sizeof(key), "%s%s_bps",
+				 pre, timer[i].key);
+			stat_record_double(rec, key, bits_per_sec(bits, sum));
+		}
+	}
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < sizeof(quantile)/sizeof(quantile[0]); j++) {
+			uint64_t v = hist_percentile(&timer[i].stat->hist,
+						     quantile[j]);
+
+			if (v > timer[i].stat->max)
+				v = timer[i].stat->max;
+			snprintf(key, sizeof(key), "%s_%s_ns",
+				 timer[i].key, qkey[j]);
+			stat_record_u64(rec, key, v);
+		}
+		snprintf(key, sizeof(key), "%s_max_ns", timer[i].key);
+		stat_record_u64(rec, key, timer[i].stat->max);
+	}
+	if (testing.tests & RNG_TESTS_HEALTH) {
+		stat_record_u64(rec, "health_failures",
+				stats->bad_health_blocks);
+		for (i = 0; i < N_RNG_TESTS; i++) {
+			if (!(rng_tests[i].mask & RNG_TESTS_HEALTH))
+				continue;
+			snprintf(key, sizeof(key), "health_%s",
+				 rng_tests[i].key);
+			stat_record_u64(rec, key, stats->test_failures[i]);
+		}
+	}
+	if (arguments->stride) {
+		stat_record_u64(rec, "windows", stats->windows);
+		stat_record_u64(rec, "window_failures", stats->bad_windows);
+		for (i = 0; i < N_FIPS_TESTS - 1; i++) {
+			snprintf(key, sizeof(key), "window_%s",
+				 rng_tests[i].key);
+			stat_record_u64(rec, key, stats->window_failures[i]);
+		}
+	}
+	if (arguments->minentropy) {
+		double est[N_ENTROPY_ESTIMATORS];
+
+		stat_record_double(rec, "min_entropy",
+				   entropy_estimate(&stats->entropy, est));
+		for (i = 0; i < N_ENTROPY_ESTIMATORS; i++) {
+			snprintf(key, sizeof(key), "min_entropy_%s",
+				 entropy_estimators[i].key);
+			stat_record_double(rec, key, est[i]);
+		}
+	}
+	if (arguments->sequence) {
+		stat_record_u64(rec, "sequences", stats->sequences);
+		for (i = 0; i < N_STS_PVALUES; i++) {
+			if (!(arguments->sequencetests &
+			      (1 << sts_pvalues[i].test)))
+				continue;
+			snprintf(key, sizeof(key), "sequence_%s",
+				 sts_pvalues[i].key);
+			stat_record_u64(rec, key, stats->sequence_failures[i]);
+			snprintf(key, sizeof(key), "sequence_%s_uniformity",
+				 sts_pvalues[i].key);
+			stat_record_double(rec, key,
+				sts_uniformity(stats->sequence_bins[i]));
+		}
+	}
+	if (arguments->spectral) {
+		stat_record_u64(rec, "spectral_windows",
+				stats->spectral_windows);
+		stat_record_u64(rec, "spectral_failures",
+				stats->spectral_failures);
+		stat_record_double(rec, "spectral_uniformity",
+				   sts_uniformity(stats->spectral_bins));
+	}
+	if (arguments->autocorr) {
+		const autocorr_summary_t *ac = &stats->autocorr;
+
+		stat_record_u64(rec, "autocorrelation_bits", ac->bits);
+		stat_record_u64(rec, "autocorrelation_alerts", ac->alerts);
+		stat_record_u64(rec, "autocorrelation_max_lag",
+				ac->top ? ac->lag[0].lag : 0);
+		stat_record_double(rec, "autocorrelation_max_z",
+				   ac->top ? ac->lag[0].z : 0.0);
+	}
+	for (i = 0; arguments->drift && (i < N_FIPS_BLOCK_STATS); i++) {
+		const struct rng_moments *m = &stats->drift[i];
+
+		snprintf(key, sizeof(key), "drift_%s_mean", drift_stats[i].key);
+		stat_record_double(rec, key, m->mean);
+		snprintf(key, sizeof(key), "drift_%s_sd", drift_stats[i].key);
+		stat_record_double(rec, key, moments_stddev(m));
+		snprintf(key, sizeof(key), "drift_%s_z", drift_stats[i].key);
+		stat_record_double(rec, key,
+			moments_zscore(m, drift_stats[i].expected));
+	}
+
+	if (rec->header)
+		return;
+	statdump.time = now;
+	memcpy(statdump.counter, counter, sizeof(counter));
+	for (i = 0; i < 3; i++) {
+		statdump.timer_sum[i] = timer[i].stat->sum;
+		statdump.timer_samples[i] = timer[i].stat->num_samples;
+	}
+}
+
+/* Formats a structured dump, and writes it to stderr at once */
+static void dump_rng_stats_record(const struct rng_stats *stats)
+{
+	struct stat_record rec;
+	size_t off = 0;
+	ssize_t r;
+
+	stat_record_init(&rec, arguments->statsformat,
+			 statdump.buf, sizeof(statdump.buf));
+	if (!statdump.header && (arguments->statsformat == STAT_FORMAT_CSV)) {
+		stat_record_begin(&rec, 1);
+		record_rng_stats(&rec, stats);
+		stat_record_end(&rec);
+		statdump.header = 1;
+	}
+	stat_record_begin(&rec, 0);
+	record_rng_stats(&rec, stats);
+	stat_record_end(&rec);
+
+	/* the buffer is sized for every field */
+	assert(!rec.overflow);
+
+	while (off < rec.len) {
+		r = write(2, rec.buf + off, rec.len - off);
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		off += r;
+	}
+}
+
+static void init_rng_stats(void)
+{
+	memset(&rng_stats, 0, sizeof(rng_stats));
+	rng_stats.progstart = clock_ticks();
+	statdump.time = rng_stats.progstart;
+	set_stat_prefix(logprefix);
+}
+
+/* The least min-entropy estimate, and every estimate */
+static char *dump_entropy(char *buf, size_t size, const entropy_ctx_t *ctx)
+{
+	double est[N_ENTROPY_ESTIMATORS];
+	size_t len;
+	int i;
+
+	len = snprintf(buf, size, "%sSP 800-90B min-entropy per bit: %.3f (",
+		       logprefix, entropy_estimate(ctx, est));
+	for (i = 0; (i < N_ENTROPY_ESTIMATORS) && (len < size); i++)
+		len += snprintf(buf + len, size - len, "%s%s=%.3f",
+				i ? "; " : "", entropy_estimators[i].key,
+				est[i]);
+	if (len < size)
+		snprintf(buf + len, size - len, ")");
+	return buf;
+}
+
+static void dump_rng_stats(const struct rng_stats *stats)
+{
+	int j;
+	char buf[256], name[64];
+	struct rng_ring_stat ring;
+
+	if (arguments->statsformat != STAT_FORMAT_TEXT) {
+		dump_rng_stats_record(stats);
+		return;
+	}
+
+	fprintf(stderr, "%s\n", dump_stat_counter(buf, sizeof(buf),
+			"bits received from input",
+			stats->bytes_received * 8));
+	if (arguments->pipemode)
+		fprintf(stderr, "%s\n", dump_stat_counter(buf, sizeof(buf),
+			"bits sent to output",
+			stats->bytes_sent * 8));
+	if (testing.tests & RNG_TESTS_FIPS) {
+		fprintf(stderr, "%s\n", dump_stat_counter(buf, sizeof(buf),
+				"FIPS 140-2 successes",
+				stats->good_fips_blocks));
+		fprintf(stderr, "%s\n", dump_stat_counter(buf, sizeof(buf),
+				"FIPS 140-2 failures",
+				stats->bad_fips_blocks));
+	}
+	for (j = 0; j < N_RNG_TESTS; j++)
+		if (rng_tests[j].mask & RNG_TESTS_FIPS & testing.tests)
+			fprintf(stderr, "%s\n", dump_stat_counter(buf,
+					sizeof(buf), rng_tests[j].name,
+					stats->test_failures[j]));
+	if (arguments->stride) {
+		fprintf(stderr, "%s\n", dump_stat_counter(buf, sizeof(buf),
+				"FIPS 140-2 windows tested",
+				stats->windows));
+		fprintf(stderr, "%s\n", dump_stat_counter(buf, sizeof(buf),
+				"FIPS 140-2 window failures",
+				stats->bad_windows));
+		for (j = 0; j < N_FIPS_TESTS - 1; j++) {
+			snprintf(name, sizeof(name), "%s (windows)",
+				 rng_tests[j].name);
+			fprintf(stderr, "%s\n", dump_stat_counter(buf,
+					sizeof(buf), name,
+					stats->window_failures[j]));
+		}
+	}
+	if (testing.tests & RNG_TESTS_HEALTH) {
+		fprintf(stderr, "%s\n", dump_stat_counter(buf, sizeof(buf),
+				"SP 800-90B health test failures",
+				stats->bad_health_blocks));
+		for (j = 0; j < N_RNG_TESTS; j++)
+			if (rng_tests[j].mask & RNG_TESTS_HEALTH &
+			    testing.tests)
+				fprintf(stderr, "%s\n", dump_stat_counter(buf,
+					sizeof(buf), rng_tests[j].name,
+					stats->test_failures[j]));
+	}
+	if (arguments->minentropy)
+		fprintf(stderr, "%s\n", dump_entropy(buf, sizeof(buf),
+						    &stats->entropy));
+	if (arguments->sequence) {
+		fprintf(stderr, "%s\n", dump_stat_counter(buf, sizeof(buf),
+				"SP 800-22 sequences tested",
+				stats->sequences));
+		for (j = 0; j < N_STS_PVALUES; j++)
+			if (arguments->sequencetests &
+			    (1 << sts_pvalues[j].test))
+				fprintf(stderr, "%s%s: %" PRIu64
+					" (uniformity=%.3f)\n", logprefix,
+					sts_pvalues[j].name,
+					stats->sequence_failures[j],
+					sts_uniformity(
+						stats->sequence_bins[j]));
+	}
+	if (arguments->spectral) {
+		fprintf(stderr, "%s\n", dump_stat_counter(buf, sizeof(buf),
+				"SP 800-22 DFT windows tested",
+				stats->spectral_windows));
+		fprintf(stderr, "%sSP 800-22 Discrete Fourier transform: %"
+			PRIu64 " (uniformity=%.3f)\n", logprefix,
+			stats->spectral_failures,
+			sts_uniformity(stats->spectral_bins));
+	}
+	if (arguments->autocorr) {
+		const autocorr_summary_t *ac = &stats->autocorr;
+		const double alert = arguments->autocorralert;
+
+		fprintf(stderr, "%s\n", dump_stat_counter(buf, sizeof(buf),
+				"autocorrelation bits compared", ac->bits));
+		fprintf(stderr, "%sAutocorrelation, lags 1 to %u: %u with "
+			"|z| >= %g (max z=%.2f at lag %u)\n", logprefix,
+			ac->lags, ac->alerts, alert,
+			ac->top ? ac->lag[0].z : 0.0,
+			ac->top ? ac->lag[0].lag : 0);
+		/* the largest ones, if more lags are over the threshold */
+		for (j = 0; j < ac->top; j++)
+			if ((ac->lag[j].z >= alert) || (ac->lag[j].z <= -alert))
+				fprintf(stderr, "%sAutocorrelation at lag %u: "
+					"z=%.2f\n", logprefix,
+					ac->lag[j].lag, ac->lag[j].z);
+	}
+	for (j = 0; arguments->drift && (j < N_FIPS_BLOCK_STATS); j++)
+		fprintf(stderr, "%s\n", dump_stat_moments(buf, sizeof(buf),
+					drift_stats[j].name, &stats->drift[j],
+					drift_stats[j].expected));
+	/* reads vary in size, rate them by their average size */
+	fprintf(stderr, "%s\n", dump_stat_bw(buf, sizeof(buf),
+			"input channel speed", "bits",
+			&stats->source_blockfill,
+			stats->source_blockfill.num_samples ?
+			stats->bytes_received * 8 /
+			stats->source_blockfill.num_samples : 0));
+	fprintf(stderr, "%s\n", dump_stat_latency(buf, sizeof(buf),
+			"input channel latency", &stats->source_blockfill));
+	fprintf(stderr, "%s\n", dump_stat_bw(buf, sizeof(buf),
+			"FIPS tests speed", "bits",
+			&stats->fips_blockfill, FIPS_RNG_BUFFER_SIZE*8));
+	fprintf(stderr, "%s\n", dump_stat_latency(buf, sizeof(buf),
+			"FIPS tests latency", &stats->fips_blockfill));
+	if (arguments->pipemode) {
+		fprintf(stderr, "%s\n", dump_stat_bw(buf, sizeof(buf),
+			"output channel speed", "bits",
+			&stats->sink_blockfill, FIPS_RNG_BUFFER_SIZE*8));
+		fprintf(stderr, "%s\n", dump_stat_latency(buf, sizeof(buf),
+			"output channel latency", &stats->sink_blockfill));
+	}
+	if (pipeline.filled) {
+		rng_ring_get_stat(pipeline.filled, &ring);
+		fprintf(stderr, "%s\n", dump_stat_ring(buf, sizeof(buf),
+			"tester queue", &ring));
+		rng_ring_get_stat(pipeline.tested, &ring);
+		fprintf(stderr, "%s\n", dump_stat_ring(buf, sizeof(buf),
+			"writer queue", &ring));
+	}
+
+	fprintf(stderr, "%sProgram run time: %" PRIu64 " microseconds\n",
+		logprefix,
+		elapsed_ns(stats->progstart, stats->taken) / 1000);
+}
+
+/* Return 32 bits of bootstrap data */
+static unsigned int discard_initial_data(void)
+{
+	unsigned char *tempbuf;
+
+	/* Do full startup discards when in pipe mode */
+	if (arguments->pipemode)
+		if (!input_get(4)) exit(EXIT_FAIL);
+
+	/* Bootstrap data for FIPS tests */
+	if (!(tempbuf = input_get(4))) exit(EXIT_FAIL);
+
+	return tempbuf[0] | (tempbuf[1] << 8) | 
+		(tempbuf[2] << 16) | (tempbuf[3] << 24);
+}
+
+/* Books the test result of a block */
+static void book_test_result(int result)
+{
+	int j;
+
+	rng_stats.blocks++;
+	if (testing.tests & RNG_TESTS_FIPS) {
+		if (result & RNG_TESTS_FIPS)
+			rng_stats.bad_fips_blocks++;
+		else
+			rng_stats.good_fips_blocks++;
+	}
+	if (result & RNG_TESTS_HEALTH)
+		rng_stats.bad_health_blocks++;
+	for (j = 0; j < N_RNG_TESTS; j++)
+		if (result & rng_tests[j].mask)
+			rng_stats.test_failures[j]++;
+}
+
+static void book_block_stats(const fips_block_stats_t *block)
+{
+	int j;
+
+	update_moments(&rng_stats.drift[0], block->ones);
+	update_moments(&rng_stats.drift[1], block->poker);
+	for (j = 0; j < 12; j++)
+		update_moments(&rng_stats.drift[2 + j], block->runs[j]);
+}
+
+/* Runs the engines that need every block in order on the next one */
+static int run_ordered_tests(const void *buf)
+{
+	int result;
+
+	rng_test_set_run(testing.stream, buf, 1, &result, NULL);
+	return result;
+}
+
+/* Slides the window over a block, and books the windows tested */
+static void book_windows(const void *buf)
+{
+	int i, j, n;
+
+	n = fips_window_slide(window.w, buf, FIPS_RNG_BUFFER_SIZE,
+			      window.results);
+	for (i = 0; i < n; i++) {
+		rng_stats.windows++;
+		if (!window.results[i])
+			continue;
+		rng_stats.bad_windows++;
+		for (j = 0; j < N_FIPS_TESTS; j++)
+			if (window.results[i] & rng_tests[j].mask)
+				rng_stats.window_failures[j]++;
+	}
+}
+
+/* Runs the SP 800-22 tests over a block, and books the sequences tested */
+static void book_sequences(const void *buf)
+{
+	double *pv;
+	int i, j, n;
+
+	n = sts_update(sequence.ctx, buf, FIPS_RNG_BUFFER_SIZE,
+		       sequence.pvalues);
+	for (i = 0; i < n; i++) {
+		rng_stats.sequences++;
+		pv = sequence.pvalues + i * N_STS_PVALUES;
+		for (j = 0; j < N_STS_PVALUES; j++) {
+			if (!(arguments->sequencetests &
+			      (1 << sts_pvalues[j].test)))
+				continue;
+			if (pv[j] < STS_ALPHA)
+				rng_stats.sequence_failures[j]++;
+			rng_stats.sequence_bins[j][sts_bin(pv[j])]++;
+		}
+	}
+}
+
+/* Runs the SP 800-22 DFT test over a block, and books the windows tested */
+static void book_spectral(const void *buf)
+{
+	int i, n;
+
+	n = dft_update(spectral.ctx, buf, FIPS_RNG_BUFFER_SIZE,
+		       spectral.pvalues);
+	for (i = 0; i < n; i++) {
+		rng_stats.spectral_windows++;
+		if (spectral.pvalues[i] < STS_ALPHA)
+			rng_stats.spectral_failures++;
+		rng_stats.spectral_bins[sts_bin(spectral.pvalues[i])]++;
+	}
+}
+
+/*
+ * Sends a good block to stdout, returns non-zero on error.  The write
+ * is timed if timed is non-zero.
+ */
+static int output_block(const void *buf, int timed)
+{
+	uint64_t start = 0;
+
+#ifdef HAVE_IO_URING
+	if (uring.ring && !output.splice) {
+		uring_output(buf);
+		return 0;
+	}
+#endif
+	if (timed)
+		start = clock_ticks();
+	if (xwrite(buf, FIPS_RNG_BUFFER_SIZE))
+		return -1;
+	if (timed)
+		update_nsectimer_stat(&rng_stats.sink_blockfill,
+				      start, clock_ticks());
+	return 0;
+}
+
+/*
+ * Shared memory statistics, see shmstats.h
+ *
+ * The thread that keeps rng_stats copies it to the segment every
+ * SHM_UPDATE_BLOCKS blocks, and before it may block on input, so that
+ * readers are never far behind.  That takes no system calls.
+ */
+#define SHM_UPDATE_BLOCKS	64
+
+static struct {
+	struct rng_shm_stats *seg;
+	unsigned int blocks;		/* Blocks since the last update */
+	uint64_t published;		/* Blocks booked at the last update */
+} shmstats;
+
+static void init_shm_stats(void)
+{
+	if (!arguments->shm)
+		return;
+	shmstats.seg = rng_shm_create(arguments->shm);
+	if (!shmstats.seg) {
+		fprintf(stderr, "%sunable to create shared memory segment "
+			"%s: %s\n", logprefix, arguments->shm,
+			strerror(errno));
+		exit(EXIT_OSERR);
+	}
+}
+
+static void update_shm_stats(void)
+{
+	struct rng_shm_stats *seg = shmstats.seg;
+
+	rng_shm_begin(seg);
+	seg->uptime_ns = elapsed_ns(rng_stats.progstart, clock_ticks());
+	seg->tests = testing.tests;
+	seg->features = (arguments->stride ? RNG_SHM_WINDOWS : 0) |
+			(arguments->sequence ? RNG_SHM_SEQUENCES : 0) |
+			(arguments->spectral ? RNG_SHM_SPECTRAL : 0);
+	seg->sequence_tests = arguments->sequence ?
+			      arguments->sequencetests : 0;
+	seg->bits_received = rng_stats.bytes_received * 8;
+	seg->bits_sent = rng_stats.bytes_sent * 8;
+	seg->blocks = rng_stats.blocks;
+	seg->good_fips_blocks = rng_stats.good_fips_blocks;
+	seg->bad_fips_blocks = rng_stats.bad_fips_blocks;
+	seg->bad_health_blocks = rng_stats.bad_health_blocks;
+	memcpy(seg->test_failures, rng_stats.test_failures,
+	       sizeof(seg->test_failures));
+	seg->windows = rng_stats.windows;
+	seg->bad_windows = rng_stats.bad_windows;
+	memcpy(seg->window_failures, rng_stats.window_failures,
+	       sizeof(seg->window_failures));
+	seg->sequences = rng_stats.sequences;
+	memcpy(seg->sequence_failures, rng_stats.sequence_failures,
+	       sizeof(seg->sequence_failures));
+	seg->spectral_windows = rng_stats.spectral_windows;
+	seg->spectral_failures = rng_stats.spectral_failures;
+	copy_stat(&seg->source, &rng_stats.source_blockfill);
+	copy_stat(&seg->fips, &rng_stats.fips_blockfill);
+	copy_stat(&seg->sink, &rng_stats.sink_blockfill);
+	rng_shm_end(seg);
+
+	shmstats.blocks = 0;
+	shmstats.published = rng_stats.blocks;
+}
+
+/* Leaves the final numbers in the segment, and removes it */
+static void done_shm_stats(void)
+{
+	if (!shmstats.seg)
+		return;
+	update_shm_stats();
+	rng_shm_destroy(shmstats.seg, arguments->shm);
+}
+
+/*
+ * Statistics reporter
+ *
+ * Dumps asked for with blockstats or timedstats, and the metrics
+ * socket, are served by a reporter thread, so testing never waits for
+ * stderr or for a client.  When a dump is due, the test loop copies
+ * rng_stats into a free snapshot and hands it over through a ring; the
+ * reporter writes it out and gives it back.
+ *
+ * Metrics only need the latest numbers, so they go through a triple
+ * buffer instead: the loop fills its back buffer and swaps it with the
+ * middle one, marking it new; the reporter swaps the middle one with
+ * the one it serves from when it is marked.  Neither side ever waits.
+ *
+ * The test loop only counts blocks.  For timedstats and metrics, the
+ * reporter raises a flag, and the loop takes the snapshot after the
+ * next block.  Before the loop may block on input, it also leaves a
+ * metrics snapshot, so stalled input does not stall metrics.  The
+ * reporter sleeps in poll() between requests.
+ */
+#define RNG_STAT_SNAPSHOTS	4
+#define REPORT_DUMP		0x01	/* Reporter wants a dump */
+#define REPORT_METRICS		0x02	/* Reporter wants metrics */
+#define METRICS_NEW		((uintptr_t)1)	/* Middle buffer is new */
+
+/* Metrics clients get the last snapshot if none comes in this long */
+#define METRICS_WAIT_NS		(100 * 1000000ULL)
+#define METRICS_CLIENTS		8
+#define METRICS_REQUEST_MAX	1024
+
+struct metrics_client {
+	int fd;
+	uint64_t since;			/* Connected, clock_monotonic_ns() */
+	uint64_t seq;			/* Snapshots seen when it connected */
+	size_t len;			/* Request bytes read */
+	int done;			/* Request read */
+	char req[METRICS_REQUEST_MAX];
+};
+
+static struct {
+	struct rng_stats *snap;		/* RNG_STAT_SNAPSHOTS + 3 snapshots */
+	struct rng_ring *free;		/* reporter -> test loop */
+	struct rng_ring *full;		/* test loop -> reporter */
+	int wake[2];			/* Pipe: a snapshot is ready, or stop */
+	pthread_t thread;
+	int want;			/* REPORT_* the reporter waits for */
+	int stop;			/* Test loop is done */
+	unsigned long int blocks;	/* Blocks since the last dump */
+
+	int listen;			/* Metrics socket, or -1 */
+	struct rng_stats *back;		/* Metrics: test loop fills it */
+	uintptr_t middle;		/* Metrics: latest, | METRICS_NEW */
+	struct rng_stats *front;	/* Metrics: reporter serves it */
+	uint64_t published;		/* Blocks booked in the latest */
+	uint64_t seq;			/* Metrics snapshots received */
+	struct metrics_client client[METRICS_CLIENTS];
+	unsigned int clients;
+	char buf[65536];		/* Metrics response */
+} reporter = { .listen = -1 };
+
+static void metrics_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%smetrics socket path too long: %s\n",
+			logprefix, path);
+		exit(EXIT_USAGE);
+	}
+	strcpy(addr.sun_path, path);
+
+	/* a socket left over by an earlier run, but nothing else */
+	if (!lstat(path, &st) && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if ((fd < 0) ||
+	    bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(fd, METRICS_CLIENTS)) {
+		fprintf(stderr, "%sunable to listen on %s: %s\n",
+			logprefix, path, strerror(errno));
+		exit(EXIT_OSERR);
+	}
+	reporter.listen = fd;
+}
+
+/* Formats stats in Prometheus text format, into reporter.buf */
+static size_t metrics_format(const struct rng_stats *stats, int http)
+{
+	static const char *channel[3] = { "input", "fips", "output" };
+	const struct rng_stat *timer[3] = {
+		&stats->source_blockfill,
+		&stats->fips_blockfill,
+		&stats->sink_blockfill,
+	};
+	struct stat_record rec;
+	size_t head = 0;
+	char labels[32];
+	uint64_t bits;
+	unsigned int i;
+
+	stat_record_init(&rec, STAT_FORMAT_TEXT,
+			 reporter.buf, sizeof(reporter.buf));
+	if (http) {
+		/* Content-Length goes in once the body is known */
+		stat_record_printf(&rec, "HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %10u\r\n\r\n", 0);
+		head = rec.len;
+	}
+
+	stat_record_printf(&rec,
+		"# HELP rngtest_input_bits_total Bits read from input.\n"
+		"# TYPE rngtest_input_bits_total counter\n"
+		"rngtest_input_bits_total %" PRIu64 "\n"
+		"# HELP rngtest_output_bits_total Bits of good blocks sent to output.\n"
+		"# TYPE rngtest_output_bits_total counter\n"
+		"rngtest_output_bits_total %" PRIu64 "\n"
+		"# HELP rngtest_fips_blocks_total Blocks tested, by result.\n"
+		"# TYPE rngtest_fips_blocks_total counter\n"
+		"rngtest_fips_blocks_total{result=\"success\"} %" PRIu64 "\n"
+		"rngtest_fips_blocks_total{result=\"failure\"} %" PRIu64 "\n"
+		"# HELP rngtest_fips_test_failures_total Blocks failing each FIPS 140-2 test.\n"
+		"# TYPE rngtest_fips_test_failures_total counter\n",
+		stats->bytes_received * 8, stats->bytes_sent * 8,
+		stats->good_fips_blocks, stats->bad_fips_blocks);
+	for (i = 0; i < N_FIPS_TESTS; i++)
+		stat_record_printf(&rec,
+			"rngtest_fips_test_failures_total{test=\"%s\"} %"
+			PRIu64 "\n", rng_tests[i].key,
+			stats->test_failures[i]);
+	if (testing.tests & RNG_TESTS_HEALTH) {
+		stat_record_printf(&rec,
+			"# HELP rngtest_health_test_failures_total Blocks failing "
+			"each SP 800-90B health test.\n"
+			"# TYPE rngtest_health_test_failures_total counter\n");
+		for (i = 0; i < N_RNG_TESTS; i++)
+			if (rng_tests[i].mask & RNG_TESTS_HEALTH)
+				stat_record_printf(&rec,
+					"rngtest_health_test_failures_total"
+					"{test=\"%s\"} %" PRIu64 "\n",
+					rng_tests[i].key,
+					stats->test_failures[i]);
+	}
+	if (arguments->minentropy) {
+		double est[N_ENTROPY_ESTIMATORS];
+
+		entropy_estimate(&stats->entropy, est);
+		stat_record_printf(&rec,
+			"# HELP rngtest_min_entropy_per_bit SP 800-90B "
+			"min-entropy estimates of the input.\n"
+			"# TYPE rngtest_min_entropy_per_bit gauge\n");
+		for (i = 0; i < N_ENTROPY_ESTIMATORS; i++)
+			stat_record_printf(&rec,
+				"rngtest_min_entropy_per_bit{estimator=\"%s\"} "
+				"%.3f\n", entropy_estimators[i].key, est[i]);
+	}
+	if (arguments->sequence) {
+		stat_record_printf(&rec,
+			"# HELP rngtest_sequences_total SP 800-22 sequences "
+			"tested.\n"
+			"# TYPE rngtest_sequences_total counter\n"
+			"rngtest_sequences_total %" PRIu64 "\n"
+			"# HELP rngtest_sequence_failures_total Sequences with "
+			"a P-value below 0.01, by SP 800-22 test.\n"
+			"# TYPE rngtest_sequence_failures_total counter\n",
+			stats->sequences);
+		for (i = 0; i < N_STS_PVALUES; i++)
+			if (arguments->sequencetests &
+			    (1 << sts_pvalues[i].test))
+				stat_record_printf(&rec,
+					"rngtest_sequence_failures_total"
+					"{test=\"%s\"} %" PRIu64 "\n",
+					sts_pvalues[i].key,
+					stats->sequence_failures[i]);
+	}
+	if (arguments->spectral)
+		stat_record_printf(&rec,
+			"# HELP rngtest_spectral_windows_total SP 800-22 DFT "
+			"windows tested.\n"
+			"# TYPE rngtest_spectral_windows_total counter\n"
+			"rngtest_spectral_windows_total %" PRIu64 "\n"
+			"# HELP rngtest_spectral_failures_total Windows with "
+			"a DFT test P-value below 0.01.\n"
+			"# TYPE rngtest_spectral_failures_total counter\n"
+			"rngtest_spectral_failures_total %" PRIu64 "\n",
+			stats->spectral_windows, stats->spectral_failures);
+	if (arguments->autocorr) {
+		const autocorr_summary_t *ac = &stats->autocorr;
+
+		stat_record_printf(&rec,
+			"# HELP rngtest_autocorrelation_alerts Lags whose "
+			"autocorrelation z-score is over the alert threshold.\n"
+			"# TYPE rngtest_autocorrelation_alerts gauge\n"
+			"rngtest_autocorrelation_alerts %u\n"
+			"# HELP rngtest_autocorrelation_z Autocorrelation "
+			"z-score of the lags with the largest ones.\n"
+			"# TYPE rngtest_autocorrelation_z gauge\n",
+			ac->alerts);
+		for (i = 0; i < ac->top; i++)
+			stat_record_printf(&rec,
+				"rngtest_autocorrelation_z{lag=\"%u\"} %.3f\n",
+				ac->lag[i].lag, ac->lag[i].z);
+	}
+
+	stat_record_printf(&rec,
+		"# HELP rngtest_bits_per_second Average speed while reading, "
+		"testing or writing.\n"
+		"# TYPE rngtest_bits_per_second gauge\n");
+	for (i = 0; i < 3; i++) {
+		/* reads vary in size, rate them by what they got */
+		bits = i ? timer[i]->num_samples * FIPS_RNG_BUFFER_SIZE * 8 :
+			   stats->bytes_received * 8;
+		stat_record_printf(&rec,
+			"rngtest_bits_per_second{channel=\"%s\"} %.3f\n",
+			channel[i], bits_per_sec(bits, timer[i]->sum));
+	}
+
+	stat_record_printf(&rec,
+		"# HELP rngtest_latency_seconds Time per read of input, "
+		"per block tested, and per block sent.\n"
+		"# TYPE rngtest_latency_seconds histogram\n");
+	for (i = 0; i < 3; i++) {
+		snprintf(labels, sizeof(labels), "channel=\"%s\"", channel[i]);
+		stat_record_histogram(&rec, "rngtest_latency_seconds", labels,
+				      timer[i], 1000000000.0);
+	}
+
+	stat_record_printf(&rec,
+		"# HELP rngtest_uptime_seconds Time since rngtest started.\n"
+		"# TYPE rngtest_uptime_seconds gauge\n"
+		"rngtest_uptime_seconds %.3f\n",
+		elapsed_ns(stats->progstart, stats->taken) / 1000000000.0);
+
+	/* the buffer is sized for every metric */
+	assert(!rec.overflow);
+
+	if (http) {
+		char length[11];
+
+		snprintf(length, sizeof(length), "%10u",
+			 (unsigned int)(rec.len - head));
+		memcpy(reporter.buf + head - 14, length, 10);
+	}
+	return rec.len;
+}
+
+static void metrics_close(unsigned int i)
+{
+	close(reporter.client[i].fd);
+	reporter.client[i] = reporter.client[--reporter.clients];
+}
+
+/* Takes in new clients, and reads what they asked for */
+static void metrics_poll(struct pollfd *pfd, uint64_t now)
+{
+	struct metrics_client *c;
+	unsigned int i;
+	ssize_t r;
+	int fd;
+
+	/* backwards, metrics_close() moves the last client to i */
+	for (i = reporter.clients; i-- > 0; ) {
+		c = &reporter.client[i];
+		if (c->done || !(pfd[i].revents & (POLLIN | POLLHUP | POLLERR)))
+			continue;
+		r = recv(c->fd, c->req + c->len, sizeof(c->req) - 1 - c->len,
+			 MSG_DONTWAIT);
+		if (r > 0) {
+			c->len += r;
+			c->req[c->len] = 0;
+		}
+		if ((r == 0) || strstr(c->req, "\r\n\r\n") ||
+		    strstr(c->req, "\n\n") || (c->len >= sizeof(c->req) - 1))
+			c->done = 1;
+		else if ((r < 0) && (errno != EAGAIN) && (errno != EINTR))
+			metrics_close(i);
+	}
+
+	while ((reporter.clients < METRICS_CLIENTS) &&
+	       ((fd = accept4(reporter.listen, NULL, NULL,
+			      SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)) {
+		c = &reporter.client[reporter.clients++];
+		c->fd = fd;
+		c->since = now;
+		c->seq = reporter.seq;
+		c->len = 0;
+		c->done = 0;
+		c->req[0] = 0;
+		__atomic_fetch_or(&reporter.want, REPORT_METRICS,
+				  __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Answers every client that sent its request and has a fresh snapshot,
+ * or that waited METRICS_WAIT_NS (or all of them, if force is set).
+ * HTTP requests get a HTTP response; anything else gets just the
+ * metrics, so that a plain connect (socat, nc -U) works too.
+ */
+static void metrics_serve(uint64_t now, int force)
+{
+	struct metrics_client *c;
+	unsigned int i;
+	size_t len;
+
+	for (i = reporter.clients; i-- > 0; ) {
+		c = &reporter.client[i];
+		if (!force && (now - c->since < METRICS_WAIT_NS) &&
+		    (!c->done || (reporter.seq == c->seq)))
+			continue;
+		len = metrics_format(reporter.front,
+				     !strncmp(c->req, "GET ", 4));
+		/* one try, a client that can't take it all misses out */
+		send(c->fd, reporter.buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		metrics_close(i);
+	}
+}
+
+static void *stats_reporter(void *arg)
+{
+	struct pollfd pfd[2 + METRICS_CLIENTS];
+	struct rng_stats *snap;
+	uintptr_t middle;
+	uint64_t now, next_dump = 0, due;
+	unsigned int i, nfds;
+	int asked = 0, timeout, stop;
+	char drain[64];
+
+	if (arguments->timedstats)
+		next_dump = clock_monotonic_ns() + arguments->timedstats;
+	for (;;) {
+		/* snapshots pushed before stop get popped below */
+		stop = __atomic_load_n(&reporter.stop, __ATOMIC_ACQUIRE);
+
+		/* sleep until a dump or a metrics client is due */
+		now = clock_monotonic_ns();
+		due = UINT64_MAX;
+		if (arguments->timedstats && !asked)
+			due = next_dump;
+		for (i = 0; i < reporter.clients; i++)
+			if (reporter.client[i].since + METRICS_WAIT_NS < due)
+				due = reporter.client[i].since +
+				      METRICS_WAIT_NS;
+		if (stop || (due <= now))
+			timeout = 0;
+		else if (due == UINT64_MAX)
+			timeout = -1;
+		else if (due - now > 60000000000ULL)
+			timeout = 60000;
+		else
+			timeout = (due - now + 999999) / 1000000;
+
+		for (i = 0; i < reporter.clients; i++) {
+			pfd[i].fd = reporter.client[i].fd;
+			pfd[i].events = POLLIN;
+		}
+		nfds = reporter.clients;
+		pfd[nfds].fd = reporter.wake[0];
+		pfd[nfds++].events = POLLIN;
+		if ((reporter.listen >= 0) && !stop &&
+		    (reporter.clients < METRICS_CLIENTS)) {
+			pfd[nfds].fd = reporter.listen;
+			pfd[nfds++].events = POLLIN;
+		}
+		if (poll(pfd, nfds, timeout) < 0)
+			continue;
+		now = clock_monotonic_ns();
+
+		while (read(reporter.wake[0], drain, sizeof(drain)) > 0)
+			;
+		if (reporter.listen >= 0)
+			metrics_poll(pfd, now);
+
+		if (arguments->timedstats && !asked && (now >= next_dump)) {
+			__atomic_fetch_or(&reporter.want, REPORT_DUMP,
+					  __ATOMIC_RELAXED);
+			asked = 1;
+		}
+
+		while ((snap = rng_ring_pop(reporter.full))) {
+			dump_rng_stats(snap);
+			rng_ring_push(reporter.free, snap);
+			asked = 0;
+			if (arguments->timedstats)
+				next_dump = clock_monotonic_ns() +
+					    arguments->timedstats;
+		}
+
+		if (reporter.listen >= 0) {
+			middle = __atomic_load_n(&reporter.middle,
+						 __ATOMIC_RELAXED);
+			if (middle & METRICS_NEW) {
+				middle = __atomic_exchange_n(&reporter.middle,
+					(uintptr_t)reporter.front,
+					__ATOMIC_ACQ_REL);
+				reporter.front = (struct rng_stats *)
+						 (middle & ~METRICS_NEW);
+				reporter.seq++;
+			}
+			metrics_serve(now, stop);
+		}
+		if (stop)
+			return NULL;
+	}
+}
+
+static void start_reporter(void)
+{
+	unsigned int i;
+	int err;
+
+	if (!arguments->blockstats && !arguments->timedstats &&
+	    !arguments->metrics)
+		return;
+
+	reporter.snap = calloc(RNG_STAT_SNAPSHOTS + 3,
+			       sizeof(struct rng_stats));
+	reporter.free = rng_ring_new(RNG_RING_SPSC, RNG_STAT_SNAPSHOTS);
+	reporter.full = rng_ring_new(RNG_RING_SPSC, RNG_STAT_SNAPSHOTS);
+	if (!reporter.snap || !reporter.free || !reporter.full) {
+		fprintf(stderr, "%sout of memory\n", logprefix);
+		exit(EXIT_OSERR);
+	}
+	for (i = 0; i < RNG_STAT_SNAPSHOTS; i++)
+		rng_ring_push(reporter.free, &reporter.snap[i]);
+	reporter.back = &reporter.snap[i++];
+	reporter.middle = (uintptr_t)&reporter.snap[i++];
+	reporter.front = &reporter.snap[i];
+
+	if (pipe(reporter.wake) ||
+	    fcntl(reporter.wake[0], F_SETFL, O_NONBLOCK) ||
+	    fcntl(reporter.wake[1], F_SETFL, O_NONBLOCK)) {
+		fprintf(stderr, "%sunable to create pipe: %s\n",
+			logprefix, strerror(errno));
+		exit(EXIT_OSERR);
+	}
+	if (arguments->metrics)
+		metrics_listen(arguments->metrics);
+
+	err = pthread_create(&reporter.thread, NULL, stats_reporter, NULL);
+	if (err) {
+		fprintf(stderr, "%sunable to create thread: %s\n",
+			logprefix, strerror(err));
+		exit(EXIT_OSERR);
+	}
+}
+
+/* If the wake pipe is full, the reporter is awake anyway */
+static void wake_reporter(void)
+{
+	(void)!write(reporter.wake[1], "", 1);
+}
+
+/*
+ * Waits for the reporter to write out every snapshot it was given, and
+ * to answer the metrics clients it has
+ */
+static void stop_reporter(void)
+{
+	if (!reporter.snap)
+		return;
+	__atomic_store_n(&reporter.stop, 1, __ATOMIC_RELEASE);
+	wake_reporter();
+	pthread_join(reporter.thread, NULL);
+	if (reporter.listen >= 0) {
+		close(reporter.listen);
+		unlink(arguments->metrics);
+	}
+}
+
+/* Copies rng_stats to a snapshot */
+static void snapshot_rng_stats(struct rng_stats *stats)
+{
+	stats->bad_fips_blocks = rng_stats.bad_fips_blocks;
+	stats->good_fips_blocks = rng_stats.good_fips_blocks;
+	memcpy(stats->test_failures, rng_stats.test_failures,
+	       sizeof(stats->test_failures));
+	stats->bytes_received = rng_stats.bytes_received;
+	stats->bytes_sent = rng_stats.bytes_sent;
+	copy_stat(&stats->source_blockfill, &rng_stats.source_blockfill);
+	copy_stat(&stats->fips_blockfill, &rng_stats.fips_blockfill);
+	copy_stat(&stats->sink_blockfill, &rng_stats.sink_blockfill);
+	memcpy(stats->drift, rng_stats.drift, sizeof(stats->drift));
+	stats->windows = rng_stats.windows;
+	stats->bad_windows = rng_stats.bad_windows;
+	memcpy(stats->window_failures, rng_stats.window_failures,
+	       sizeof(stats->window_failures));
+	stats->bad_health_blocks = rng_stats.bad_health_blocks;
+	stats->entropy = rng_stats.entropy;
+	stats->sequences = rng_stats.sequences;
+	memcpy(stats->sequence_failures, rng_stats.sequence_failures,
+	       sizeof(stats->sequence_failures));
+	memcpy(stats->sequence_bins, rng_stats.sequence_bins,
+	       sizeof(stats->sequence_bins));
+	stats->spectral_windows = rng_stats.spectral_windows;
+	stats->spectral_failures = rng_stats.spectral_failures;
+	memcpy(stats->spectral_bins, rng_stats.spectral_bins,
+	       sizeof(stats->spectral_bins));
+	if (autocorr)
+		autocorr_summarize(autocorr, arguments->autocorralert,
+				   &stats->autocorr);
+	stats->progstart = rng_stats.progstart;
+	stats->taken = clock_ticks();
+}
+
+/* Hands a snapshot to the reporter to dump */
+static void publish_dump(void)
+{
+	struct rng_stats *snap;
+
+	/* waits only if the reporter is all snapshots behind */
+	snap = rng_ring_pop_wait(reporter.free, &gotsigterm);
+	if (!snap)
+		return;
+	snapshot_rng_stats(snap);
+	reporter.blocks = 0;
+	rng_ring_push(reporter.full, snap);
+	wake_reporter();
+}
+
+/* Swaps a snapshot into the metrics triple buffer, wakes the reporter */
+static void publish_metrics(int wake)
+{
+	uintptr_t middle;
+
+	snapshot_rng_stats(reporter.back);
+	reporter.published = rng_stats.blocks;
+	middle = __atomic_exchange_n(&reporter.middle,
+				     (uintptr_t)reporter.back | METRICS_NEW,
+				     __ATOMIC_ACQ_REL);
+	reporter.back = (struct rng_stats *)(middle & ~METRICS_NEW);
+	if (wake)
+		wake_reporter();
+}
+
+/* Called before the thread that keeps the stats may block on input */
+static void stats_idle(void)
+{
+	if ((reporter.listen >= 0) &&
+	    (rng_stats.blocks != reporter.published))
+		publish_metrics(0);
+	if (shmstats.seg && (rng_stats.blocks != shmstats.published))
+		update_shm_stats();
+}
+
+/* Publishes statistics if blockstats or the reporter say so */
+static inline void check_stats_dump(void)
+{
+	unsigned int want = 0;
+
+	if (__atomic_load_n(&reporter.want, __ATOMIC_RELAXED))
+		want = __atomic_exchange_n(&reporter.want, 0,
+					   __ATOMIC_RELAXED);
+	if ((arguments->blockstats &&
+	     (++reporter.blocks >= arguments->blockstats)) ||
+	    (want & REPORT_DUMP))
+		publish_dump();
+	if (want & REPORT_METRICS)
+		publish_metrics(1);
+	if (shmstats.seg && (++shmstats.blocks >= SHM_UPDATE_BLOCKS))
+		update_shm_stats();
+}
+
+/*
+ * Picks the test engines.  Those that must see every block in order
+ * are run by the thread that books the results, the others where the
+ * blocks are tested.
+ */
+static void init_tests(void)
+{
+	unsigned int engines;
+	int i;
+
+	testing.tests = arguments->tests;
+	if (!testing.tests)
+		testing.tests = RNG_TESTS_FIPS |
+				(arguments->health ? RNG_TESTS_HEALTH : 0);
+	if (arguments->drift && !(testing.tests & RNG_TESTS_FIPS_BLOCK)) {
+		fprintf(stderr, "%s--drift needs the monobit, poker, runs or "
+			"long_run test\n", logprefix);
+		exit(EXIT_USAGE);
+	}
+
+	/* only the whole FIPS 140-2 battery has the statistics of --drift */
+	engines = rng_test_plan(testing.tests |
+				(arguments->drift ? RNG_TESTS_FIPS_BLOCK : 0));
+	for (i = 0; i < N_RNG_TEST_ENGINES; i++) {
+		if (!(engines & (1 << i)))
+			continue;
+		if (rng_test_engines[i].flags & RNG_ENGINE_ORDERED)
+			testing.ordered |= 1 << i;
+		else
+			testing.engines |= 1 << i;
+	}
+
+	testing.params.width = arguments->health ? arguments->health : 8;
+	testing.params.entropy = arguments->entropy;
+	testing.stream = rng_test_set_new(testing.tests, testing.ordered,
+					  &testing.params);
+	if (!testing.stream && (errno == EINVAL)) {
+		fprintf(stderr, "%s--entropy must be at most the sample "
+			"width of --health\n", logprefix);
+		exit(EXIT_USAGE);
+	} else if (!testing.stream) {
+		fprintf(stderr, "%sout of memory\n", logprefix);
+		exit(EXIT_OSERR);
+	}
+}
+
+/* Whether block n of the input is timed, one in arguments->sample */
+static int block_timed(uint64_t n)
+{
+	return !(n % arguments->sample);
+}
+
+/*
+ * Runs set on nblocks blocks in data, the first of them block n of the
+ * input.  The blocks between timed ones are run in one go, timed blocks
+ * alone, into timer.
+ */
+static void test_blocks(rng_test_set_t *set, const unsigned char *data,
+			unsigned int nblocks, uint64_t n, int *results,
+			fips_block_stats_t *stats, struct rng_stat *timer)
+{
+	unsigned int i, run;
+	uint64_t start;
+
+	for (i = 0; i < nblocks; i += run) {
+		run = 1;
+		if (block_timed(n + i)) {
+			start = clock_ticks();
+			rng_test_set_run(set, data + i * FIPS_RNG_BUFFER_SIZE,
+					 1, results + i, stats ? stats + i : NULL);
+			update_nsectimer_stat(timer, start, clock_ticks());
+			continue;
+		}
+		/* up to the next timed block */
+		run = arguments->sample - (n + i) % arguments->sample;
+		if (run > nblocks - i)
+			run = nblocks - i;
+		rng_test_set_run(set, data + i * FIPS_RNG_BUFFER_SIZE, run,
+				 results + i, stats ? stats + i : NULL);
+	}
+}
+
+/*
+ * Tests the input a buffer at a time: every whole block input_get_some()
+ * has is run through the engines at once, then booked one by one.
+ */
+static void do_rng_fips_test_loop( void )
+{
+	size_t nblocks = arguments->readsize / FIPS_RNG_BUFFER_SIZE;
+	fips_block_stats_t *stats = NULL;
+	unsigned char *data, *block;
+	unsigned long int runs = 0;
+	unsigned int i, n;
+	int *results, result;
+	uint64_t first;
+
+	results = calloc(nblocks, sizeof(*results));
+	if (arguments->drift)
+		stats = calloc(nblocks, sizeof(*stats));
+	if (!results || (arguments->drift && !stats)) {
+		fprintf(stderr, "%sout of memory\n", logprefix);
+		exit(EXIT_OSERR);
+	}
+
+	while (!gotsigterm) {
+		n = input_get_some(&data, FIPS_RNG_BUFFER_SIZE,
+				   nblocks * FIPS_RNG_BUFFER_SIZE) /
+		    FIPS_RNG_BUFFER_SIZE;
+		if (!n)
+			break;
+
+		first = rng_stats.blocks;
+		test_blocks(testing.blocks, data, n, first, results, stats,
+			    &rng_stats.fips_blockfill);
+
+		for (i = 0; i < n; i++) {
+			if (gotsigterm)
+				break;
+			block = data + i * FIPS_RNG_BUFFER_SIZE;
+			result = results[i] | run_ordered_tests(block);
+
+			book_test_result(result);
+			if (arguments->drift)
+				book_block_stats(&stats[i]);
+			if (window.w)
+				book_windows(block);
+			if (arguments->minentropy)
+				entropy_update(&rng_stats.entropy, block,
+					       FIPS_RNG_BUFFER_SIZE);
+			if (sequence.ctx)
+				book_sequences(block);
+			if (spectral.ctx)
+				book_spectral(block);
+			if (autocorr)
+				autocorr_update(autocorr, block,
+						FIPS_RNG_BUFFER_SIZE);
+			if (!result && arguments->pipemode &&
+			    output_block(block, block_timed(first + i)))
+				goto out;
+
+			if (arguments->blockcount &&
+			    (++runs >= arguments->blockcount))
+				goto out;
+
+			check_stats_dump();
+		}
+	}
+out:
+#ifdef HAVE_IO_URING
+	if (uring.ring)
+		uring_flush();
+#endif
+	free(results);
+	free(stats);
+}
+
+
+/*
+ * Pipelined mode
+ *
+ * A reader thread fills batches of blocks, arguments->threads tester
+ * threads run the FIPS tests on them, and the main thread books the
+ * results, echoes good blocks and dumps statistics, in input order.
+ * All statistics are kept by the main thread, so they come out exactly
+ * as in the serial loop.  Testers time the same blocks as the serial
+ * loop would, into their batch, which the main thread merges.
+ *
+ * Batches are handed around through lock-free rings: free batches go
+ * from the writer to the reader, filled ones to the testers, and tested
+ * ones to the writer, which puts them back in sequence order.  Each
+ * batch carries the 32 bits of input that precede it, so a tester can
+ * resume the continuous run test at the seam with fips_resume().
+ *
+ * The reader fills a batch with a single read() where it can: a batch
+ * holds as many blocks as fit in arguments->readsize.  A mapped input
+ * file isn't read at all, its batches point straight into the mapping,
+ * so the testers work on block-aligned shards of the file.
+ */
+#define RNG_BATCHES_PER_THREAD 4	/* Batches per tester */
+
+struct rng_batch {
+	uint64_t seq;			/* Position in the input */
+	uint64_t first;			/* Input block number of data[0] */
+	unsigned int nblocks;		/* Complete blocks in data */
+	uint64_t received;		/* Bytes read into the batch */
+	int last;			/* Input ends after this batch */
+	unsigned int prev32;		/* 32 bits of input before data */
+	struct rng_stat source;		/* Read time of the batch */
+	struct rng_stat fips;		/* Test time of its timed blocks */
+	int *results;			/* FIPS results, per block */
+	fips_block_stats_t *stats;	/* Raw statistics, per block, for
+					   --drift only */
+	unsigned char *data;		/* Blocks */
+};
+
+static void *pipeline_reader(void *arg)
+{
+	unsigned int prev32 = *(unsigned int *)arg;
+	size_t have, size = (arguments->readsize / FIPS_RNG_BUFFER_SIZE) *
+			    FIPS_RNG_BUFFER_SIZE;
+	unsigned long int blocks = 0;
+	struct rng_batch *b;
+	unsigned char *p;
+	uint64_t seq;
+	ssize_t r;
+	int last = 0;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	for (seq = 0; !last; seq++) {
+		b = rng_ring_pop_wait(pipeline.free, &pipeline.stop);
+		if (!b)
+			break;
+
+		b->seq = seq;
+		b->first = blocks;
+		b->received = 0;
+		b->prev32 = prev32;
+		clear_stat(&b->source);
+
+		if (input.mapped) {
+			have = input_get_blocks(&b->data, size, &b->received);
+			if (!have)
+				last = 1;
+			b->nblocks = have / FIPS_RNG_BUFFER_SIZE;
+		} else {
+			/* start with what's left over from the last read */
+			b->data = renew_buffer(b->data, size);
+			have = input_take(b->data, size);
+			if (have < FIPS_RNG_BUFFER_SIZE) {
+				r = xread(b->data + have,
+					  FIPS_RNG_BUFFER_SIZE - have,
+					  size - have, &b->source,
+					  &b->received);
+				if (r < 0)
+					last = 1;
+				else
+					have += r;
+			}
+			b->nblocks = have / FIPS_RNG_BUFFER_SIZE;
+			input_unget(b->data +
+				    b->nblocks * FIPS_RNG_BUFFER_SIZE,
+				    have - b->nblocks * FIPS_RNG_BUFFER_SIZE);
+		}
+
+		blocks += b->nblocks;
+		if ((arguments->blockcount &&
+		     (blocks >= arguments->blockcount)) || gotsigterm)
+			last = 1;
+		b->last = last;
+
+		if (b->nblocks) {
+			p = b->data + b->nblocks * FIPS_RNG_BUFFER_SIZE;
+			prev32 = p[-4] | (p[-3] << 8) | (p[-2] << 16) |
+				((unsigned int)p[-1] << 24);
+		}
+
+		/* never waits, there are as many slots as batches */
+		rng_ring_push_wait(pipeline.filled, b, &pipeline.stop);
+	}
+	return NULL;
+}
+
+static void *pipeline_tester(void *arg)
+{
+	rng_test_set_t *set = arg;
+	struct rng_test_params params = testing.params;
+	struct rng_batch *b;
+
+	while ((b = rng_ring_pop_wait(pipeline.filled, &pipeline.stop))) {
+		params.last32 = b->prev32;
+		params.resume = (b->seq != 0);
+		rng_test_set_init(set, &params);
+
+		clear_stat(&b->fips);
+		test_blocks(set, b->data, b->nblocks, b->first, b->results,
+			    b->stats, &b->fips);
+
+		rng_ring_push_wait(pipeline.tested, b, &pipeline.stop);
+	}
+	rng_test_set_free(set);
+	return NULL;
+}
+
+static void start_pipeline_thread(void *(*fn)(void *), void *arg)
+{
+	int err;
+
+	err = pthread_create(&pipeline.thread[pipeline.nthreads], NULL,
+			     fn, arg);
+	if (err) {
+		fprintf(stderr, "%sunable to create thread: %s\n",
+			logprefix, strerror(err));
+		exit(EXIT_OSERR);
+	}
+	pipeline.nthreads++;
+}
+
+/*
+ * Stops the reader and the testers, and waits for them to return.  The
+ * reader may be blocked in read(), cancelling it gets it out of there.
+ */
+static void stop_pipeline(void)
+{
+	unsigned int i;
+
+	__atomic_store_n(&pipeline.stop, 1, __ATOMIC_RELEASE);
+	if (pipeline.nthreads)
+		pthread_cancel(pipeline.thread[0]);
+	for (i = 0; i < pipeline.nthreads; i++)
+		pthread_join(pipeline.thread[i], NULL);
+	pipeline.nthreads = 0;
+}
+
+/* Frees the batches, once no thread uses them; the rings stay for stats */
+static void free_pipeline_batches(size_t size)
+{
+	struct rng_batch *b;
+	unsigned int i;
+
+	for (i = 0; pipeline.batches && (i < pipeline.size); i++) {
+		b = &pipeline.batches[i];
+		if (!input.mapped && b->data)
+			munmap(b->data, size);
+		free(b->results);
+		free(b->stats);
+	}
+	free(pipeline.batches);
+	pipeline.batches = NULL;
+}
+
+static void do_rng_fips_test_pipeline(unsigned int bootstrap)
+{
+	struct rng_batch *b, **pending;
+	unsigned long int runs = 0;
+	unsigned int i;
+	uint64_t seq;
+	int done = 0, result;
+	size_t nblocks = arguments->readsize / FIPS_RNG_BUFFER_SIZE;
+	rng_test_set_t **sets;
+
+	pipeline.size = arguments->threads * RNG_BATCHES_PER_THREAD;
+	pipeline.batches = calloc(pipeline.size, sizeof(struct rng_batch));
+	pipeline.thread = calloc(arguments->threads + 1, sizeof(pthread_t));
+	pending = calloc(pipeline.size, sizeof(*pending));
+	sets = calloc(arguments->threads, sizeof(*sets));
+	pipeline.free = rng_ring_new(RNG_RING_SPSC, pipeline.size);
+	pipeline.filled = rng_ring_new(RNG_RING_MPMC, pipeline.size);
+	pipeline.tested = rng_ring_new(RNG_RING_MPMC, pipeline.size);
+	if (!pipeline.batches || !pipeline.thread || !pending || !sets ||
+	    !pipeline.free || !pipeline.filled || !pipeline.tested)
+		goto oom;
+	for (i = 0; i < pipeline.size; i++) {
+		b = &pipeline.batches[i];
+		if (!input.mapped)
+			b->data = alloc_buffer(nblocks *
+					       FIPS_RNG_BUFFER_SIZE);
+		b->results = calloc(nblocks, sizeof(*b->results));
+		if (!b->results)
+			goto oom;
+		if (arguments->drift) {
+			b->stats = calloc(nblocks, sizeof(*b->stats));
+			if (!b->stats)
+				goto oom;
+		}
+		rng_ring_push(pipeline.free, b);
+	}
+	/* testers free their own set */
+	for (i = 0; i < arguments->threads; i++) {
+		sets[i] = rng_test_set_new(testing.tests, testing.engines,
+					   &testing.params);
+		if (!sets[i])
+			goto oom;
+	}
+
+	start_pipeline_thread(pipeline_reader, &bootstrap);
+	for (i = 0; i < arguments->threads; i++) {
+		start_pipeline_thread(pipeline_tester, sets[i]);
+		sets[i] = NULL;
+	}
+
+	for (seq = 0; !done; seq++) {
+		/* testers finish out of order, wait for the next batch */
+		while (!done && !pending[seq % pipeline.size]) {
+			stats_idle();
+			b = rng_ring_pop_wait(pipeline.tested, &gotsigterm);
+			if (!b)
+				done = 1;
+			else
+				pending[b->seq % pipeline.size] = b;
+		}
+		if (done)
+			break;
+		b = pending[seq % pipeline.size];
+		pending[seq % pipeline.size] = NULL;
+
+		rng_stats.bytes_received += b->received;
+		merge_stat(&rng_stats.source_blockfill, &b->source);
+		merge_stat(&rng_stats.fips_blockfill, &b->fips);
+		for (i = 0; (i < b->nblocks) && !done; i++) {
+			if (gotsigterm) {
+				done = 1;
+				break;
+			}
+
+			result = b->results[i] | run_ordered_tests(b->data +
+						i * FIPS_RNG_BUFFER_SIZE);
+			book_test_result(result);
+			if (b->stats)
+				book_block_stats(&b->stats[i]);
+			if (window.w)
+				book_windows(b->data +
+					     i * FIPS_RNG_BUFFER_SIZE);
+			if (arguments->minentropy)
+				entropy_update(&rng_stats.entropy, b->data +
+					       i * FIPS_RNG_BUFFER_SIZE,
+					       FIPS_RNG_BUFFER_SIZE);
+			if (sequence.ctx)
+				book_sequences(b->data +
+					       i * FIPS_RNG_BUFFER_SIZE);
+			if (spectral.ctx)
+				book_spectral(b->data +
+					      i * FIPS_RNG_BUFFER_SIZE);
+			if (autocorr)
+				autocorr_update(autocorr, b->data +
+						i * FIPS_RNG_BUFFER_SIZE,
+						FIPS_RNG_BUFFER_SIZE);
+			if (!result && arguments->pipemode)
+				if (output_block(b->data +
+						 i * FIPS_RNG_BUFFER_SIZE,
+						 block_timed(b->first + i))) {
+					done = 1;
+					break;
+				}
+
+			if (arguments->blockcount &&
+			    (++runs >= arguments->blockcount)) {
+				done = 1;
+				break;
+			}
+
+			check_stats_dump();
+		}
+		if (!done)
+			done = b->last;
+		rng_ring_push(pipeline.free, b);
+	}
+	stop_pipeline();
+
+out:
+	for (i = 0; sets && (i < arguments->threads); i++)
+		rng_test_set_free(sets[i]);
+	free(sets);
+	free(pending);
+	free(pipeline.thread);
+	free_pipeline_batches(nblocks * FIPS_RNG_BUFFER_SIZE);
+	return;
+
+oom:
+	fprintf(stderr, "%sout of memory\n", logprefix);
+	exitstatus = EXIT_OSERR;
+	goto out;
+}
+
+int main(int argc, char **argv)
+{
+	int i;
+
+	argp_parse(&argp, argc, argv, 0, 0, arguments);
+
+	if (!arguments->pipemode)
+		fprintf(stderr, "%s\n\n",
+			argp_program_version);
+
+	init_sighandlers();
+	init_clock();
+
+	/* Init data structures */
+	init_rng_stats();
+	init_shm_stats();
+
+	if (!arguments->pipemode)
+		fprintf(stderr, "%sstarting FIPS tests...\n",
+			logprefix);
+
+	if (fips_set_engine(arguments->engine) < 0) {
+		fprintf(stderr, "%sFIPS test engine %s not supported on "
+			"this CPU\n", logprefix,
+			fips_engine_names[arguments->engine]);
+		exit(EXIT_USAGE);
+	}
+
+	init_tests();
+	entropy_init(&rng_stats.entropy);
+	if (arguments->stride) {
+		window.w = fips_window_new(arguments->stride);
+		window.results = calloc(FIPS_RNG_BUFFER_SIZE /
+					arguments->stride + 1,
+					sizeof(*window.results));
+		if (!window.w || !window.results) {
+			fprintf(stderr, "%sout of memory\n", logprefix);
+			exit(EXIT_OSERR);
+		}
+	}
+
+	if (arguments->sequence) {
+		if (!arguments->sequencetests)
+			arguments->sequencetests =
+				sts_tests_default(arguments->sequence);
+		for (i = 0; i < N_STS_TESTS; i++)
+			if ((arguments->sequencetests & (1 << i)) &&
+			    (arguments->sequence < sts_test_min_length[i])) {
+				fprintf(stderr, "%sSP 800-22 test %s needs "
+					"sequences of %" PRIu64 " bits or "
+					"more\n", logprefix, sts_test_keys[i],
+					sts_test_min_length[i]);
+				exit(EXIT_USAGE);
+			}
+		sequence.ctx = sts_new(arguments->sequence,
+				       arguments->sequencetests,
+				       arguments->sequencesample);
+		sequence.pvalues = calloc((FIPS_RNG_BUFFER_SIZE * 8 /
+					   arguments->sequence + 1) *
+					  N_STS_PVALUES,
+					  sizeof(*sequence.pvalues));
+		if (!sequence.ctx || !sequence.pvalues) {
+			fprintf(stderr, "%sout of memory\n", logprefix);
+			exit(EXIT_OSERR);
+		}
+	}
+	if (arguments->spectral) {
+		spectral.ctx = dft_new(arguments->spectral);
+		spectral.pvalues = calloc(FIPS_RNG_BUFFER_SIZE * 8 /
+					  arguments->spectral + 1,
+					  sizeof(*spectral.pvalues));
+		if (!spectral.ctx || !spectral.pvalues) {
+			fprintf(stderr, "%sout of memory\n", logprefix);
+			exit(EXIT_OSERR);
+		}
+	}
+	if (arguments->autocorr) {
+		autocorr = autocorr_new(arguments->autocorr);
+		if (!autocorr) {
+			fprintf(stderr, "%sout of memory\n", logprefix);
+			exit(EXIT_OSERR);
+		}
+	}
+
+	init_input();
+	init_output();
+	start_reporter();
+
+	/* Bootstrap FIPS tests */
+	if (arguments->threads > 1) {
+		do_rng_fips_test_pipeline(discard_initial_data());
+	} else {
+		testing.params.last32 = discard_initial_data();
+		testing.blocks = rng_test_set_new(testing.tests,
+						  testing.engines,
+						  &testing.params);
+		if (!testing.blocks) {
+			fprintf(stderr, "%sout of memory\n", logprefix);
+			exit(EXIT_OSERR);
+		}
+		do_rng_fips_test_loop();
+	}
+
+	stop_reporter();
+	done_shm_stats();
+	rng_stats.taken = clock_ticks();
+	if (autocorr)
+		autocorr_summarize(autocorr, arguments->autocorralert,
+				   &rng_stats.autocorr);
+	dump_rng_stats(&rng_stats);
 
 	if ((exitstatus == EXIT_SUCCESS) && 
-	    (rng_stats.bad_fips_blocks || !rng_stats.good_fips_blocks)) {
+	    (rng_stats.bad_fips_blocks || rng_stats.bad_health_blocks ||
+	     !rng_stats.blocks || ((testing.tests & RNG_TESTS_FIPS) &&
+				   !rng_stats.good_fips_blocks))) {
 		exitstatus = EXIT_FAIL;
 	}
 
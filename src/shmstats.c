@@ -0,0 +1,188 @@
+/*
+ * shmstats.c -- Statistics in a shared memory segment
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define _GNU_SOURCE
+
+#include "rng-tools-config.h"
+
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <limits.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+
+#include "shmstats.h"
+
+/* Readers give up after this many torn copies */
+#define SHM_READ_TRIES		1000
+
+#define SHM_LOAD(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define SHM_STORE(p, v)		__atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+/* shm_open() wants names like "/name" */
+static const char *shm_name(const char *name, char *buf, size_t size)
+{
+	if (name[0] == '/')
+		return name;
+	snprintf(buf, size, "/%s", name);
+	return buf;
+}
+
+struct rng_shm_stats *rng_shm_create(const char *name)
+{
+	struct rng_shm_stats *shm;
+	char buf[NAME_MAX + 2];
+	int fd, err;
+
+	assert(name != NULL);
+
+	name = shm_name(name, buf, sizeof(buf));
+	fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return NULL;
+	if (ftruncate(fd, sizeof(*shm))) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return NULL;
+	}
+	shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fd, 0);
+	err = errno;
+	close(fd);
+	if (shm == MAP_FAILED) {
+		errno = err;
+		return NULL;
+	}
+
+	/* left over from an earlier run, readers must not trust it */
+	SHM_STORE(&shm->magic, 0);
+	memset((char *)shm + sizeof(shm->magic), 0,
+	       sizeof(*shm) - sizeof(shm->magic));
+	shm->version = RNG_SHM_VERSION;
+	shm->size = sizeof(*shm);
+	shm->pid = getpid();
+	SHM_STORE(&shm->magic, RNG_SHM_MAGIC);
+	return shm;
+}
+
+void rng_shm_begin(struct rng_shm_stats *shm)
+{
+	__atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELAXED);
+	/* the odd seq is seen before any of the new fields */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void rng_shm_end(struct rng_shm_stats *shm)
+{
+	SHM_STORE(&shm->seq, shm->seq + 1);
+}
+
+void rng_shm_destroy(struct rng_shm_stats *shm, const char *name)
+{
+	char buf[NAME_MAX + 2];
+
+	if (!shm)
+		return;
+	rng_shm_begin(shm);
+	shm->done = 1;
+	rng_shm_end(shm);
+	munmap(shm, sizeof(*shm));
+	shm_unlink(shm_name(name, buf, sizeof(buf)));
+}
+
+const struct rng_shm_stats *rng_shm_open(const char *name)
+{
+	const struct rng_shm_stats *shm;
+	char buf[NAME_MAX + 2];
+	struct stat st;
+	int fd, err;
+
+	assert(name != NULL);
+
+	fd = shm_open(shm_name(name, buf, sizeof(buf)), O_RDONLY, 0);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) || (st.st_size < (off_t)sizeof(*shm))) {
+		close(fd);
+		errno = EPROTO;
+		return NULL;
+	}
+	shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+	err = errno;
+	close(fd);
+	if (shm == MAP_FAILED) {
+		errno = err;
+		return NULL;
+	}
+	if ((SHM_LOAD(&shm->magic) != RNG_SHM_MAGIC) ||
+	    (shm->version != RNG_SHM_VERSION) ||
+	    (shm->size != sizeof(*shm))) {
+		munmap((void *)shm, sizeof(*shm));
+		errno = EPROTO;
+		return NULL;
+	}
+	return shm;
+}
+
+void rng_shm_close(const struct rng_shm_stats *shm)
+{
+	if (shm)
+		munmap((void *)shm, sizeof(*shm));
+}
+
+/* A consistent copy is sane, but the segment may not be: keep in range */
+static void shm_check_hist(struct rng_hist *hist)
+{
+	if ((hist->hi >= RNG_HIST_BUCKETS) || (hist->lo > hist->hi))
+		hist->total = hist->lo = hist->hi = 0;
+}
+
+int rng_shm_read(const struct rng_shm_stats *shm, struct rng_shm_stats *copy)
+{
+	uint32_t seq;
+	unsigned int i;
+
+	assert(shm != NULL && copy != NULL);
+
+	for (i = 0; i < SHM_READ_TRIES; i++) {
+		seq = SHM_LOAD(&shm->seq);
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+		memcpy(copy, shm, sizeof(*copy));
+		/* the copy is done before seq is checked again */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == seq) {
+			shm_check_hist(&copy->source.hist);
+			shm_check_hist(&copy->fips.hist);
+			shm_check_hist(&copy->sink.hist);
+			return 0;
+		}
+	}
+	return -1;
+}
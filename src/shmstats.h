@@ -0,0 +1,112 @@
+/*
+ * shmstats.h -- Statistics in a shared memory segment
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef SHMSTATS__H
+#define SHMSTATS__H
+
+#include <stdint.h>
+
+#include "fips.h"
+#include "tests.h"
+#include "sts.h"
+#include "stats.h"
+
+/*
+ * rngtest keeps a copy of its statistics in a POSIX shared memory
+ * segment (see shm_open(3)), that any number of readers can map and
+ * read without rngtest making a single system call for them.
+ *
+ * The writer bumps seq to an odd number, updates the fields, and bumps
+ * it again: a reader that saw the same even seq before and after its
+ * copy got a consistent one.  The header never changes after creation;
+ * readers must check magic, version and size before trusting the rest.
+ */
+#define RNG_SHM_MAGIC		0x74676e72	/* "rngt" */
+#define RNG_SHM_VERSION		2
+
+/* What the writer runs besides the tests, see features */
+#define RNG_SHM_WINDOWS		0x0001	/* --stride */
+#define RNG_SHM_SEQUENCES	0x0002	/* --sequence */
+#define RNG_SHM_SPECTRAL	0x0004	/* --spectral */
+
+struct rng_shm_stats {
+	/* header */
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;			/* sizeof(struct rng_shm_stats) */
+	int32_t pid;			/* Of the writer */
+
+	uint32_t seq;			/* Odd while being written */
+	uint32_t done;			/* The writer has exited */
+	uint64_t uptime_ns;		/* Writer run time at the update */
+	uint32_t tests;			/* Mask of rng_tests[] run */
+	uint32_t features;		/* RNG_SHM_* */
+	uint32_t sequence_tests;	/* Mask of SP 800-22 tests run */
+	uint32_t reserved;
+
+	uint64_t bits_received;
+	uint64_t bits_sent;
+	uint64_t blocks;
+	uint64_t good_fips_blocks;
+	uint64_t bad_fips_blocks;
+	uint64_t bad_health_blocks;
+	uint64_t test_failures[N_RNG_TESTS];	/* Per rng_tests[] entry */
+
+	uint64_t windows;		/* Sliding windows, see --stride */
+	uint64_t bad_windows;
+	uint64_t window_failures[N_FIPS_TESTS];
+
+	uint64_t sequences;		/* SP 800-22 sequences */
+	uint64_t sequence_failures[N_STS_PVALUES];	/* Per sts_pvalues[] */
+	uint64_t spectral_windows;	/* SP 800-22 DFT windows */
+	uint64_t spectral_failures;
+
+	struct rng_stat source;		/* Read time, nanoseconds */
+	struct rng_stat fips;		/* FIPS test time per block */
+	struct rng_stat sink;		/* Output time per block */
+};
+
+/*
+ * Creates (or takes over) the segment called name, and maps it.  A
+ * leading '/' is added to name if missing.  Returns NULL with errno set
+ * on failure.
+ */
+extern struct rng_shm_stats *rng_shm_create(const char *name);
+
+/* Brackets an update of the fields, on the writer side */
+extern void rng_shm_begin(struct rng_shm_stats *shm);
+extern void rng_shm_end(struct rng_shm_stats *shm);
+
+/* Marks the segment done, unmaps it, and removes its name */
+extern void rng_shm_destroy(struct rng_shm_stats *shm, const char *name);
+
+/*
+ * Maps the segment called name for reading.  Returns NULL with errno
+ * set on failure, EPROTO if it is not a segment this reader knows.
+ */
+extern const struct rng_shm_stats *rng_shm_open(const char *name);
+extern void rng_shm_close(const struct rng_shm_stats *shm);
+
+/*
+ * Takes a consistent copy of the segment.  Returns 0, or -1 if the
+ * writer kept it busy for too long.
+ */
+extern int rng_shm_read(const struct rng_shm_stats *shm,
+			struct rng_shm_stats *copy);
+
+#endif /* SHMSTATS__H */
@@ -34,6 +34,8 @@
 #include <sys/time.h>
 #include <time.h>
 #include <string.h>
+#include <stdarg.h>
+#include <math.h>
 
 #include <assert.h>
 
@@ -43,6 +45,10 @@
 
 static char stat_prefix[20] = "";
 
+const char *stat_format_names[STAT_FORMAT_MAX] = {
+	"text", "json", "csv"
+};
+
 void set_stat_prefix(const char* prefix)
 {
 	if (prefix) {
@@ -77,6 +83,93 @@ static void scale_mult_unit(char *unit, size_t unitsize,
 	unit[unitsize-1] = 0;
 }
 
+static unsigned int hist_bucket(uint64_t value)
+{
+	unsigned int msb;
+
+	if (value < RNG_HIST_SUB)
+		return value;
+	msb = 63 - __builtin_clzll(value);
+	return (msb - RNG_HIST_SUB_BITS + 1) * RNG_HIST_SUB +
+	       (value >> (msb - RNG_HIST_SUB_BITS)) - RNG_HIST_SUB;
+}
+
+/* Highest value that falls in bucket */
+static uint64_t hist_bucket_top(unsigned int bucket)
+{
+	unsigned int shift;
+
+	if (bucket < RNG_HIST_SUB)
+		return bucket;
+	shift = bucket / RNG_HIST_SUB - 1;
+	return (((uint64_t)RNG_HIST_SUB + bucket % RNG_HIST_SUB) << shift) +
+	       ((1ULL << shift) - 1);
+}
+
+void update_hist(struct rng_hist *hist, uint64_t value)
+{
+	unsigned int bucket = hist_bucket(value);
+
+	if (!hist->total++) {
+		hist->lo = hist->hi = bucket;
+	} else if (bucket < hist->lo) {
+		hist->lo = bucket;
+	} else if (bucket > hist->hi) {
+		hist->hi = bucket;
+	}
+	hist->count[bucket]++;
+}
+
+void merge_hist(struct rng_hist *hist, const struct rng_hist *src)
+{
+	unsigned int i;
+
+	assert(hist != NULL && src != NULL);
+
+	if (!src->total)
+		return;
+	if (!hist->total) {
+		hist->lo = src->lo;
+		hist->hi = src->hi;
+	} else {
+		if (src->lo < hist->lo) hist->lo = src->lo;
+		if (src->hi > hist->hi) hist->hi = src->hi;
+	}
+	for (i = src->lo; i <= src->hi; i++)
+		hist->count[i] += src->count[i];
+	hist->total += src->total;
+}
+
+void clear_hist(struct rng_hist *hist)
+{
+	assert(hist != NULL);
+
+	if (hist->total)
+		memset(&hist->count[hist->lo], 0,
+		       (hist->hi - hist->lo + 1) * sizeof(hist->count[0]));
+	hist->total = hist->lo = hist->hi = 0;
+}
+
+uint64_t hist_percentile(const struct rng_hist *hist, double q)
+{
+	uint64_t rank, seen = 0;
+	unsigned int i;
+
+	assert(hist != NULL);
+
+	if (!hist->total)
+		return 0;
+	rank = (uint64_t)(q * hist->total + 0.5);
+	if (rank < 1)
+		rank = 1;
+	for (i = hist->lo; i < hist->hi; i++) {
+		seen += hist->count[i];
+		if (seen >= rank)
+			break;
+	}
+	return hist_bucket_top(i);
+}
+
 /* Updates min-max stat */
 void update_stat(struct rng_stat *stat, uint64_t value)
 {
@@ -84,6 +177,8 @@ void update_stat(struct rng_stat *stat, uint64_t value)
 
 	assert(stat != NULL);
 
+	update_hist(&stat->hist, value);
+
 	if ((stat->min == 0 ) || (value < stat->min)) stat->min = value;
 	if (value > stat->max) stat->max = value;
 	if (++stat->num_samples > overflow) {
@@ -94,6 +189,40 @@ void update_stat(struct rng_stat *stat, uint64_t value)
 	}
 }
 
+void merge_stat(struct rng_stat *stat, const struct rng_stat *src)
+{
+	assert(stat != NULL && src != NULL);
+
+	if (!src->num_samples)
+		return;
+	merge_hist(&stat->hist, &src->hist);
+	if (!stat->num_samples) {
+		stat->min = src->min;
+		stat->max = src->max;
+		stat->num_samples = src->num_samples;
+		stat->sum = src->sum;
+		return;
+	}
+	if ((stat->min == 0) || (src->min < stat->min)) stat->min = src->min;
+	if (src->max > stat->max) stat->max = src->max;
+	stat->num_samples += src->num_samples;
+	stat->sum += src->sum;
+}
+
+void clear_stat(struct rng_stat *stat)
+{
+	assert(stat != NULL);
+
+	stat->min = stat->max = stat->num_samples = stat->sum = 0;
+	clear_hist(&stat->hist);
+}
+
+void copy_stat(struct rng_stat *stat, const struct rng_stat *src)
+{
+	clear_stat(stat);
+	merge_stat(stat, src);
+}
+
 char *dump_stat_counter(char *buf, size_t size,
 		       const char *msg, uint64_t value)
 {
@@ -106,7 +235,7 @@ char *dump_stat_counter(char *buf, size_t size,
 }
 
 char *dump_stat_stat(char *buf, size_t size,
-		    const char *msg, const char *unit, struct rng_stat *stat)
+		    const char *msg, const char *unit, const struct rng_stat *stat)
 {
 	double avg = 0.0;
 
@@ -125,7 +254,7 @@ char *dump_stat_stat(char *buf, size_t size,
 
 char *dump_stat_bw(char *buf, size_t size,
 		  const char *msg, const char *unit, 
-		  struct rng_stat *stat, 
+		  const struct rng_stat *stat, 
 		  uint64_t blocksize)
 {
 	char unitscaled[20];
@@ -134,11 +263,12 @@ char *dump_stat_bw(char *buf, size_t size,
 	assert(stat != NULL && msg != NULL && unit != NULL);
 
 	if (stat->max > 0)
-		bw_min = (1000000.0 * blocksize) / stat->max;
+		bw_min = (1000000000.0 * blocksize) / stat->max;
 	if (stat->min > 0)
-		bw_max = (1000000.0 * blocksize) / stat->min;
+		bw_max = (1000000000.0 * blocksize) / stat->min;
 	if (stat->num_samples > 0)
-		bw_avg = (1000000.0 * blocksize * stat->num_samples) / stat->sum;
+		bw_avg = (1000000000.0 * blocksize * stat->num_samples) /
+			 stat->sum;
 
 	scale_mult_unit(unitscaled, sizeof(unitscaled), unit,
 			&bw_min, &bw_avg, &bw_max);
@@ -150,3 +280,245 @@ char *dump_stat_bw(char *buf, size_t size,
 	return buf;
 }
 
+void update_moments(struct rng_moments *m, double value)
+{
+	double delta;
+
+	assert(m != NULL);
+
+	delta = value - m->mean;
+	m->num_samples++;
+	m->mean += delta / m->num_samples;
+	m->m2 += delta * (value - m->mean);
+}
+
+double moments_stddev(const struct rng_moments *m)
+{
+	assert(m != NULL);
+
+	if (m->num_samples < 2)
+		return 0.0;
+	return sqrt(m->m2 / (m->num_samples - 1));
+}
+
+double moments_zscore(const struct rng_moments *m, double expected)
+{
+	double sd = moments_stddev(m);
+
+	if (sd <= 0.0)
+		return 0.0;
+	return (m->mean - expected) / (sd / sqrt(m->num_samples));
+}
+
+char *dump_stat_moments(char *buf, size_t size, const char *msg,
+		       const struct rng_moments *m, double expected)
+{
+	assert(m != NULL && msg != NULL && buf != NULL);
+
+	snprintf(buf, size-1, "%s%s: (mean=%.3f; sd=%.3f; z=%.2f)",
+		 stat_prefix, msg, m->mean, moments_stddev(m),
+		 moments_zscore(m, expected));
+	buf[size-1] = 0;
+
+	return buf;
+}
+
+char *dump_stat_latency(char *buf, size_t size,
+		       const char *msg, const struct rng_stat *stat)
+{
+	static const double quantile[] = { 0.5, 0.9, 0.99, 0.999 };
+	static const char *label[] = { "p50", "p90", "p99", "p99.9" };
+	const char *unit = "ns";
+	double scale = 1.0, max;
+	size_t len;
+	unsigned int i;
+
+	assert(stat != NULL && msg != NULL && buf != NULL);
+
+	/* a bucket top can overshoot the real maximum */
+	max = stat->max;
+	if (max >= 1000000000.0) {
+		unit = "s";
+		scale = 1000000000.0;
+	} else if (max >= 1000000.0) {
+		unit = "ms";
+		scale = 1000000.0;
+	} else if (max >= 1000.0) {
+		unit = "us";
+		scale = 1000.0;
+	}
+
+	buf[size-1] = 0;
+	len = snprintf(buf, size-1, "%s%s: (", stat_prefix, msg);
+	for (i = 0; (i < sizeof(quantile)/sizeof(quantile[0])) &&
+		    (len < size-1); i++) {
+		uint64_t v = hist_percentile(&stat->hist, quantile[i]);
+
+		if (v > stat->max)
+			v = stat->max;
+		len += snprintf(buf+len, size-1-len, "%s=%.3f; ",
+				label[i], v / scale);
+	}
+	if (len < size-1)
+		snprintf(buf+len, size-1-len, "max=%.3f)%s", max / scale, unit);
+
+	return buf;
+}
+
+char *dump_stat_ring(char *buf, size_t size,
+		    const char *msg, struct rng_ring_stat *stat)
+{
+	double avg = 0.0;
+
+	assert(stat != NULL && msg != NULL && buf != NULL);
+
+	if (stat->pushes > 0)
+		avg = (double)stat->occupancy_sum / stat->pushes;
+
+	buf[size-1] = 0;
+	snprintf(buf, size-1,
+		 "%s%s: (occupancy avg=%.3f; max=%" PRIu64 "/%" PRIu64
+		 "; stalls full=%" PRIu64 "; empty=%" PRIu64 ")",
+		 stat_prefix, msg, avg, stat->occupancy_max, stat->size,
+		 stat->push_stalls, stat->pop_stalls);
+
+	return buf;
+}
+
+void stat_record_init(struct stat_record *rec, stat_format_t format,
+		      char *buf, size_t size)
+{
+	assert(rec != NULL && buf != NULL && size > 0);
+
+	rec->format = format;
+	rec->buf = buf;
+	rec->size = size;
+	rec->len = 0;
+	rec->overflow = 0;
+	rec->header = 0;
+	rec->fields = 0;
+	buf[0] = 0;
+}
+
+void stat_record_printf(struct stat_record *rec, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (rec->overflow)
+		return;
+	va_start(ap, fmt);
+	n = vsnprintf(rec->buf + rec->len, rec->size - rec->len, fmt, ap);
+	va_end(ap);
+	if ((n < 0) || ((size_t)n >= rec->size - rec->len)) {
+		rec->overflow = 1;
+		rec->buf[rec->len] = 0;
+	} else {
+		rec->len += n;
+	}
+}
+
+/* Starts a field, returns non-zero if its value is wanted */
+static int stat_record_field(struct stat_record *rec, const char *key)
+{
+	const char *sep = rec->fields++ ? "," : "";
+
+	if (rec->format == STAT_FORMAT_JSON) {
+		if (rec->header)
+			return 0;
+		stat_record_printf(rec, "%s\"%s\":", sep, key);
+		return 1;
+	}
+	if (rec->header) {
+		stat_record_printf(rec, "%s%s", sep, key);
+		return 0;
+	}
+	stat_record_printf(rec, "%s", sep);
+	return 1;
+}
+
+void stat_record_begin(struct stat_record *rec, int header)
+{
+	assert(rec != NULL);
+
+	rec->header = header;
+	rec->fields = 0;
+	if ((rec->format == STAT_FORMAT_JSON) && !header)
+		stat_record_printf(rec, "{");
+}
+
+void stat_record_u64(struct stat_record *rec, const char *key, uint64_t value)
+{
+	assert(rec != NULL && key != NULL);
+
+	if (stat_record_field(rec, key))
+		stat_record_printf(rec, "%" PRIu64, value);
+}
+
+void stat_record_double(struct stat_record *rec, const char *key, double value)
+{
+	assert(rec != NULL && key != NULL);
+
+	if (stat_record_field(rec, key))
+		stat_record_printf(rec, "%.3f", value);
+}
+
+void stat_record_string(struct stat_record *rec, const char *key,
+			const char *value)
+{
+	const char *quote = (rec->format == STAT_FORMAT_JSON) ? "\"" : "";
+
+	assert(rec != NULL && key != NULL && value != NULL);
+
+	if (!stat_record_field(rec, key))
+		return;
+	/* neither format can take these unescaped, and names need none */
+	stat_record_printf(rec, "%s", quote);
+	for (; *value; value++)
+		stat_record_printf(rec, "%c",
+			((unsigned char)*value < ' ') || (*value == '"') ||
+			(*value == '\\') || (*value == ',') ? '_' : *value);
+	stat_record_printf(rec, "%s", quote);
+}
+
+void stat_record_end(struct stat_record *rec)
+{
+	assert(rec != NULL);
+
+	if (rec->format == STAT_FORMAT_JSON) {
+		if (!rec->header)
+			stat_record_printf(rec, "}\n");
+	} else {
+		stat_record_printf(rec, "\n");
+	}
+	rec->header = 0;
+}
+
+void stat_record_histogram(struct stat_record *rec, const char *name,
+			   const char *labels, const struct rng_stat *stat,
+			   double scale)
+{
+	const struct rng_hist *hist = &stat->hist;
+	uint64_t below = 0;
+	unsigned int i = 0, k, top;
+
+	assert(rec != NULL && name != NULL && labels != NULL && stat != NULL);
+
+	/*
+	 * powers of two start a bucket, so the count below 2^k is exact;
+	 * values are integers, so that is the count up to le = 2^k - 1
+	 */
+	for (k = RNG_HIST_EXPORT_LOW; k <= RNG_HIST_EXPORT_HIGH; k++) {
+		top = hist_bucket(1ULL << k);
+		for (; i < top; i++)
+			below += hist->count[i];
+		stat_record_printf(rec, "%s_bucket{%s,le=\"%.10g\"} %" PRIu64 "\n",
+				   name, labels, ((1ULL << k) - 1) / scale, below);
+	}
+	stat_record_printf(rec, "%s_bucket{%s,le=\"+Inf\"} %" PRIu64 "\n",
+			   name, labels, hist->total);
+	stat_record_printf(rec, "%s_sum{%s} %.9f\n",
+			   name, labels, stat->sum / scale);
+	stat_record_printf(rec, "%s_count{%s} %" PRIu64 "\n",
+			   name, labels, hist->total);
+}
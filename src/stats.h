@@ -25,23 +25,102 @@
 #include <stdint.h>
 #include "util.h"
 
+/*
+ * Log-linear histogram: values below 2^RNG_HIST_SUB_BITS get a bucket
+ * each, and every power of two above that is split into
+ * 2^RNG_HIST_SUB_BITS buckets, so a value is known to within about 3%.
+ * It covers all of uint64_t in fixed memory.
+ */
+#define RNG_HIST_SUB_BITS	5
+#define RNG_HIST_SUB		(1U << RNG_HIST_SUB_BITS)
+#define RNG_HIST_BUCKETS	((64 - RNG_HIST_SUB_BITS + 1) * RNG_HIST_SUB)
+
+struct rng_hist {
+	uint64_t total;			/* Number of samples */
+	unsigned int lo, hi;		/* Range of buckets in use */
+	uint64_t count[RNG_HIST_BUCKETS];
+};
+
 /* Min-Max stat */
 struct rng_stat {
 	uint64_t max;			/* Highest value seen */
 	uint64_t min;			/* Lowest value seen */
 	uint64_t num_samples;		/* Number of samples */
 	uint64_t sum;			/* Sum of all samples */
+	struct rng_hist hist;		/* Distribution of samples */
+};
+
+/* Streaming mean and variance stat */
+struct rng_moments {
+	uint64_t num_samples;		/* Number of samples */
+	double mean;			/* Mean of all samples */
+	double m2;			/* Sum of squared deviations from it */
+};
+
+/* Ring buffer stat, see ring.h */
+struct rng_ring_stat {
+	uint64_t size;			/* Slots in the ring */
+	uint64_t pushes;		/* Items pushed */
+	uint64_t pops;			/* Items popped */
+	uint64_t push_stalls;		/* Pushes that waited, ring full */
+	uint64_t pop_stalls;		/* Pops that waited, ring empty */
+	uint64_t occupancy_sum;		/* Sum of occupancy after pushes */
+	uint64_t occupancy_max;		/* Highest occupancy seen */
+};
+
+/* Formats for statistics dumps */
+typedef enum {
+	STAT_FORMAT_TEXT,		/* dump_stat_*() lines */
+	STAT_FORMAT_JSON,		/* One JSON object per line */
+	STAT_FORMAT_CSV,		/* A header line, then a line per dump */
+	STAT_FORMAT_MAX
+} stat_format_t;
+
+extern const char *stat_format_names[STAT_FORMAT_MAX];
+
+/*
+ * A machine-readable stat dump, built field by field into a buffer the
+ * caller owns, so that it can be written out at once
+ */
+struct stat_record {
+	stat_format_t format;
+	char *buf;
+	size_t size;
+	size_t len;			/* Bytes used in buf */
+	int overflow;			/* Fields did not fit in buf */
+	int header;			/* Adding CSV header, not values */
+	unsigned int fields;		/* Fields in this line */
 };
 
 /* Sets a prefix for all stat dumps. Maximum length is 19 chars */
 extern void set_stat_prefix(const char* prefix);
 
+/* Histogram helpers, all but hist_percentile are O(1) per sample */
+extern void update_hist(struct rng_hist *hist, uint64_t value);
+extern void merge_hist(struct rng_hist *hist, const struct rng_hist *src);
+extern void clear_hist(struct rng_hist *hist);
+
+/*
+ * Returns the value below which a fraction q of the samples fall (the
+ * top of its bucket), or 0 if there are no samples
+ */
+extern uint64_t hist_percentile(const struct rng_hist *hist, double q);
+
 /* Updates min-max stat */
 extern void update_stat(struct rng_stat *stat, uint64_t value);
 
-/* Updates min-max microseconds timer stat */
-#define update_usectimer_stat(STAT, START, STOP) \
-	update_stat(STAT, elapsed_time(START, STOP))
+/* Adds the samples of src to stat */
+extern void merge_stat(struct rng_stat *stat, const struct rng_stat *src);
+
+/* Empties stat, cheaper than a memset when few buckets were used */
+extern void clear_stat(struct rng_stat *stat);
+
+/* Copies src to stat, touching only the buckets either one uses */
+extern void copy_stat(struct rng_stat *stat, const struct rng_stat *src);
+
+/* Updates min-max nanoseconds timer stat, from clock_ticks() */
+#define update_nsectimer_stat(STAT, START, STOP) \
+	update_stat(STAT, elapsed_ns(START, STOP))
 
 /*
  * The following functions format a stat dump on buf, and
@@ -55,14 +134,77 @@ extern char *dump_stat_counter(char *buf, size_t size,
 /* Dump min-max time stat */
 extern char *dump_stat_stat(char *buf, size_t size,
 			   const char *msg, const char *unit,
-			   struct rng_stat *stat);
+			   const struct rng_stat *stat);
 
 /*
- * Dump min-max speed stat, base time unit is a microsecond
+ * Dump min-max speed stat, base time unit is a nanosecond
  */
 extern char *dump_stat_bw(char *buf, size_t size,
 			 const char *msg, const char *unit,
-			 struct rng_stat *stat,
+			 const struct rng_stat *stat,
 			 uint64_t blocksize);
 
+/*
+ * Updates a mean and variance stat with Welford's method, which stays
+ * accurate over any number of samples
+ */
+extern void update_moments(struct rng_moments *m, double value);
+
+/* Sample standard deviation, 0 for less than two samples */
+extern double moments_stddev(const struct rng_moments *m);
+
+/* By how many standard errors the mean is off expected, 0 if unknown */
+extern double moments_zscore(const struct rng_moments *m, double expected);
+
+/* Dump mean, standard deviation and moments_zscore() */
+extern char *dump_stat_moments(char *buf, size_t size, const char *msg,
+			      const struct rng_moments *m, double expected);
+
+/*
+ * Dump the percentiles of a nanoseconds timer stat
+ */
+extern char *dump_stat_latency(char *buf, size_t size,
+			      const char *msg, const struct rng_stat *stat);
+
+/* Dump ring occupancy and stalls */
+extern char *dump_stat_ring(char *buf, size_t size,
+			   const char *msg, struct rng_ring_stat *stat);
+
+/*
+ * Structured dumps: stat_record_init() once, then for every line
+ * stat_record_begin(), the fields, and stat_record_end().  With header
+ * set, a CSV line gets the field names instead of their values; JSON
+ * has no header, and the line is skipped.  Lines are appended to buf,
+ * until stat_record_init() is called again.
+ */
+extern void stat_record_init(struct stat_record *rec, stat_format_t format,
+			     char *buf, size_t size);
+extern void stat_record_begin(struct stat_record *rec, int header);
+extern void stat_record_u64(struct stat_record *rec,
+			    const char *key, uint64_t value);
+extern void stat_record_double(struct stat_record *rec,
+			       const char *key, double value);
+/* Strings lose the characters that would need quoting, as '_' */
+extern void stat_record_string(struct stat_record *rec,
+			       const char *key, const char *value);
+extern void stat_record_end(struct stat_record *rec);
+
+/* Appends free-form text to rec, or marks it overflowed */
+extern void stat_record_printf(struct stat_record *rec, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+/*
+ * Appends the histogram of stat to rec in Prometheus text format, as
+ * the _bucket, _sum and _count series of name, with labels (a comma
+ * separated list, without braces).  Bucket k counts the values up to
+ * 2^k - 1, for k from RNG_HIST_EXPORT_LOW to RNG_HIST_EXPORT_HIGH; values
+ * are divided by scale (1e9 turns nanoseconds into seconds).
+ */
+#define RNG_HIST_EXPORT_LOW	7
+#define RNG_HIST_EXPORT_HIGH	33
+
+extern void stat_record_histogram(struct stat_record *rec, const char *name,
+				  const char *labels,
+				  const struct rng_stat *stat, double scale);
+
 #endif /* STATS__H */
@@ -0,0 +1,971 @@
+/*
+ * sts.c -- NIST SP 800-22 statistical tests
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "sts.h"
+
+const char *sts_test_keys[N_STS_TESTS] = {
+	[STS_FREQUENCY] = "frequency",
+	[STS_BLOCK_FREQUENCY] = "block_frequency",
+	[STS_RUNS] = "runs",
+	[STS_LONGEST_RUN] = "longest_run",
+	[STS_RANK] = "rank",
+	[STS_LINEAR_COMPLEXITY] = "linear_complexity",
+	[STS_SERIAL] = "serial",
+	[STS_APPROXIMATE_ENTROPY] = "approximate_entropy",
+	[STS_CUSUM] = "cusum",
+};
+
+const uint64_t sts_test_min_length[N_STS_TESTS] = {
+	[STS_RANK] = STS_RANK_MIN_LENGTH,
+	[STS_LINEAR_COMPLEXITY] = STS_LINEAR_COMPLEXITY_MIN_LENGTH,
+};
+
+const struct sts_pvalue sts_pvalues[N_STS_PVALUES] = {
+	[STS_P_FREQUENCY] = {
+		"frequency", "SP 800-22 Frequency", STS_FREQUENCY },
+	[STS_P_BLOCK_FREQUENCY] = {
+		"block_frequency", "SP 800-22 Block frequency",
+		STS_BLOCK_FREQUENCY },
+	[STS_P_RUNS] = {
+		"runs", "SP 800-22 Runs", STS_RUNS },
+	[STS_P_LONGEST_RUN] = {
+		"longest_run", "SP 800-22 Longest run of ones",
+		STS_LONGEST_RUN },
+	[STS_P_RANK] = {
+		"rank", "SP 800-22 Binary matrix rank", STS_RANK },
+	[STS_P_LINEAR_COMPLEXITY] = {
+		"linear_complexity", "SP 800-22 Linear complexity",
+		STS_LINEAR_COMPLEXITY },
+	[STS_P_SERIAL_1] = {
+		"serial_1", "SP 800-22 Serial (first)", STS_SERIAL },
+	[STS_P_SERIAL_2] = {
+		"serial_2", "SP 800-22 Serial (second)", STS_SERIAL },
+	[STS_P_APPROXIMATE_ENTROPY] = {
+		"approximate_entropy", "SP 800-22 Approximate entropy",
+		STS_APPROXIMATE_ENTROPY },
+	[STS_P_CUSUM_FORWARD] = {
+		"cusum_forward", "SP 800-22 Cumulative sums (forward)",
+		STS_CUSUM },
+	[STS_P_CUSUM_BACKWARD] = {
+		"cusum_backward", "SP 800-22 Cumulative sums (backward)",
+		STS_CUSUM },
+};
+
+unsigned int sts_tests_default(uint64_t length)
+{
+	unsigned int tests = 0;
+	int i;
+
+	for (i = 0; i < N_STS_TESTS; i++)
+		if (length >= sts_test_min_length[i])
+			tests |= 1 << i;
+	if (length < STS_LINEAR_COMPLEXITY_LENGTH)
+		tests &= ~(1 << STS_LINEAR_COMPLEXITY);
+	return tests;
+}
+
+unsigned int sts_tests_parse(const char *list)
+{
+	unsigned int tests = 0;
+	const char *p, *end;
+	size_t len;
+	int i;
+
+	for (p = list; *p; p = *end ? end + 1 : end) {
+		end = strchrnul(p, ',');
+		len = end - p;
+		for (i = 0; i < N_STS_TESTS; i++)
+			if ((strlen(sts_test_keys[i]) == len) &&
+			    !strncmp(p, sts_test_keys[i], len))
+				break;
+		if (i >= N_STS_TESTS)
+			return 0;
+		tests |= 1 << i;
+	}
+	return tests;
+}
+
+#define BLOCK_FREQUENCY_M	128
+
+/*
+ * Longest run of ones: block size, the runs counted in the first and
+ * last classes and below and above, and the probability of each class
+ * (SP 800-22 3.4)
+ */
+static const struct longest_run_params {
+	uint64_t min_length;
+	unsigned int m;
+	unsigned int low, k;
+	double pi[7];
+} longest_run_params[] = {
+	{ 750000, 10000, 10, 6, { 0.0882, 0.2092, 0.2483, 0.1933, 0.1208,
+				  0.0675, 0.0727 } },
+	{ 6272, 128, 4, 5, { 0.1174035788, 0.242955959, 0.249363483,
+			     0.17517706, 0.102701071, 0.112398847 } },
+	{ 128, 8, 1, 3, { 0.21484375, 0.3671875, 0.23046875, 0.1875 } },
+};
+
+/*
+ * Binary matrix rank: M x Q matrices, a row of Q bits in a 64-bit word,
+ * and the probability of full rank, of one less, and of the rest
+ * (SP 800-22 3.5)
+ */
+#define RANK_M			32
+#define RANK_Q			32
+#define RANK_BYTES		(RANK_M * RANK_Q / 8)
+
+static const double rank_pi[3] = {
+	0.2887880951538411, 0.5775761901732048, 0.1336357146729540
+};
+
+/*
+ * Linear complexity: blocks of LC_M bits, bit i of a block at bit
+ * LC_TOP - i of LC_WORDS 64-bit words, with room for the bits of the
+ * next block that come in the same byte and words of zeroes above.
+ * The probabilities of the classes are the exact ones of SP 800-22 3.10.
+ */
+#define LC_M			500
+#define LC_TOP			511
+#define LC_WORDS		10
+
+static const double lc_pi[7] = {
+	1.0 / 96, 1.0 / 32, 1.0 / 8, 1.0 / 2, 1.0 / 4, 1.0 / 16, 1.0 / 48
+};
+
+/* Per byte: the ones it adds to a cumulative sum, and its extremes */
+static struct {
+	int8_t sum, max, min;
+} cusum_tab[256];
+
+/* Per byte: the runs of ones at its ends, and its longest one */
+static struct {
+	uint8_t lead, trail, longest;
+} run_tab[256];
+
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+struct sts_ctx {
+	unsigned int tests;
+	uint64_t length;		/* Bytes per sequence */
+	uint64_t done;			/* Bytes of the sequence seen */
+	unsigned int sample;		/* Test one sequence in sample */
+	unsigned int skip;		/* Sequences since the last tested */
+
+	/* frequency, runs */
+	uint64_t ones;
+	uint64_t changes;		/* Bits that differ from the last */
+	unsigned int last;
+
+	/* block frequency */
+	unsigned int bf_left;		/* Bytes left in the block */
+	unsigned int bf_ones;
+	uint64_t bf_squares;		/* Sum of (2 ones - M)^2 */
+	uint64_t bf_blocks;
+
+	/* longest run of ones */
+	const struct longest_run_params *lr;
+	unsigned int lr_left;		/* Bytes left in the block */
+	unsigned int lr_run;		/* Run of ones going on */
+	unsigned int lr_longest;	/* In the block so far */
+	uint64_t lr_classes[7];
+	uint64_t lr_blocks;
+
+	/* binary matrix rank */
+	unsigned int rk_fill;		/* Bytes of the matrix seen */
+	unsigned char rk_buf[RANK_BYTES];
+	uint64_t rk_classes[3];
+	uint64_t rk_blocks;
+
+	/* linear complexity */
+	uint64_t lc_bits[LC_WORDS];	/* Of the block so far */
+	unsigned int lc_fill;		/* Bits of the block seen */
+	uint64_t lc_classes[7];
+	uint64_t lc_blocks;
+
+	/* serial, approximate entropy */
+	unsigned int serial_m, apen_m;
+	uint32_t window;		/* Last bits seen */
+	uint32_t head;			/* First 16 bits of the sequence */
+	uint32_t *counts;		/* Of each serial_m-bit pattern */
+	double *fold;			/* Of shorter patterns */
+
+	/* cumulative sums */
+	int64_t sum, max, min;
+};
+
+static void init_tables(void)
+{
+	unsigned int b, i, bit, run;
+	int s, max, min;
+
+	for (b = 0; b < 256; b++) {
+		s = 0;
+		max = -8;
+		min = 8;
+		run = 0;
+		run_tab[b].longest = run_tab[b].lead = 0;
+		for (i = 0; i < 8; i++) {
+			bit = (b >> (7 - i)) & 1;
+			s += bit ? 1 : -1;
+			if (s > max)
+				max = s;
+			if (s < min)
+				min = s;
+			run = bit ? run + 1 : 0;
+			if (run > run_tab[b].longest)
+				run_tab[b].longest = run;
+			if (run == i + 1)
+				run_tab[b].lead = run;
+		}
+		cusum_tab[b].sum = s;
+		cusum_tab[b].max = max;
+		cusum_tab[b].min = min;
+		run_tab[b].trail = run;
+	}
+}
+
+/* Starts the next sequence */
+static void sts_restart(sts_ctx_t *ctx)
+{
+	ctx->done = 0;
+	ctx->ones = ctx->changes = 0;
+	ctx->bf_left = BLOCK_FREQUENCY_M / 8;
+	ctx->bf_ones = 0;
+	ctx->bf_squares = ctx->bf_blocks = 0;
+	ctx->lr_left = ctx->lr->m / 8;
+	ctx->lr_run = ctx->lr_longest = 0;
+	memset(ctx->lr_classes, 0, sizeof(ctx->lr_classes));
+	ctx->lr_blocks = 0;
+	ctx->rk_fill = 0;
+	memset(ctx->rk_classes, 0, sizeof(ctx->rk_classes));
+	ctx->rk_blocks = 0;
+	memset(ctx->lc_bits, 0, sizeof(ctx->lc_bits));
+	ctx->lc_fill = 0;
+	memset(ctx->lc_classes, 0, sizeof(ctx->lc_classes));
+	ctx->lc_blocks = 0;
+	if (ctx->counts)
+		memset(ctx->counts, 0,
+		       sizeof(*ctx->counts) << ctx->serial_m);
+	ctx->sum = ctx->max = ctx->min = 0;
+}
+
+sts_ctx_t *sts_new(uint64_t length, unsigned int mask, unsigned int sample)
+{
+	sts_ctx_t *ctx;
+	unsigned int log2n, i;
+
+	if ((length < STS_MIN_LENGTH) || (length > STS_MAX_LENGTH) ||
+	    (length % 8) || !mask || (mask >> N_STS_TESTS) || !sample) {
+		errno = EINVAL;
+		return NULL;
+	}
+	for (i = 0; i < N_STS_TESTS; i++)
+		if ((mask & (1 << i)) && (length < sts_test_min_length[i])) {
+			errno = EINVAL;
+			return NULL;
+		}
+	pthread_once(&tables_once, init_tables);
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+	ctx->tests = mask;
+	ctx->length = length / 8;
+	ctx->sample = sample;
+	for (i = 0; length < longest_run_params[i].min_length; i++)
+		;
+	ctx->lr = &longest_run_params[i];
+
+	log2n = 63 - __builtin_clzll(length);
+	ctx->serial_m = (log2n - 3 < 16) ? log2n - 3 : 16;
+	ctx->apen_m = (log2n - 6 < 10) ? log2n - 6 : 10;
+	if (mask & ((1 << STS_SERIAL) | (1 << STS_APPROXIMATE_ENTROPY))) {
+		ctx->counts = malloc(sizeof(*ctx->counts) << ctx->serial_m);
+		ctx->fold = malloc(sizeof(*ctx->fold) << (ctx->serial_m - 1));
+		if (!ctx->counts || !ctx->fold) {
+			sts_free(ctx);
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+	sts_restart(ctx);
+	return ctx;
+}
+
+void sts_free(sts_ctx_t *ctx)
+{
+	if (!ctx)
+		return;
+	free(ctx->counts);
+	free(ctx->fold);
+	free(ctx);
+}
+
+static inline uint64_t load_be64(const unsigned char *p)
+{
+	uint64_t x;
+
+	memcpy(&x, p, sizeof(x));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	x = __builtin_bswap64(x);
+#endif
+	return x;
+}
+
+/* Ones of the len bytes at p */
+static unsigned int popcount_bytes(const unsigned char *p, size_t len)
+{
+	unsigned int n = 0;
+	uint64_t x;
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8)
+		n += __builtin_popcountll(load_be64(p + i));
+	for (x = 0; i < len; i++)
+		x = (x << 8) | p[i];
+	return n + __builtin_popcountll(x);
+}
+
+/*
+ * Frequency and runs: ones, and bits that differ from the one before,
+ * 64 bits at a time
+ */
+static void update_frequency(sts_ctx_t *ctx, const unsigned char *p,
+			     size_t len)
+{
+	uint64_t x, ones = 0, changes = 0, last = ctx->last;
+	unsigned int bits;
+	size_t i;
+
+	for (i = 0; i < len; i += bits / 8) {
+		if (i + 8 <= len) {
+			x = load_be64(p + i);
+			bits = 64;
+		} else {
+			for (x = 0, bits = 0; i + bits / 8 < len; bits += 8)
+				x = (x << 8) | p[i + bits / 8];
+		}
+		ones += __builtin_popcountll(x);
+		changes += __builtin_popcountll(x ^ ((x >> 1) |
+						     (last << (bits - 1))));
+		last = x & 1;
+	}
+	ctx->ones += ones;
+	ctx->changes += changes;
+	ctx->last = last;
+}
+
+static void update_block_frequency(sts_ctx_t *ctx, const unsigned char *p,
+				   size_t len)
+{
+	unsigned int n;
+	int d;
+
+	while (len) {
+		n = (len < ctx->bf_left) ? len : ctx->bf_left;
+		ctx->bf_ones += popcount_bytes(p, n);
+		p += n;
+		len -= n;
+		ctx->bf_left -= n;
+		if (ctx->bf_left)
+			break;
+		d = 2 * ctx->bf_ones - BLOCK_FREQUENCY_M;
+		ctx->bf_squares += d * d;
+		ctx->bf_blocks++;
+		ctx->bf_ones = 0;
+		ctx->bf_left = BLOCK_FREQUENCY_M / 8;
+	}
+}
+
+static void update_longest_run(sts_ctx_t *ctx, const unsigned char *p,
+			       size_t len)
+{
+	const struct longest_run_params *lr = ctx->lr;
+	unsigned int run = ctx->lr_run, longest = ctx->lr_longest, c;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (p[i] == 0xff) {
+			run += 8;
+		} else {
+			if (run + run_tab[p[i]].lead > longest)
+				longest = run + run_tab[p[i]].lead;
+			if (run_tab[p[i]].longest > longest)
+				longest = run_tab[p[i]].longest;
+			run = run_tab[p[i]].trail;
+		}
+		if (--ctx->lr_left)
+			continue;
+		if (run > longest)
+			longest = run;
+		c = (longest > lr->low) ? longest - lr->low : 0;
+		ctx->lr_classes[(c < lr->k) ? c : lr->k]++;
+		ctx->lr_blocks++;
+		run = longest = 0;
+		ctx->lr_left = lr->m / 8;
+	}
+	ctx->lr_run = run;
+	ctx->lr_longest = longest;
+}
+
+/*
+ * Rank over GF(2) of m rows: each row left once earlier pivots are
+ * XORed out of it is a pivot, and is XORed out of the rows below it
+ * where they have its lowest bit
+ */
+static unsigned int gf2_rank(uint64_t *rows, unsigned int m)
+{
+	unsigned int i, j, rank = 0;
+	uint64_t x, pivot;
+
+	for (i = 0; i < m; i++) {
+		x = rows[i];
+		if (!x)
+			continue;
+		pivot = x & -x;
+		for (j = i + 1; j < m; j++)
+			rows[j] ^= x & -(uint64_t)!!(rows[j] & pivot);
+		rank++;
+	}
+	return rank;
+}
+
+static void rank_matrix(sts_ctx_t *ctx, const unsigned char *p)
+{
+	uint64_t rows[RANK_M];
+	unsigned int i, rank;
+
+	for (i = 0; i < RANK_M; i++)
+		rows[i] = ((uint64_t)p[4 * i] << 24) | (p[4 * i + 1] << 16) |
+			  (p[4 * i + 2] << 8) | p[4 * i + 3];
+	rank = gf2_rank(rows, RANK_M);
+	ctx->rk_classes[(rank == RANK_M) ? 0 : (rank == RANK_M - 1) ? 1 : 2]++;
+	ctx->rk_blocks++;
+}
+
+/* Matrices are byte aligned, and only buffered across calls */
+static void update_rank(sts_ctx_t *ctx, const unsigned char *p, size_t len)
+{
+	size_t n;
+
+	while (len) {
+		if (!ctx->rk_fill && (len >= RANK_BYTES)) {
+			rank_matrix(ctx, p);
+			p += RANK_BYTES;
+			len -= RANK_BYTES;
+			continue;
+		}
+		n = RANK_BYTES - ctx->rk_fill;
+		if (n > len)
+			n = len;
+		memcpy(ctx->rk_buf + ctx->rk_fill, p, n);
+		ctx->rk_fill += n;
+		p += n;
+		len -= n;
+		if (ctx->rk_fill == RANK_BYTES) {
+			rank_matrix(ctx, ctx->rk_buf);
+			ctx->rk_fill = 0;
+		}
+	}
+}
+
+/*
+ * Berlekamp-Massey over GF(2), on the n bits of s: the connection
+ * polynomials C and B have coefficient i at bit i, so the discrepancy
+ * at bit i is the parity of C and the bits i, i - 1... of s, which
+ * start at bit LC_TOP - i and go up, 64 at a time
+ */
+static unsigned int linear_complexity(const uint64_t *s, unsigned int n)
+{
+	uint64_t c[LC_WORDS - 2] = { 1 }, b[LC_WORDS - 2] = { 1 };
+	uint64_t t[LC_WORDS - 2], d, x;
+	unsigned int l = 0, lb = 0, i, k, w, sh, shift, bs;
+	int m = -1, j, ws;
+
+	for (i = 0; i < n; i++) {
+		w = (LC_TOP - i) / 64;
+		sh = (LC_TOP - i) % 64;
+		for (d = 0, k = 0; k <= l / 64; k++) {
+			x = s[w + k] >> sh;
+			if (sh)
+				x |= s[w + k + 1] << (64 - sh);
+			d ^= c[k] & x;
+		}
+		if (!__builtin_parityll(d))
+			continue;
+
+		/* C += B x^(i - m), which has degree at most i + 1 - l */
+		if (2 * l <= i)
+			memcpy(t, c, sizeof(t));
+		shift = i - m;
+		ws = shift / 64;
+		bs = shift % 64;
+		for (j = (lb + shift) / 64; j >= ws; j--) {
+			x = b[j - ws] << bs;
+			if (bs && (j > ws))
+				x |= b[j - ws - 1] >> (64 - bs);
+			c[j] ^= x;
+		}
+		if (2 * l <= i) {
+			lb = l;
+			l = i + 1 - l;
+			m = i;
+			memcpy(b, t, sizeof(b));
+		}
+	}
+	return l;
+}
+
+/* T = (-1)^M (L - mu) + 2/9, in 7 classes from <= -2.5 to > 2.5 */
+static void lc_block(sts_ctx_t *ctx)
+{
+	double mu, t;
+	int c;
+
+	mu = LC_M / 2.0 + (9.0 + ((LC_M & 1) ? 1 : -1)) / 36.0 -
+	     (LC_M / 3.0 + 2.0 / 9.0) / ldexp(1.0, LC_M);
+	t = ((LC_M & 1) ? -1 : 1) *
+	    (linear_complexity(ctx->lc_bits, LC_M) - mu) + 2.0 / 9.0;
+	c = ceil(t + 2.5);
+	ctx->lc_classes[(c < 0) ? 0 : (c > 6) ? 6 : c]++;
+	ctx->lc_blocks++;
+}
+
+/* Blocks are not byte aligned: a byte may start the next one */
+static void update_linear_complexity(sts_ctx_t *ctx, const unsigned char *p,
+				     size_t len)
+{
+	unsigned int f = ctx->lc_fill, pos, extra;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		pos = LC_TOP - 7 - f;
+		ctx->lc_bits[pos / 64] |= (uint64_t)p[i] << (pos % 64);
+		if (pos % 64 > 56)
+			ctx->lc_bits[pos / 64 + 1] |=
+				p[i] >> (64 - pos % 64);
+		f += 8;
+		if (f < LC_M)
+			continue;
+		lc_block(ctx);
+		extra = f - LC_M;
+		memset(ctx->lc_bits, 0, sizeof(ctx->lc_bits));
+		if (extra)
+			ctx->lc_bits[LC_TOP / 64] = (uint64_t)p[i] <<
+						    (64 - extra);
+		f = extra;
+	}
+	ctx->lc_fill = f;
+}
+
+/* Counts the serial_m-bit patterns that end in every bit of p */
+static void update_serial(sts_ctx_t *ctx, const unsigned char *p,
+			  size_t len, uint64_t done)
+{
+	uint32_t *counts = ctx->counts, w = ctx->window;
+	uint32_t mask = (1U << ctx->serial_m) - 1;
+	unsigned int j;
+	size_t i = 0;
+
+	/* the first patterns end past the head */
+	for (; (i < len) && (done + i < 2); i++) {
+		ctx->head = (ctx->head << 8) | p[i];
+		w = (w << 8) | p[i];
+		for (j = 0; j < 8; j++)
+			if (8 * (done + i) + j + 1 >= ctx->serial_m)
+				counts[(w >> (7 - j)) & mask]++;
+	}
+	for (; i < len; i++) {
+		w = (w << 8) | p[i];
+		counts[(w >> 7) & mask]++;
+		counts[(w >> 6) & mask]++;
+		counts[(w >> 5) & mask]++;
+		counts[(w >> 4) & mask]++;
+		counts[(w >> 3) & mask]++;
+		counts[(w >> 2) & mask]++;
+		counts[(w >> 1) & mask]++;
+		counts[w & mask]++;
+	}
+	ctx->window = w;
+}
+
+/* Cumulative sums: the sum, and its extremes, a byte at a time */
+static void update_cusum(sts_ctx_t *ctx, const unsigned char *p,
+			 size_t len)
+{
+	int64_t sum = ctx->sum, max = ctx->max, min = ctx->min;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (sum + cusum_tab[p[i]].max > max)
+			max = sum + cusum_tab[p[i]].max;
+		if (sum + cusum_tab[p[i]].min < min)
+			min = sum + cusum_tab[p[i]].min;
+		sum += cusum_tab[p[i]].sum;
+	}
+	ctx->sum = sum;
+	ctx->max = max;
+	ctx->min = min;
+}
+
+
+/*
+ * P-values
+ */
+
+#define MACHEP		1.11022302462515654042e-16
+#define MAXLOG		7.09782712893383996843e2
+#define BIG		4.503599627370496e15
+#define BIGINV		2.22044604925031308085e-16
+
+/* Regularized lower incomplete gamma function, by its power series */
+static double igam(double a, double x)
+{
+	double ax, r, c, sum;
+
+	ax = a * log(x) - x - lgamma(a);
+	if (ax < -MAXLOG)
+		return 0.0;
+	ax = exp(ax);
+
+	r = a;
+	c = sum = 1.0;
+	do {
+		r += 1.0;
+		c *= x / r;
+		sum += c;
+	} while (c / sum > MACHEP);
+
+	return sum * ax / a;
+}
+
+/* Its complement, by a continued fraction where the series is slow */
+static double igamc(double a, double x)
+{
+	double ans, ax, c, yc, r, t, y, z;
+	double pk, pkm1, pkm2, qk, qkm1, qkm2;
+
+	if ((x <= 0.0) || (a <= 0.0))
+		return 1.0;
+	if ((x < 1.0) || (x < a))
+		return 1.0 - igam(a, x);
+
+	ax = a * log(x) - x - lgamma(a);
+	if (ax < -MAXLOG)
+		return 0.0;
+	ax = exp(ax);
+
+	y = 1.0 - a;
+	z = x + y + 1.0;
+	c = 0.0;
+	pkm2 = 1.0;
+	qkm2 = x;
+	pkm1 = x + 1.0;
+	qkm1 = z * x;
+	ans = pkm1 / qkm1;
+	do {
+		c += 1.0;
+		y += 1.0;
+		z += 2.0;
+		yc = y * c;
+		pk = pkm1 * z - pkm2 * yc;
+		qk = qkm1 * z - qkm2 * yc;
+		if (qk != 0.0) {
+			r = pk / qk;
+			t = fabs((ans - r) / r);
+			ans = r;
+		} else {
+			t = 1.0;
+		}
+		pkm2 = pkm1;
+		pkm1 = pk;
+		qkm2 = qkm1;
+		qkm1 = qk;
+		if (fabs(pk) > BIG) {
+			pkm2 *= BIGINV;
+			pkm1 *= BIGINV;
+			qkm2 *= BIGINV;
+			qkm1 *= BIGINV;
+		}
+	} while (t > MACHEP);
+
+	return ans * ax;
+}
+
+/* Standard normal distribution */
+static double normal(double x)
+{
+	return 0.5 * erfc(-x / M_SQRT2);
+}
+
+static double p_frequency(const sts_ctx_t *ctx, double n)
+{
+	return erfc(fabs(2.0 * ctx->ones - n) / sqrt(n) / M_SQRT2);
+}
+
+static double p_block_frequency(const sts_ctx_t *ctx)
+{
+	double chi2 = (double)ctx->bf_squares / BLOCK_FREQUENCY_M;
+
+	return igamc(ctx->bf_blocks / 2.0, chi2 / 2.0);
+}
+
+/* The runs test is not run on sequences that fail the frequency one */
+static double p_runs(const sts_ctx_t *ctx, double n)
+{
+	double pi = ctx->ones / n, v = ctx->changes + 1.0;
+
+	if (fabs(pi - 0.5) >= 2.0 / sqrt(n))
+		return 0.0;
+	return erfc(fabs(v - 2.0 * n * pi * (1.0 - pi)) /
+		    (2.0 * sqrt(2.0 * n) * pi * (1.0 - pi)));
+}
+
+static double p_longest_run(const sts_ctx_t *ctx)
+{
+	const struct longest_run_params *lr = ctx->lr;
+	double chi2 = 0.0, e;
+	unsigned int i;
+
+	for (i = 0; i <= lr->k; i++) {
+		e = ctx->lr_blocks * lr->pi[i];
+		chi2 += (ctx->lr_classes[i] - e) * (ctx->lr_classes[i] - e) /
+			e;
+	}
+	return igamc(lr->k / 2.0, chi2 / 2.0);
+}
+
+static double p_rank(const sts_ctx_t *ctx)
+{
+	double chi2 = 0.0, e;
+	unsigned int i;
+
+	for (i = 0; i < 3; i++) {
+		e = ctx->rk_blocks * rank_pi[i];
+		chi2 += (ctx->rk_classes[i] - e) * (ctx->rk_classes[i] - e) /
+			e;
+	}
+	return igamc(1.0, chi2 / 2.0);
+}
+
+static double p_linear_complexity(const sts_ctx_t *ctx)
+{
+	double chi2 = 0.0, e;
+	unsigned int i;
+
+	for (i = 0; i < 7; i++) {
+		e = ctx->lc_blocks * lc_pi[i];
+		chi2 += (ctx->lc_classes[i] - e) * (ctx->lc_classes[i] - e) /
+			e;
+	}
+	return igamc(3.0, chi2 / 2.0);
+}
+
+/*
+ * Serial and approximate entropy: the counts of the m-bit patterns are
+ * folded into those of the shorter ones, the (m-1)-bit pattern w being
+ * counted as w0 and w1
+ */
+static void p_serial(sts_ctx_t *ctx, double n, double *pvalues)
+{
+	unsigned int m = ctx->serial_m, k, i;
+	double psi2[3] = { 0.0, 0.0, 0.0 }, phi[2] = { 0.0, 0.0 }, c;
+	uint32_t w;
+
+	/* the patterns that wrap around the end of the sequence */
+	for (w = ctx->window, i = 0; i < m - 1; i++) {
+		w = (w << 1) | ((ctx->head >> (15 - i)) & 1);
+		ctx->counts[w & ((1U << m) - 1)]++;
+	}
+
+	for (i = 0; i < (1U << m); i++)
+		psi2[0] += (double)ctx->counts[i] * ctx->counts[i];
+	for (i = 0; i < (1U << (m - 1)); i++)
+		ctx->fold[i] = (double)ctx->counts[2 * i] +
+			       ctx->counts[2 * i + 1];
+	for (k = m - 1; k >= ctx->apen_m; k--) {
+		if (k >= m - 2)
+			for (i = 0; i < (1U << k); i++)
+				psi2[m - k] += ctx->fold[i] * ctx->fold[i];
+		if (k <= ctx->apen_m + 1)
+			for (i = 0; i < (1U << k); i++) {
+				c = ctx->fold[i];
+				if (c > 0.0)
+					phi[k - ctx->apen_m] +=
+						c / n * log(c / n);
+			}
+		for (i = 0; i < (1U << (k - 1)); i++)
+			ctx->fold[i] = ctx->fold[2 * i] + ctx->fold[2 * i + 1];
+	}
+	for (k = 0; k < 3; k++)
+		psi2[k] = psi2[k] * ldexp(1.0, m - k) / n - n;
+
+	pvalues[STS_P_SERIAL_1] = igamc(ldexp(1.0, m - 2),
+					(psi2[0] - psi2[1]) / 2.0);
+	pvalues[STS_P_SERIAL_2] = igamc(ldexp(1.0, m - 3),
+				(psi2[0] - 2.0 * psi2[1] + psi2[2]) / 2.0);
+	pvalues[STS_P_APPROXIMATE_ENTROPY] = igamc(ldexp(1.0, ctx->apen_m - 1),
+		n * (M_LN2 - (phi[0] - phi[1])));
+}
+
+/* The largest excursion z of a random walk of n steps */
+static double p_cusum(int64_t n, int64_t z)
+{
+	double sum1 = 0.0, sum2 = 0.0, sn = sqrt(n);
+	int64_t k;
+
+	/* bounds truncated as in the reference implementation */
+	for (k = (-n / z + 1) / 4; k <= (n / z - 1) / 4; k++)
+		sum1 += normal((4 * k + 1) * z / sn) -
+			normal((4 * k - 1) * z / sn);
+	for (k = (-n / z - 3) / 4; k <= (n / z - 1) / 4; k++)
+		sum2 += normal((4 * k + 3) * z / sn) -
+			normal((4 * k + 1) * z / sn);
+	return 1.0 - sum1 + sum2;
+}
+
+/* The backward walk starts at the end: its sums are sum - S_k */
+static void p_cusums(const sts_ctx_t *ctx, int64_t n, double *pvalues)
+{
+	int64_t fwd, bwd;
+
+	fwd = (ctx->max > -ctx->min) ? ctx->max : -ctx->min;
+	bwd = (ctx->sum - ctx->min > ctx->max - ctx->sum) ?
+	      ctx->sum - ctx->min : ctx->max - ctx->sum;
+	pvalues[STS_P_CUSUM_FORWARD] = p_cusum(n, fwd);
+	pvalues[STS_P_CUSUM_BACKWARD] = p_cusum(n, bwd);
+}
+
+static void sts_finish(sts_ctx_t *ctx, double *pvalues)
+{
+	double n = ctx->length * 8.0;
+	unsigned int t = ctx->tests;
+	int i;
+
+	for (i = 0; i < N_STS_PVALUES; i++)
+		pvalues[i] = 1.0;
+	if (t & (1 << STS_FREQUENCY))
+		pvalues[STS_P_FREQUENCY] = p_frequency(ctx, n);
+	if (t & (1 << STS_BLOCK_FREQUENCY))
+		pvalues[STS_P_BLOCK_FREQUENCY] = p_block_frequency(ctx);
+	if (t & (1 << STS_RUNS))
+		pvalues[STS_P_RUNS] = p_runs(ctx, n);
+	if (t & (1 << STS_LONGEST_RUN))
+		pvalues[STS_P_LONGEST_RUN] = p_longest_run(ctx);
+	if (t & (1 << STS_RANK))
+		pvalues[STS_P_RANK] = p_rank(ctx);
+	if (t & (1 << STS_LINEAR_COMPLEXITY))
+		pvalues[STS_P_LINEAR_COMPLEXITY] = p_linear_complexity(ctx);
+	if (t & ((1 << STS_SERIAL) | (1 << STS_APPROXIMATE_ENTROPY)))
+		p_serial(ctx, n, pvalues);
+	if (!(t & (1 << STS_SERIAL)))
+		pvalues[STS_P_SERIAL_1] = pvalues[STS_P_SERIAL_2] = 1.0;
+	if (!(t & (1 << STS_APPROXIMATE_ENTROPY)))
+		pvalues[STS_P_APPROXIMATE_ENTROPY] = 1.0;
+	if (t & (1 << STS_CUSUM))
+		p_cusums(ctx, ctx->length * 8, pvalues);
+}
+
+int sts_update(sts_ctx_t *ctx, const void *buf, size_t len,
+	       double *pvalues)
+{
+	const unsigned char *p = buf;
+	unsigned int t;
+	size_t n;
+	int seqs = 0;
+
+	if (!ctx) return -1;
+	if (!buf) return -1;
+	if (!pvalues) return -1;
+	t = ctx->tests;
+
+	while (len) {
+		n = ctx->length - ctx->done;
+		if (n > len)
+			n = len;
+		/* the first bit has no bit before it */
+		if (!ctx->done)
+			ctx->last = p[0] >> 7;
+
+		if (!ctx->skip) {
+			if (t & ((1 << STS_FREQUENCY) | (1 << STS_RUNS)))
+				update_frequency(ctx, p, n);
+			if (t & (1 << STS_BLOCK_FREQUENCY))
+				update_block_frequency(ctx, p, n);
+			if (t & (1 << STS_LONGEST_RUN))
+				update_longest_run(ctx, p, n);
+			if (t & (1 << STS_RANK))
+				update_rank(ctx, p, n);
+			if (t & (1 << STS_LINEAR_COMPLEXITY))
+				update_linear_complexity(ctx, p, n);
+			if (t & ((1 << STS_SERIAL) |
+				 (1 << STS_APPROXIMATE_ENTROPY)))
+				update_serial(ctx, p, n, ctx->done);
+			if (t & (1 << STS_CUSUM))
+				update_cusum(ctx, p, n);
+		}
+
+		ctx->done += n;
+		p += n;
+		len -= n;
+		if (ctx->done < ctx->length)
+			continue;
+		if (!ctx->skip) {
+			sts_finish(ctx, pvalues + seqs++ * N_STS_PVALUES);
+			sts_restart(ctx);
+		} else {
+			ctx->done = 0;
+		}
+		if (++ctx->skip >= ctx->sample)
+			ctx->skip = 0;
+	}
+
+	return seqs;
+}
+
+unsigned int sts_bin(double pvalue)
+{
+	unsigned int bin = pvalue * STS_BINS;
+
+	return (bin < STS_BINS) ? bin : STS_BINS - 1;
+}
+
+double sts_uniformity(const uint64_t *bins)
+{
+	double s = 0.0, chi2 = 0.0, e;
+	int i;
+
+	for (i = 0; i < STS_BINS; i++)
+		s += bins[i];
+	if (s == 0.0)
+		return 1.0;
+	e = s / STS_BINS;
+	for (i = 0; i < STS_BINS; i++)
+		chi2 += (bins[i] - e) * (bins[i] - e) / e;
+	return igamc((STS_BINS - 1) / 2.0, chi2 / 2.0);
+}
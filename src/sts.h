@@ -0,0 +1,139 @@
+/*
+ * sts.h -- NIST SP 800-22 statistical tests
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef STS__H
+#define STS__H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Tests of NIST SP 800-22 rev. 1a, run on back-to-back sequences of n
+ * bits of a stream, taken most significant bit first.  The stream may
+ * be given in pieces of any size; a sequence is tested as it goes by,
+ * and gives its P-values once it is complete.
+ *
+ * The parameters are the ones SP 800-22 recommends for n: blocks of
+ * 128 bits for the block frequency test, of 8, 128 or 10^4 bits for the
+ * longest run test, 32x32 matrices for the rank test, blocks of 500
+ * bits for linear complexity, and m = min(16, log2(n) - 3) for the
+ * serial test, min(10, log2(n) - 6) for approximate entropy (log2
+ * rounded down).
+ */
+#define STS_MIN_LENGTH		20000
+#define STS_MAX_LENGTH		(1ULL << 31)
+#define STS_ALPHA		0.01	/* Significance level */
+
+/* Tests, bit (1 << index) in masks */
+enum {
+	STS_FREQUENCY,			/* 2.1 */
+	STS_BLOCK_FREQUENCY,		/* 2.2 */
+	STS_RUNS,			/* 2.3 */
+	STS_LONGEST_RUN,		/* 2.4 */
+	STS_RANK,			/* 2.5 */
+	STS_LINEAR_COMPLEXITY,		/* 2.10 */
+	STS_SERIAL,			/* 2.11 */
+	STS_APPROXIMATE_ENTROPY,	/* 2.12 */
+	STS_CUSUM,			/* 2.13 */
+	N_STS_TESTS
+};
+
+extern const char *sts_test_keys[N_STS_TESTS];
+
+/*
+ * Shortest sequences each test may run on, 0 for any: SP 800-22 wants
+ * at least 38 matrices for the rank test, and 200 blocks for linear
+ * complexity.  The latter still fails somewhat more than 1% of good
+ * sequences until the 10^6 bits SP 800-22 recommends, where the
+ * default tests start running it.
+ */
+#define STS_RANK_MIN_LENGTH			(38 * 32 * 32)
+#define STS_LINEAR_COMPLEXITY_MIN_LENGTH	(200 * 500)
+#define STS_LINEAR_COMPLEXITY_LENGTH		1000000
+
+extern const uint64_t sts_test_min_length[N_STS_TESTS];
+
+/* The tests run by default on sequences of length bits */
+extern unsigned int sts_tests_default(uint64_t length);
+
+/* P-values of a sequence, a test may have more than one */
+enum {
+	STS_P_FREQUENCY,
+	STS_P_BLOCK_FREQUENCY,
+	STS_P_RUNS,
+	STS_P_LONGEST_RUN,
+	STS_P_RANK,
+	STS_P_LINEAR_COMPLEXITY,
+	STS_P_SERIAL_1,
+	STS_P_SERIAL_2,
+	STS_P_APPROXIMATE_ENTROPY,
+	STS_P_CUSUM_FORWARD,
+	STS_P_CUSUM_BACKWARD,
+	N_STS_PVALUES
+};
+
+struct sts_pvalue {
+	const char *key;		/* For structured stats */
+	const char *name;		/* For humans */
+	unsigned int test;		/* Index of its test */
+};
+
+extern const struct sts_pvalue sts_pvalues[N_STS_PVALUES];
+
+/*
+ * Returns the mask of the tests in list, comma-separated keys of
+ * sts_test_keys[], or 0 if it has an unknown key or none at all
+ */
+extern unsigned int sts_tests_parse(const char *list);
+
+/*
+ * A context running the tests in mask on sequences of length bits, a
+ * multiple of 8 from STS_MIN_LENGTH to STS_MAX_LENGTH, testing only one
+ * sequence in sample, the first one, and skipping the others.  Returns
+ * NULL with errno set, EINVAL if length, mask or sample is out of range,
+ * or if mask has a test that needs sequences longer than length.
+ */
+typedef struct sts_ctx sts_ctx_t;
+
+extern sts_ctx_t *sts_new(uint64_t length, unsigned int mask,
+			  unsigned int sample);
+extern void sts_free(sts_ctx_t *ctx);
+
+/*
+ *  Runs the tests on len more bytes of buf, storing the P-values of
+ *  every sequence tested in pvalues[], N_STS_PVALUES of them per
+ *  sequence, which must have room for len * 8 / length + 1 sequences.
+ *  The P-values of tests not run are 1.
+ *
+ *  This function returns the number of sequences tested, or -1 if
+ *  ctx, buf or pvalues is NULL.
+ */
+extern int sts_update(sts_ctx_t *ctx, const void *buf, size_t len,
+		      double *pvalues);
+
+/*
+ * P-values are spread over STS_BINS bins of equal width.  Returns the
+ * P-value of the chi-square test of the bins being equally likely, as
+ * SP 800-22 (4.2.2) checks the P-values of a test, or 1 if they are
+ * all empty.
+ */
+#define STS_BINS		10
+extern unsigned int sts_bin(double pvalue);
+extern double sts_uniformity(const uint64_t *bins);
+
+#endif /* STS__H */
@@ -0,0 +1,386 @@
+/*
+ * tests.c -- Registry of the tests run on blocks of input
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "fips.h"
+#include "health.h"
+#include "tests.h"
+
+const struct rng_test rng_tests[N_RNG_TESTS] = {
+	[RNG_TEST_MONOBIT] = {
+		"monobit", "FIPS 140-2(2001-10-10) Monobit",
+		FIPS_RNG_MONOBIT },
+	[RNG_TEST_POKER] = {
+		"poker", "FIPS 140-2(2001-10-10) Poker",
+		FIPS_RNG_POKER },
+	[RNG_TEST_RUNS] = {
+		"runs", "FIPS 140-2(2001-10-10) Runs",
+		FIPS_RNG_RUNS },
+	[RNG_TEST_LONGRUN] = {
+		"long_run", "FIPS 140-2(2001-10-10) Long run",
+		FIPS_RNG_LONGRUN },
+	[RNG_TEST_CONTINUOUS] = {
+		"continuous_run", "FIPS 140-2(2001-10-10) Continuous run",
+		FIPS_RNG_CONTINUOUS_RUN },
+	[RNG_TEST_RCT] = {
+		"rct", "SP 800-90B Repetition count",
+		1 << RNG_TEST_RCT },
+	[RNG_TEST_APT] = {
+		"apt", "SP 800-90B Adaptive proportion",
+		1 << RNG_TEST_APT },
+};
+
+unsigned int rng_tests_parse(const char *list)
+{
+	unsigned int tests = 0;
+	const char *p, *end;
+	size_t len;
+	int i;
+
+	for (p = list; *p; p = *end ? end + 1 : end) {
+		end = strchrnul(p, ',');
+		len = end - p;
+		for (i = 0; i < N_RNG_TESTS; i++)
+			if ((strlen(rng_tests[i].key) == len) &&
+			    !strncmp(p, rng_tests[i].key, len))
+				break;
+		if (i >= N_RNG_TESTS)
+			return 0;
+		tests |= rng_tests[i].mask;
+	}
+	return tests;
+}
+
+
+/*
+ * Engines
+ */
+
+/* FIPS 140-2 continuous run test alone */
+struct continuous_ctx {
+	fips_ctx_t fips;
+	int result;
+};
+
+static int continuous_init(void *ctx, const struct rng_test_params *params)
+{
+	struct continuous_ctx *c = ctx;
+
+	fips_init(&c->fips, params->last32);
+	return 0;
+}
+
+static void continuous_update(void *ctx, const void *block)
+{
+	struct continuous_ctx *c = ctx;
+
+	c->result = fips_run_continuous_test(&c->fips, block);
+}
+
+static int continuous_finalize(void *ctx, fips_block_stats_t *stats)
+{
+	(void)stats;
+	return ((struct continuous_ctx *)ctx)->result;
+}
+
+/* FIPS 140-2 monobit test alone */
+struct monobit_ctx {
+	int result;
+};
+
+static int monobit_init(void *ctx, const struct rng_test_params *params)
+{
+	(void)ctx;
+	(void)params;
+	return 0;
+}
+
+static void monobit_update(void *ctx, const void *block)
+{
+	((struct monobit_ctx *)ctx)->result = fips_run_monobit_test(block);
+}
+
+static int monobit_finalize(void *ctx, fips_block_stats_t *stats)
+{
+	(void)stats;
+	return ((struct monobit_ctx *)ctx)->result;
+}
+
+/* FIPS 140-2 poker test, and monobit on the way */
+struct poker_ctx {
+	fips_ctx_t fips;
+	int result;
+};
+
+static int poker_init(void *ctx, const struct rng_test_params *params)
+{
+	struct poker_ctx *c = ctx;
+
+	/* the last bit decides the spurious run, see fips_run_poker_test */
+	if (params->resume)
+		fips_resume(&c->fips, params->last32);
+	else
+		fips_init(&c->fips, params->last32);
+	return 0;
+}
+
+static void poker_update(void *ctx, const void *block)
+{
+	struct poker_ctx *c = ctx;
+
+	c->result = fips_run_poker_test(&c->fips, block);
+}
+
+static int poker_finalize(void *ctx, fips_block_stats_t *stats)
+{
+	(void)stats;
+	return ((struct poker_ctx *)ctx)->result;
+}
+
+/* SP 800-90B health tests, over the whole stream */
+struct health_engine_ctx {
+	health_ctx_t health;
+	int result;
+};
+
+static int health_engine_init(void *ctx,
+			      const struct rng_test_params *params)
+{
+	struct health_engine_ctx *c = ctx;
+
+	return health_init(&c->health, params->width,
+			   params->entropy ? params->entropy : params->width);
+}
+
+static void health_engine_update(void *ctx, const void *block)
+{
+	struct health_engine_ctx *c = ctx;
+	int r;
+
+	r = health_test(&c->health, block, FIPS_RNG_BUFFER_SIZE);
+	c->result = ((r & HEALTH_RCT) ? rng_tests[RNG_TEST_RCT].mask : 0) |
+		    ((r & HEALTH_APT) ? rng_tests[RNG_TEST_APT].mask : 0);
+}
+
+static int health_engine_finalize(void *ctx, fips_block_stats_t *stats)
+{
+	(void)stats;
+	return ((struct health_engine_ctx *)ctx)->result;
+}
+
+/* The whole FIPS 140-2 battery, continuous run test included */
+struct fips_engine_ctx {
+	fips_ctx_t fips;
+	int result;
+	fips_block_stats_t stats;
+};
+
+static int fips_engine_init(void *ctx, const struct rng_test_params *params)
+{
+	struct fips_engine_ctx *c = ctx;
+
+	/* the bootstrap bits don't set the last bit, see fips_init */
+	if (params->resume)
+		fips_resume(&c->fips, params->last32);
+	else
+		fips_init(&c->fips, params->last32);
+	return 0;
+}
+
+static void fips_engine_update(void *ctx, const void *block)
+{
+	struct fips_engine_ctx *c = ctx;
+
+	c->result = fips_run_rng_test_stats(&c->fips, block, &c->stats);
+}
+
+static int fips_engine_finalize(void *ctx, fips_block_stats_t *stats)
+{
+	struct fips_engine_ctx *c = ctx;
+
+	if (stats)
+		*stats = c->stats;
+	return c->result;
+}
+
+static void fips_engine_run(void *ctx, const void *buf, unsigned int nblocks,
+			    int *results, fips_block_stats_t *stats)
+{
+	struct fips_engine_ctx *c = ctx;
+
+	fips_run_rng_test_batch(&c->fips, buf, nblocks, results, stats);
+}
+
+const struct rng_test_engine rng_test_engines[N_RNG_TEST_ENGINES] = {
+	{ "continuous", FIPS_RNG_CONTINUOUS_RUN, 0,
+	  sizeof(struct continuous_ctx),
+	  continuous_init, continuous_update, continuous_finalize, NULL },
+	{ "monobit", FIPS_RNG_MONOBIT, 0,
+	  sizeof(struct monobit_ctx),
+	  monobit_init, monobit_update, monobit_finalize, NULL },
+	{ "poker", FIPS_RNG_MONOBIT | FIPS_RNG_POKER, 0,
+	  sizeof(struct poker_ctx),
+	  poker_init, poker_update, poker_finalize, NULL },
+	{ "health", RNG_TESTS_HEALTH, RNG_ENGINE_ORDERED,
+	  sizeof(struct health_engine_ctx),
+	  health_engine_init, health_engine_update, health_engine_finalize,
+	  NULL },
+	{ "fips", RNG_TESTS_FIPS, 0,
+	  sizeof(struct fips_engine_ctx),
+	  fips_engine_init, fips_engine_update, fips_engine_finalize,
+	  fips_engine_run },
+};
+
+/*
+ * An engine is needed for the tests no cheaper engine runs.  A needed
+ * engine is then dropped if dearer ones run all its tests anyway.
+ */
+unsigned int rng_test_plan(unsigned int tests)
+{
+	unsigned int engines = 0, cheaper = 0, dearer = 0;
+	int i;
+
+	for (i = 0; i < N_RNG_TEST_ENGINES; i++) {
+		if (tests & rng_test_engines[i].tests & ~cheaper)
+			engines |= 1 << i;
+		cheaper |= rng_test_engines[i].tests;
+	}
+	for (i = N_RNG_TEST_ENGINES - 1; i >= 0; i--) {
+		if (!(engines & (1 << i)))
+			continue;
+		if (!(tests & rng_test_engines[i].tests & ~dearer))
+			engines &= ~(1 << i);
+		else
+			dearer |= rng_test_engines[i].tests;
+	}
+	return engines;
+}
+
+
+/*
+ * Sets of engines
+ */
+struct rng_test_set {
+	unsigned int tests;
+	unsigned int count;
+	const struct rng_test_engine *engine[N_RNG_TEST_ENGINES];
+	void *ctx[N_RNG_TEST_ENGINES];
+};
+
+rng_test_set_t *rng_test_set_new(unsigned int tests, unsigned int engines,
+				 const struct rng_test_params *params)
+{
+	rng_test_set_t *set;
+	int pass, i;
+
+	set = calloc(1, sizeof(*set));
+	if (!set)
+		return NULL;
+	set->tests = tests;
+	/* the engine that runs whole batches first, see rng_test_set_run */
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < N_RNG_TEST_ENGINES; i++) {
+			if (!(engines & (1 << i)))
+				continue;
+			if ((rng_test_engines[i].run == NULL) != pass)
+				continue;
+			set->engine[set->count] = &rng_test_engines[i];
+			set->ctx[set->count] =
+				calloc(1, rng_test_engines[i].ctx_size);
+			if (!set->ctx[set->count++]) {
+				rng_test_set_free(set);
+				errno = ENOMEM;
+				return NULL;
+			}
+		}
+	}
+	if (rng_test_set_init(set, params)) {
+		rng_test_set_free(set);
+		errno = EINVAL;
+		return NULL;
+	}
+	return set;
+}
+
+void rng_test_set_free(rng_test_set_t *set)
+{
+	unsigned int i;
+
+	if (!set)
+		return;
+	for (i = 0; i < set->count; i++)
+		free(set->ctx[i]);
+	free(set);
+}
+
+int rng_test_set_init(rng_test_set_t *set,
+		      const struct rng_test_params *params)
+{
+	unsigned int i;
+
+	if (!set) return -1;
+	if (!params) return -1;
+
+	for (i = 0; i < set->count; i++)
+		if (set->engine[i]->init(set->ctx[i], params))
+			return -1;
+	return 0;
+}
+
+int rng_test_set_run(rng_test_set_t *set, const void *buf,
+		     unsigned int nblocks, int *results,
+		     fips_block_stats_t *stats)
+{
+	const unsigned char *block;
+	unsigned int i, j = 0;
+	int failed = 0;
+
+	if (!set) return -1;
+	if (!buf) return -1;
+	if (!results) return -1;
+	block = (const unsigned char *)buf;
+
+	/* a batch engine stores the results, the others add to them */
+	if (set->count && set->engine[0]->run) {
+		set->engine[0]->run(set->ctx[0], buf, nblocks, results, stats);
+		j = 1;
+	} else
+		memset(results, 0, nblocks * sizeof(*results));
+
+	for (i = 0; i < nblocks; i++, block += FIPS_RNG_BUFFER_SIZE) {
+		unsigned int k;
+
+		for (k = j; k < set->count; k++) {
+			set->engine[k]->update(set->ctx[k], block);
+			results[i] |= set->engine[k]->finalize(set->ctx[k],
+					stats ? &stats[i] : NULL);
+		}
+		results[i] &= set->tests;
+		if (results[i])
+			failed++;
+	}
+
+	return failed;
+}
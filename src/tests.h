@@ -0,0 +1,140 @@
+/*
+ * tests.h -- Registry of the tests run on blocks of input
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef TESTS__H
+#define TESTS__H
+
+#include <stddef.h>
+
+#include "fips.h"
+
+/*
+ * Every test has an index in rng_tests[], and fails a block with bit
+ * (1 << index) set in its result.  The FIPS 140-2 tests come first,
+ * in the order of fips_test_names[], so that their bits are the
+ * FIPS_RNG_* ones.
+ */
+enum {
+	RNG_TEST_MONOBIT,
+	RNG_TEST_POKER,
+	RNG_TEST_RUNS,
+	RNG_TEST_LONGRUN,
+	RNG_TEST_CONTINUOUS,
+	RNG_TEST_RCT,
+	RNG_TEST_APT,
+	N_RNG_TESTS
+};
+
+#define RNG_TESTS_FIPS		0x001f	/* FIPS 140-2 */
+#define RNG_TESTS_FIPS_BLOCK	0x000f	/* FIPS 140-2, on a block alone */
+#define RNG_TESTS_HEALTH	0x0060	/* SP 800-90B health tests */
+
+struct rng_test {
+	const char *key;		/* For --tests and structured stats */
+	const char *name;		/* For humans */
+	unsigned int mask;
+};
+
+extern const struct rng_test rng_tests[N_RNG_TESTS];
+
+/*
+ * Returns the mask of the tests in list, comma-separated keys, or 0 if
+ * it has an unknown key or none at all
+ */
+extern unsigned int rng_tests_parse(const char *list);
+
+/* What test engines are started with */
+struct rng_test_params {
+	unsigned int last32;		/* 32 bits of input before the block */
+	int resume;			/* last32 ends a tested block, see
+					   fips_resume() */
+	unsigned int width;		/* Health tests: bits per sample */
+	double entropy;			/* Health tests: min-entropy per
+					   sample, 0 for width */
+};
+
+/*
+ * A test engine runs one or more tests.  init() starts it, returning
+ * 0 or -1 if params are out of range.  Then for every block,
+ * update() tests it and finalize() returns the mask of the tests that
+ * failed, storing the raw statistics of the block in stats if the
+ * engine has them and stats isn't NULL.
+ *
+ * An engine can also test a whole batch of back-to-back blocks at
+ * once with run(), storing their results and statistics as
+ * fips_run_rng_test_batch() does.  A set runs it before its other
+ * engines, which add their results to the ones it stored; at most one
+ * engine of a set may have run().
+ *
+ * RNG_ENGINE_ORDERED engines must see every block, in input order.
+ * The others can be started anew on any block, given the 32 bits of
+ * input that come before it.
+ */
+#define RNG_ENGINE_ORDERED	0x0001
+
+struct rng_test_engine {
+	const char *name;
+	unsigned int tests;		/* Tests it runs */
+	unsigned int flags;
+	size_t ctx_size;
+	int (*init)(void *ctx, const struct rng_test_params *params);
+	void (*update)(void *ctx, const void *block);
+	int (*finalize)(void *ctx, fips_block_stats_t *stats);
+	void (*run)(void *ctx, const void *buf, unsigned int nblocks,
+		    int *results, fips_block_stats_t *stats);
+};
+
+/* Engines, cheapest first */
+#define N_RNG_TEST_ENGINES 5
+extern const struct rng_test_engine rng_test_engines[N_RNG_TEST_ENGINES];
+
+/*
+ * Picks the engines to run the tests in mask, as cheaply as possible.
+ * Returns a mask of engines, bit n for rng_test_engines[n].
+ */
+extern unsigned int rng_test_plan(unsigned int tests);
+
+/*
+ * A set of engines, with their contexts, running the given tests.
+ * Returns NULL with errno set, EINVAL if an engine refused params.
+ */
+typedef struct rng_test_set rng_test_set_t;
+
+extern rng_test_set_t *rng_test_set_new(unsigned int tests,
+					unsigned int engines,
+					const struct rng_test_params *params);
+extern void rng_test_set_free(rng_test_set_t *set);
+
+/* Starts every engine of the set again.  Returns 0, or -1. */
+extern int rng_test_set_init(rng_test_set_t *set,
+			     const struct rng_test_params *params);
+
+/*
+ *  Runs the set on nblocks back-to-back blocks of size
+ *  FIPS_RNG_BUFFER_SIZE in buf, storing the result of every block in
+ *  results[] (the failed tests of the set), and its raw statistics in
+ *  stats[] unless stats is NULL.
+ *
+ *  This function returns the number of blocks that failed, or -1 if
+ *  set, buf or results is NULL.
+ */
+extern int rng_test_set_run(rng_test_set_t *set, const void *buf,
+			    unsigned int nblocks, int *results,
+			    fips_block_stats_t *stats);
+
+#endif /* TESTS__H */
@@ -0,0 +1,224 @@
+/*
+ * uring.c -- Minimal io_uring interface, without liburing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define _GNU_SOURCE
+
+#include "rng-tools-config.h"
+
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include <assert.h>
+
+/* Pointers into the rings the kernel shares with us */
+struct rng_uring {
+	int fd;
+
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int sq_entries;
+	unsigned int sq_queued;		/* Queued, not submitted yet */
+
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+};
+
+#define URING_LOAD(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define URING_STORE(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+struct rng_uring *rng_uring_new(unsigned int entries)
+{
+	struct io_uring_params p;
+	struct rng_uring *ring;
+	void *map;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (fd < 0)
+		return NULL;
+	if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+		close(fd);
+		errno = ENOSYS;
+		return NULL;
+	}
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring) {
+		close(fd);
+		errno = ENOMEM;
+		return NULL;
+	}
+	ring->fd = fd;
+	ring->sq_entries = p.sq_entries;
+	ring->sq_ring_size = p.sq_off.array +
+			     p.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = p.cq_off.cqes +
+			     p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	/* newer kernels map both rings at once */
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = 0;
+	}
+
+	map = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (map == MAP_FAILED)
+		goto fail;
+	ring->sq_ring = map;
+
+	if (ring->cq_ring_size) {
+		map = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (map == MAP_FAILED)
+			goto fail;
+		ring->cq_ring = map;
+	} else {
+		ring->cq_ring = ring->sq_ring;
+	}
+
+	map = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (map == MAP_FAILED)
+		goto fail;
+	ring->sqes = map;
+
+	ring->sq_head = (void *)((char *)ring->sq_ring + p.sq_off.head);
+	ring->sq_tail = (void *)((char *)ring->sq_ring + p.sq_off.tail);
+	ring->sq_mask = (void *)((char *)ring->sq_ring + p.sq_off.ring_mask);
+	ring->sq_array = (void *)((char *)ring->sq_ring + p.sq_off.array);
+	ring->cq_head = (void *)((char *)ring->cq_ring + p.cq_off.head);
+	ring->cq_tail = (void *)((char *)ring->cq_ring + p.cq_off.tail);
+	ring->cq_mask = (void *)((char *)ring->cq_ring + p.cq_off.ring_mask);
+	ring->cqes = (void *)((char *)ring->cq_ring + p.cq_off.cqes);
+	return ring;
+
+fail:
+	rng_uring_free(ring);
+	errno = ENOMEM;
+	return NULL;
+}
+
+void rng_uring_free(struct rng_uring *ring)
+{
+	if (!ring)
+		return;
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring && (ring->cq_ring != ring->sq_ring))
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+	free(ring);
+}
+
+static int uring_queue(struct rng_uring *ring, int op, int fd,
+		       const struct iovec *iov, unsigned int iovcnt,
+		       int64_t offset, uint64_t tag)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail, idx;
+
+	assert(ring != NULL && iov != NULL);
+
+	tail = *ring->sq_tail;
+	if (tail - URING_LOAD(ring->sq_head) >= ring->sq_entries)
+		return -1;
+
+	idx = tail & *ring->sq_mask;
+	sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->off = offset;
+	sqe->addr = (unsigned long)iov;
+	sqe->len = iovcnt;
+	sqe->user_data = tag;
+	ring->sq_array[idx] = idx;
+
+	URING_STORE(ring->sq_tail, tail + 1);
+	ring->sq_queued++;
+	return 0;
+}
+
+int rng_uring_readv(struct rng_uring *ring, int fd,
+		    const struct iovec *iov, unsigned int iovcnt,
+		    int64_t offset, uint64_t tag)
+{
+	return uring_queue(ring, IORING_OP_READV, fd, iov, iovcnt,
+			   offset, tag);
+}
+
+int rng_uring_writev(struct rng_uring *ring, int fd,
+		     const struct iovec *iov, unsigned int iovcnt,
+		     int64_t offset, uint64_t tag)
+{
+	return uring_queue(ring, IORING_OP_WRITEV, fd, iov, iovcnt,
+			   offset, tag);
+}
+
+int rng_uring_submit(struct rng_uring *ring, int wait)
+{
+	int r;
+
+	assert(ring != NULL);
+
+	r = syscall(__NR_io_uring_enter, ring->fd, ring->sq_queued,
+		    wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0,
+		    NULL, 0);
+	if (r < 0)
+		return -1;
+	ring->sq_queued -= r;
+	return 0;
+}
+
+int rng_uring_reap(struct rng_uring *ring, uint64_t *tag, int *res)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head;
+
+	assert(ring != NULL && tag != NULL && res != NULL);
+
+	head = *ring->cq_head;
+	if (head == URING_LOAD(ring->cq_tail))
+		return -1;
+	cqe = &ring->cqes[head & *ring->cq_mask];
+	*tag = cqe->user_data;
+	*res = cqe->res;
+	URING_STORE(ring->cq_head, head + 1);
+	return 0;
+}
+
+#endif /* HAVE_IO_URING */
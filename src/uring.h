@@ -0,0 +1,70 @@
+/*
+ * uring.h -- Minimal io_uring interface, without liburing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef URING__H
+#define URING__H
+
+/*
+ * Built only when asked for (make USE_IO_URING=1), and only on Linux.
+ * Without it, none of this exists and callers use plain syscalls.
+ */
+#if defined(__linux__) && (USE_IO_URING + 0)
+#define HAVE_IO_URING 1
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+struct rng_uring;
+
+/*
+ * Sets up a ring with room for at least entries requests.  Returns NULL
+ * (with errno set) if the kernel has no usable io_uring: it must accept
+ * -1 as "the current file position", which takes Linux 5.6.
+ */
+extern struct rng_uring *rng_uring_new(unsigned int entries);
+extern void rng_uring_free(struct rng_uring *ring);
+
+/*
+ * Queue a readv or writev on fd.  offset -1 reads or writes at the
+ * current file position.  iov must stay valid until the request
+ * completes.  tag comes back with the completion.  Return -1 if the
+ * submission queue is full.
+ */
+extern int rng_uring_readv(struct rng_uring *ring, int fd,
+			   const struct iovec *iov, unsigned int iovcnt,
+			   int64_t offset, uint64_t tag);
+extern int rng_uring_writev(struct rng_uring *ring, int fd,
+			    const struct iovec *iov, unsigned int iovcnt,
+			    int64_t offset, uint64_t tag);
+
+/*
+ * Submits everything queued, and waits for a completion if wait is
+ * non-zero.  Returns 0, or -1 with errno set (EINTR if a signal came
+ * while waiting).
+ */
+extern int rng_uring_submit(struct rng_uring *ring, int wait);
+
+/*
+ * Takes one completion off the ring: its tag, and the result of the
+ * request (a byte count, or -errno).  Returns -1 if there is none.
+ */
+extern int rng_uring_reap(struct rng_uring *ring, uint64_t *tag, int *res);
+
+#endif /* USE_IO_URING */
+
+#endif /* URING__H */
@@ -29,6 +29,9 @@
 #include <time.h>
 #include <sys/time.h>
 #include <sys/utsname.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
 
 #include "util.h"
 
@@ -48,6 +51,62 @@ uint64_t elapsed_time(struct timeval *start,
 	return llabs(diff);
 }
 
+int clock_tsc = 0;
+static double clock_ns_per_tick = 1.0;
+
+uint64_t clock_monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CLOCK_CALIBRATE_NS 2000000	/* Spin 2ms against the clock */
+
+/* The TSC is usable if it keeps a constant rate in all P/C-states */
+static int tsc_invariant(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) ||
+	    (eax < 0x80000007))
+		return 0;
+	__cpuid(0x80000007, eax, ebx, ecx, edx);
+	return (edx >> 8) & 1;
+}
+#endif
+
+void init_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	uint64_t t0, t1, c0, c1;
+
+	if (!tsc_invariant())
+		return;
+	t0 = clock_monotonic_ns();
+	c0 = __builtin_ia32_rdtsc();
+	do {
+		t1 = clock_monotonic_ns();
+		c1 = __builtin_ia32_rdtsc();
+	} while (t1 - t0 < CLOCK_CALIBRATE_NS);
+	if (c1 <= c0)
+		return;
+	clock_ns_per_tick = (double)(t1 - t0) / (c1 - c0);
+	clock_tsc = 1;
+#endif
+}
+
+uint64_t elapsed_ns(uint64_t start, uint64_t stop)
+{
+	if (stop < start)
+		return 0;
+	if (!clock_tsc)
+		return stop - start;
+	return (uint64_t)((stop - start) * clock_ns_per_tick);
+}
+
 /* Returns kernel support level */
 /* FIXME: track down safe 2.5 version */
 kernel_mode_t kernel_mode( void ) {
@@ -28,6 +28,27 @@
 extern uint64_t elapsed_time(struct timeval *start,
                               struct timeval *stop);
 
+/*
+ * Nanosecond clock.  Reads the TSC where it ticks at a constant rate
+ * (calibrated by init_clock()), clock_gettime(CLOCK_MONOTONIC) anywhere
+ * else.  Ticks are only good for differences: elapsed_ns() converts
+ * them to nanoseconds.  Call init_clock() before any threads start.
+ */
+extern void init_clock(void);
+extern uint64_t clock_monotonic_ns(void);
+extern uint64_t elapsed_ns(uint64_t start, uint64_t stop);
+
+extern int clock_tsc;			/* Ticks come from the TSC */
+
+static inline uint64_t clock_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	if (clock_tsc)
+		return __builtin_ia32_rdtsc();
+#endif
+	return clock_monotonic_ns();
+}
+
 typedef enum {
 	KERNEL_UNSUPPORTED,
 	KERNEL_LINUX_24,